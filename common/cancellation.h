@@ -0,0 +1,59 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <limits>
+
+// Cooperative cancellation of a search. The token is either cancelled
+// explicitly, or once its deadline passed. Long running loops (the searchers,
+// the task loop of the planner, the RRT and KOMO attempts) check it, and stop
+// at the next opportunity.
+class CancellationToken {
+public:
+  typedef std::chrono::steady_clock Clock;
+
+  // a budget of 0 removes the deadline
+  void set_time_budget(const double seconds) {
+    if (seconds <= 0) {
+      has_deadline = false;
+      return;
+    }
+    deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+                                  std::chrono::duration<double>(seconds));
+    has_deadline = true;
+  }
+
+  void cancel() { cancelled = true; }
+
+  void reset() {
+    cancelled = false;
+    has_deadline = false;
+  }
+
+  bool is_cancelled() const {
+    if (cancelled.load()) {
+      return true;
+    }
+    return has_deadline.load() && Clock::now() >= deadline;
+  }
+
+  // remaining time in seconds, infinity if there is no deadline
+  double get_remaining_time() const {
+    if (!has_deadline.load()) {
+      return std::numeric_limits<double>::infinity();
+    }
+    return std::chrono::duration<double>(deadline - Clock::now()).count();
+  }
+
+private:
+  std::atomic<bool> cancelled{false};
+  std::atomic<bool> has_deadline{false};
+  Clock::time_point deadline;
+};
+
+CancellationToken &get_cancellation_token() {
+  static CancellationToken token;
+  return token;
+}
+
+bool search_is_cancelled() { return get_cancellation_token().is_cancelled(); }
@@ -12,6 +12,80 @@ namespace manip{
     std::string output_path = "./out/";
 
     bool randomize_mod_switch_durations = false;
+
+    bool use_reachability_maps = false;
+    std::string reachability_map_path = "./in/reachability/";
+
+    // closed form inverse kinematics for top-down picks of the UR5, instead of
+    // solving the keyframes with KOMO. Changes the keyframes of UR5 scenes.
+    bool use_analytical_ik = false;
+
+    bool use_keyframe_library = false;
+    std::string keyframe_library_path = "./in/keyframe_library.json";
+
+    // number of candidate sequences that are scored with the lower bound before
+    // the best screening_top_k of them are planned. 0 disables the screening.
+    unsigned int screening_batch_size = 0;
+    unsigned int screening_top_k = 10;
+
+    // memoization of tasks that could not be planned
+    bool use_nogood_store = false;
+    unsigned int nogood_capacity = 10000;
+    unsigned int nogood_time_bucket_size = 20;
+    unsigned int nogood_aggregate_threshold = 3;
+
+    // interval in seconds between two progress records of a search
+    double progress_interval = 10.;
+
+    // parts of the single arm planner that can be disabled
+    bool attempt_komo = true;
+    bool shortcutting = true;
+    bool smoothing = false;
+    bool informed_sampling = true;
+
+    // number of workers of the searchers that run in parallel (greedy
+    // restarts, parallel tempering replicas). The planner reads the parameters
+    // from here, and draws from get_thread_rng(), but the rrt and the
+    // keyframe samplers of rai still share its global rnd. Runs with more than
+    // one worker are thus not reproducible.
+    unsigned int num_threads = 1;
+    // a restart of the greedy search is stopped if it did not improve for this
+    // many iterations
+    unsigned int greedy_stagnation_limit = 20;
+
+    // check shortcuts and planned paths continuously with conservative
+    // advancement instead of sampling them at a fixed resolution, and
+    // configurations that are held over several time steps as one interval
+    bool use_edge_checker = false;
+
+    // number of resolution levels of the smoother, each level doubles the
+    // number of timesteps. 1 smoothes at full resolution only.
+    unsigned int smoothing_levels = 3;
+
+    // reoptimize the complete plan after planning, with this many threads
+    bool reoptimize_plans = false;
+    unsigned int reoptimization_threads = 1;
+
+    // number of disjoint shortcuts that are checked at once, and the number of
+    // threads that check them. 1 shortcuts sequentially.
+    unsigned int shortcut_batch_size = 1;
+    unsigned int shortcut_threads = 1;
+
+    // number of threads that check the points of a path or plan
+    unsigned int validation_threads = 1;
+
+    // check the planned robot against a cached signed distance field of the
+    // static geometry, and only use fcl for it if the robot is close to it.
+    // Applies to the validation of planned paths and to the collision checks
+    // of the planner and the postprocessing, but not to the queries inside
+    // the rrt and komo.
+    bool use_static_sdf = false;
+    std::string static_sdf_cache_path = "./sdf_cache/";
+
+    // the searchers log the features and outcome of every planned sequence,
+    // which the surrogate model is trained on
+    bool log_surrogate_samples = false;
+    std::string surrogate_model_path = "";
   };
 };
 
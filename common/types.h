@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <Core/array.h>
@@ -194,6 +195,35 @@ struct RobotTaskPair {
   }
 };
 
+// 64 bit FNV-1a hash. Unlike std::hash, this is stable across runs and
+// platforms, which allows persisting it.
+uint64_t fnv1a_hash(const std::string &str,
+                    uint64_t h = 14695981039346656037ull) {
+  for (const char c : str) {
+    h ^= static_cast<unsigned char>(c);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+uint64_t fnv1a_hash(const uint64_t v, uint64_t h = 14695981039346656037ull) {
+  for (uint i = 0; i < 8; ++i) {
+    h ^= (v >> (8 * i)) & 0xff;
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+uint64_t hash_robot_task_pair(const RobotTaskPair &rtp) {
+  uint64_t h = fnv1a_hash(rtp.robots.size());
+  for (const auto &r : rtp.robots) {
+    h = fnv1a_hash(r.prefix, h);
+  }
+  h = fnv1a_hash(uint64_t(rtp.task.type), h);
+  h = fnv1a_hash(uint64_t(rtp.task.object), h);
+  return h;
+}
+
 template <> struct std::hash<RobotTaskPair> {
   std::size_t operator()(RobotTaskPair const &rtp) const {
     std::size_t seed = rtp.robots.size();
@@ -1,10 +1,28 @@
 #pragma once
 
+#include <cstring>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <random>
+#include <unordered_map>
 #include "types.h"
 
 #include <KOMO/komo.h>
 
+// rand() is not thread safe, and the planner runs on the workers of the
+// searchers. Every thread gets its own generator, seeded from rand() on first
+// use, i.e. single threaded runs stay reproducible with std::srand.
+std::mt19937 &get_thread_rng() {
+  static std::mutex m;
+  thread_local std::unique_ptr<std::mt19937> rng;
+  if (!rng) {
+    std::lock_guard<std::mutex> lock(m);
+    rng = std::make_unique<std::mt19937>(rand());
+  }
+  return *rng;
+}
+
 rai::Animation::AnimationPart make_animation_part(rai::Configuration &C,
                                                   const arr &path,
                                                   const FrameL &frames,
@@ -121,29 +139,142 @@ uintA get_cant_collide_pairs(const rai::Configuration &C) {
   return cantCollidePairs;
 }
 
-void setKomoToAnimation(KOMO &komo, const rai::Configuration &C,
-                        const rai::Animation &A, const arr &ts, int k = -1) {
-  CHECK_EQ(ts.d0, komo.timeSlices.d0 - komo.k_order, "wrong komo-size");
+// Frame states of a configuration with an animation applied. Only the frames
+// that are moved by the animation (the animated frames, and the frames
+// attached to them) are stored, all other frames keep the state they have in
+// the configuration. The states of a time step are computed on first access,
+// and are then reused, e.g. by all horizons of a KOMO problem, or all levels
+// of the smoothing.
+class AnimationFrameCache {
+public:
+  AnimationFrameCache(const rai::Configuration &C, const rai::Animation &_A)
+      : A(_A) {
+    Ccpy.copy(C);
+
+    std::vector<bool> is_moving(Ccpy.frames.N, false);
+    std::vector<rai::Frame *> stack;
+    for (const auto &part : A.A) {
+      for (const uint id : part.frameIDs) {
+        if (id < Ccpy.frames.N) {
+          stack.push_back(Ccpy.frames(id));
+        }
+      }
+    }
+    while (!stack.empty()) {
+      rai::Frame *f = stack.back();
+      stack.pop_back();
+      if (is_moving[f->ID]) {
+        continue;
+      }
+      is_moving[f->ID] = true;
+      for (auto *c : f->children) {
+        stack.push_back(c);
+      }
+    }
+
+    for (uint i = 0; i < Ccpy.frames.N; ++i) {
+      if (is_moving[i]) {
+        moving_frame_ids.append(i);
+        moving_frames.append(Ccpy.frames(i));
+      }
+    }
+  }
+
+  // IDs of the frames that the states are stored for
+  const uintA &get_moving_frame_ids() const { return moving_frame_ids; }
+
+  // states of the moving frames at time t, (moving frames x 7)
+  const arr &get_frame_state(const uint t) {
+    std::lock_guard<std::mutex> lock(m);
+    auto it = states.find(t);
+    if (it == states.end()) {
+      A.setToTime(Ccpy, t);
+      it = states.emplace(t, Ccpy.getFrameState(moving_frames)).first;
+    }
+    return it->second;
+  }
+
+  // states of the moving frames for the times t_start..t_end, in steps of one,
+  // as (T x moving frames x 7) tensor
+  arr get_frame_states(const uint t_start, const uint t_end) {
+    arr X(t_end - t_start + 1, moving_frame_ids.N, 7);
+    if (X.N == 0) {
+      return X;
+    }
+    for (uint t = t_start; t <= t_end; ++t) {
+      const arr &x = get_frame_state(t);
+      std::memcpy(&X(t - t_start, 0, 0), x.p, x.N * sizeof(double));
+    }
+    return X;
+  }
 
+private:
+  const rai::Animation &A;
   rai::Configuration Ccpy;
-  Ccpy.copy(C);
 
-  /*for (uint i=0; i<komo.k_order; ++i){
-    A.setToTime(Ccpy, ts(0));
+  uintA moving_frame_ids;
+  FrameL moving_frames;
 
-    const FrameL F = komo.timeSlices[i];
-    komo.pathConfig.setFrameState(Ccpy.getFrameState(), F);
-  }*/
+  std::mutex m;
+  std::unordered_map<uint, arr> states;
+};
+
+// Sets the time slices of komo to the animation at the times ts. Times are
+// truncated to full time steps.
+void setKomoToAnimation(KOMO &komo, AnimationFrameCache &cache,
+                        const arr &ts) {
+  CHECK_EQ(ts.d0, komo.timeSlices.d0 - komo.k_order, "wrong komo-size");
+
+  const uintA &ids = cache.get_moving_frame_ids();
+  if (ids.N == 0) {
+    return;
+  }
 
   for (uint i = 0; i < ts.d0; ++i) {
-    const uint t = ts(i);
-    A.setToTime(Ccpy, t);
+    const FrameL slice = komo.timeSlices[i + komo.k_order];
+
+    FrameL F;
+    F.resize(ids.N);
+    for (uint j = 0; j < ids.N; ++j) {
+      F(j) = slice(ids(j));
+    }
+    komo.pathConfig.setFrameState(cache.get_frame_state(uint(ts(i))), F);
+  }
+}
+
+void setKomoToAnimation(KOMO &komo, const rai::Configuration &C,
+                        const rai::Animation &A, const arr &ts, int k = -1) {
+  AnimationFrameCache cache(C, A);
+  setKomoToAnimation(komo, cache, ts);
+}
 
-    const FrameL F = komo.timeSlices[i + komo.k_order];
-    komo.pathConfig.setFrameState(Ccpy.getFrameState(), F);
+// Radius of a sphere around the origin of the frame that contains its shape.
+double get_bounding_radius(rai::Frame *f) {
+  if (!f->shape) {
+    return 0.;
   }
 
-  // komo.pathConfig.reset_q();
-  // komo.pathConfig.ensure_indexedJoints();
-  // komo.pathConfig.ensure_q();
+  const arr &size = f->shape->size;
+  switch (f->shape->type()) {
+  case rai::ST_box:
+  case rai::ST_ssBox:
+    return 0.5 * std::sqrt(size(0) * size(0) + size(1) * size(1) +
+                           size(2) * size(2));
+  case rai::ST_sphere:
+    return size(-1);
+  case rai::ST_cylinder:
+    return std::sqrt(0.25 * size(0) * size(0) + size(1) * size(1));
+  case rai::ST_capsule:
+    return 0.5 * size(0) + size(1);
+  default:
+    break;
+  }
+
+  // meshes, and everything that is approximated by a mesh
+  const arr &V = f->shape->mesh().V;
+  double radius = 0.;
+  for (uint i = 0; i < V.d0; ++i) {
+    radius = std::max(radius, length(V[i]));
+  }
+  return radius;
 }
@@ -31,9 +31,13 @@
 
 #include "searchers/annealing_searcher.h"
 #include "searchers/greedy_random_searcher.h"
+#include "searchers/mcts_searcher.h"
+#include "searchers/parallel_tempering_searcher.h"
 #include "searchers/random_searcher.h"
 #include "searchers/sequencing.h"
 #include "searchers/squeaky_wheel_searcher.h"
+#include "searchers/surrogate_model.h"
+#include "searchers/transposition_table.h"
 
 #include "planners/optimal_planner.h"
 #include "planners/plan.h"
@@ -165,9 +169,9 @@ OrderedTaskSequence make_pick_pick_seq(const std::vector<Robot> &robots, const u
   for (uint i = 0; i < num_objects; ++i) {
     // check which robot combinations are available for a given object
     std::vector<std::pair<Robot, Robot>> available_robots;
-    for (auto rtp : rtpm) {
-      auto robots = rtp.first.robots;
-      if (rtp.first.task.object == i) {
+    for (const auto &rtp : rtpm.candidates()) {
+      auto robots = rtp.robots;
+      if (rtp.task.object == i && rtpm.count(rtp) > 0) {
         available_robots.push_back(std::make_pair(robots[0], robots[1]));
       }
     }
@@ -181,26 +185,26 @@ OrderedTaskSequence make_pick_pick_seq(const std::vector<Robot> &robots, const u
     spdlog::info("Using the {} available robot for pickpick", ind);
 
     // choose a combo randomly
-    for (auto &rtp : rtpm) {
-      auto robots = rtp.first.robots;
-      if (rtp.first.task.object == i &&
+    for (const auto &rtp : rtpm.candidates()) {
+      auto robots = rtp.robots;
+      if (rtp.task.object == i &&
           robots[0] == available_robots[ind].first &&
           robots[1] == available_robots[ind].second &&
-          rtp.first.task.type == PrimitiveType::pick_pick_1) {
+          rtp.task.type == PrimitiveType::pick_pick_1 && rtpm.count(rtp) > 0) {
         rtps.push_back({});
-        rtps.back().push_back(rtp.first);
-        // seq.push_back(rtp.first);
+        rtps.back().push_back(rtp);
+        // seq.push_back(rtp);
       }
     }
 
-    for (auto &rtp : rtpm) {
-      auto robots = rtp.first.robots;
-      if (rtp.first.task.object == i &&
+    for (const auto &rtp : rtpm.candidates()) {
+      auto robots = rtp.robots;
+      if (rtp.task.object == i &&
           robots[0] == available_robots[ind].first &&
           robots[1] == available_robots[ind].second &&
-          rtp.first.task.type == PrimitiveType::pick_pick_2) {
-        // seq.push_back(rtp.first);
-        rtps.back().push_back(rtp.first);
+          rtp.task.type == PrimitiveType::pick_pick_2 && rtpm.count(rtp) > 0) {
+        // seq.push_back(rtp);
+        rtps.back().push_back(rtp);
       }
     }
   }
@@ -234,7 +238,15 @@ OrderedTaskSequence make_pick_pick_seq(const std::vector<Robot> &robots, const u
 RobotTaskPoseMap compute_keyframes(rai::Configuration &C, const std::vector<Robot> &robots,
                   const bool use_picks = true, const bool use_handovers = false, // changed
                   const bool use_repeated_picks = true,
-                  const bool attempt_all_grasp_directions = false) {
+                  const bool attempt_all_grasp_directions = false,
+                  const bool lazy = false, const bool prefetch = false) {
+  if (lazy) {
+    return make_lazy_robot_task_pose_map(C, robots, use_picks, use_handovers,
+                                         use_repeated_picks,
+                                         attempt_all_grasp_directions,
+                                         prefetch);
+  }
+
   RobotTaskPoseMap robot_task_pose_mapping;
 
   if (use_picks) {
@@ -255,9 +267,23 @@ RobotTaskPoseMap compute_keyframes(rai::Configuration &C, const std::vector<Robo
                                    pick_pick_rtpm.end());
   }
 
+  save_keyframe_library();
+
   return robot_task_pose_mapping;
 }
 
+// The keyframes of a lazy map are computed during the search, i.e. the
+// library can only be saved once it is done.
+void finish_keyframes(const RobotTaskPoseMap &rtpm) {
+  if (!rtpm.is_lazy()) {
+    return;
+  }
+
+  rtpm.get_lazy_keyframes()->stop_prefetching();
+  rtpm.get_lazy_keyframes()->log_statistics();
+  save_keyframe_library();
+}
+
 void export_keyframes() {}
 
 void set_to_mode_for_primitive(rai::Configuration &C, RobotTaskPair rtp, TaskPoses poses, const uint phase) {
@@ -373,9 +399,11 @@ void export_scene_at_keyframes(rai::Configuration &C, const std::vector<Robot> &
   (void)res;
 
   uint cnt = 0;
-  for (const auto &robot_task_pair : robot_task_pose_mapping) {
-    const RobotTaskPair rtp = robot_task_pair.first;
-    const TaskPoses poses = robot_task_pair.second[0];
+  for (const auto &rtp : robot_task_pose_mapping.candidates()) {
+    if (robot_task_pose_mapping.count(rtp) == 0) {
+      continue;
+    }
+    const TaskPoses poses = robot_task_pose_mapping.at(rtp)[0];
 
     for (uint i = 0; i < poses.size(); ++i) {
       const auto pose = poses[i];
@@ -521,6 +549,98 @@ int main(int argc, char **argv) {
       rai::getParameter<bool>("export_txt_files", false);
   global_params.export_txt_files = export_txt_files;
 
+  const bool lazy_keyframes = rai::getParameter<bool>("lazy_keyframes", false);
+
+  const bool prefetch_keyframes =
+      rai::getParameter<bool>("prefetch_keyframes", false);
+
+  const bool use_analytical_ik =
+      rai::getParameter<bool>("use_analytical_ik", false);
+  global_params.use_analytical_ik = use_analytical_ik;
+
+  const bool use_reachability_maps =
+      rai::getParameter<bool>("use_reachability_maps", false);
+  global_params.use_reachability_maps = use_reachability_maps;
+
+  const rai::String reachability_map_path =
+      rai::getParameter<rai::String>("reachability_map_path",
+                                     "./in/reachability/");
+  global_params.reachability_map_path = std::string(reachability_map_path.p);
+
+  const bool use_keyframe_library =
+      rai::getParameter<bool>("use_keyframe_library", false);
+  global_params.use_keyframe_library = use_keyframe_library;
+
+  const rai::String keyframe_library_path = rai::getParameter<rai::String>(
+      "keyframe_library_path", "./in/keyframe_library.json");
+  global_params.keyframe_library_path = std::string(keyframe_library_path.p);
+
+  const uint screening_batch_size =
+      rai::getParameter<double>("screening_batch_size", 0);
+  global_params.screening_batch_size = screening_batch_size;
+
+  const uint screening_top_k = rai::getParameter<double>("screening_top_k", 10);
+  global_params.screening_top_k = screening_top_k;
+
+  const bool use_nogood_store =
+      rai::getParameter<bool>("use_nogood_store", false);
+  global_params.use_nogood_store = use_nogood_store;
+
+  global_params.nogood_capacity =
+      rai::getParameter<double>("nogood_capacity", 10000);
+  global_params.nogood_time_bucket_size =
+      rai::getParameter<double>("nogood_time_bucket_size", 20);
+  global_params.nogood_aggregate_threshold =
+      rai::getParameter<double>("nogood_aggregate_threshold", 3);
+
+  // wall clock budget of the search in seconds, 0 means unlimited
+  const double time_budget = rai::getParameter<double>("time_budget", 0.);
+
+  const double progress_interval =
+      rai::getParameter<double>("progress_interval", 10.);
+  global_params.progress_interval = progress_interval;
+
+  // the planner runs on the worker threads of the searchers, and can thus not
+  // read the parameters itself
+  global_params.attempt_komo = rai::getParameter<bool>("attempt_komo", true);
+  global_params.shortcutting = rai::getParameter<bool>("shortcutting", true);
+  global_params.smoothing = rai::getParameter<bool>("smoothing", false);
+  global_params.informed_sampling =
+      rai::getParameter<bool>("informed_sampling", true);
+
+  const uint num_threads = rai::getParameter<double>("num_threads", 1);
+  global_params.num_threads = num_threads;
+
+  const uint greedy_stagnation_limit =
+      rai::getParameter<double>("greedy_stagnation_limit", 20);
+  global_params.greedy_stagnation_limit = greedy_stagnation_limit;
+
+  global_params.smoothing_levels =
+      rai::getParameter<double>("smoothing_levels", 3);
+  global_params.reoptimize_plans =
+      rai::getParameter<bool>("reoptimize_plans", false);
+  global_params.reoptimization_threads =
+      rai::getParameter<double>("reoptimization_threads", 1);
+  global_params.use_edge_checker =
+      rai::getParameter<bool>("use_edge_checker", false);
+  global_params.shortcut_batch_size =
+      rai::getParameter<double>("shortcut_batch_size", 1);
+  global_params.shortcut_threads =
+      rai::getParameter<double>("shortcut_threads", 1);
+  global_params.validation_threads =
+      rai::getParameter<double>("validation_threads", 1);
+  global_params.use_static_sdf =
+      rai::getParameter<bool>("use_static_sdf", false);
+  const rai::String static_sdf_cache_path =
+      rai::getParameter<rai::String>("static_sdf_cache_path", "./sdf_cache/");
+  global_params.static_sdf_cache_path = std::string(static_sdf_cache_path.p);
+
+  global_params.log_surrogate_samples =
+      rai::getParameter<bool>("log_surrogate_samples", false);
+  const rai::String surrogate_model_path =
+      rai::getParameter<rai::String>("surrogate_model_path", "");
+  global_params.surrogate_model_path = std::string(surrogate_model_path.p);
+
   const rai::String strrt_log_dir_path =
       rai::getParameter<rai::String>("log_dir_strrt");
 
@@ -554,6 +674,26 @@ int main(int argc, char **argv) {
     break;
   }
 
+  if (mode == "train_surrogate") {
+    const rai::String training_path = rai::getParameter<rai::String>(
+        "surrogate_training_path", global_params.output_path.c_str());
+    const std::string model_path = global_params.surrogate_model_path.empty()
+                                       ? "./in/surrogate_model.json"
+                                       : global_params.surrogate_model_path;
+
+    SurrogateModel model;
+    model.train(read_surrogate_samples(training_path.p));
+    if (model.is_trained()) {
+      model.save(model_path);
+      spdlog::info("Saved surrogate model to {}", model_path);
+    }
+    return 0;
+  }
+
+  if (global_params.surrogate_model_path.size() > 0) {
+    get_surrogate_model().load(global_params.surrogate_model_path);
+  }
+
   if (mode == "benchmark_single_keyframe") {
     benchmark_single_arm_pick_and_place_success_rate(false, false);
     return 0;
@@ -687,6 +827,34 @@ int main(int argc, char **argv) {
     return 0;
   }
 
+  if (mode == "build_reachability_maps") {
+    const uint num_samples =
+        rai::getParameter<double>("reachability_samples", 500000);
+    const double resolution =
+        rai::getParameter<double>("reachability_resolution", 0.05);
+
+    const int res =
+        system(STRING("mkdir -p " << global_params.reachability_map_path).p);
+    (void)res;
+
+    // one map per robot- and end-effector type
+    std::unordered_set<std::string> built_maps;
+    for (const auto &r : robots) {
+      const std::string filename = get_reachability_map_filename(r);
+      if (built_maps.count(filename) > 0) {
+        continue;
+      }
+      built_maps.insert(filename);
+
+      spdlog::info("Building reachability map {}", filename);
+      const auto map =
+          build_reachability_map(C, r, num_samples, resolution);
+      map.save(filename);
+    }
+
+    return 0;
+  }
+
   // maps [robot] to home_pose
   const std::unordered_map<Robot, arr> home_poses =
       get_robot_home_poses(robots);
@@ -774,9 +942,9 @@ int main(int argc, char **argv) {
     std::stringstream buffer;
     buffer << "sequence_plan_" << std::put_time(&tm, "%Y%m%d_%H%M%S");
 
-    RobotTaskPoseMap rtpm =
-        compute_keyframes(C, robots, use_picks, use_handovers,
-                          use_repeated_picks, attempt_all_grasp_directions);
+    RobotTaskPoseMap rtpm = compute_keyframes(
+        C, robots, use_picks, use_handovers, use_repeated_picks,
+        attempt_all_grasp_directions, lazy_keyframes, prefetch_keyframes);
 
     const auto start_time = std::chrono::high_resolution_clock::now();
 
@@ -805,6 +973,13 @@ int main(int argc, char **argv) {
         export_plan(C, robots, home_poses, plan.plan, seq, buffer.str(),
                     seq_num, duration);
 
+        if (global_params.reoptimize_plans) {
+          const Plan reoptimized_plan =
+              reoptimize_plan(C, plan.plan, home_poses);
+          export_plan(C, robots, home_poses, reoptimized_plan, seq,
+                      buffer.str() + "/reoptimized", seq_num, duration);
+        }
+
         if (global_params.export_images) {
           const std::string image_path = global_params.output_path +
                                          buffer.str() + "/" +
@@ -820,6 +995,8 @@ int main(int argc, char **argv) {
       ++seq_num;
     }
 
+    finish_keyframes(rtpm);
+
     return 0;
   }
 
@@ -843,9 +1020,9 @@ int main(int argc, char **argv) {
     std::stringstream buffer;
     buffer << "sequence_generation_" << std::put_time(&tm, "%Y%m%d_%H%M%S");
 
-    RobotTaskPoseMap robot_task_pose_mapping =
-        compute_keyframes(C, robots, use_picks, use_handovers,
-                          use_repeated_picks, attempt_all_grasp_directions);
+    RobotTaskPoseMap robot_task_pose_mapping = compute_keyframes(
+        C, robots, use_picks, use_handovers, use_repeated_picks,
+        attempt_all_grasp_directions, lazy_keyframes, prefetch_keyframes);
 
     int num_tasks = 0;
     for (auto f : C.frames) {
@@ -888,17 +1065,42 @@ int main(int argc, char **argv) {
     save_json(sequences, folder + "sequences.json",
               global_params.compress_data);
 
+    finish_keyframes(robot_task_pose_mapping);
+
     return 0;
   }
 
   spdlog::info("Computing pick and place poses");
 
   // merge both maps
-  RobotTaskPoseMap robot_task_pose_mapping =
-      compute_keyframes(C, robots, use_picks, use_handovers, use_repeated_picks,
-                        attempt_all_grasp_directions);
+  RobotTaskPoseMap robot_task_pose_mapping = compute_keyframes(
+      C, robots, use_picks, use_handovers, use_repeated_picks,
+      attempt_all_grasp_directions, lazy_keyframes, prefetch_keyframes);
   spdlog::info("{} poses computed.", robot_task_pose_mapping.size());
 
+  // outcomes of evaluated sequences, shared by the searchers and optionally
+  // persisted between runs on the same scene
+  const bool use_transposition_table =
+      rai::getParameter<bool>("use_transposition_table", true);
+  const rai::String transposition_table_path =
+      rai::getParameter<rai::String>("transposition_table_path", "");
+  // a single (possibly unlucky) failure excludes all sequences that share the
+  // prefix up to the failed task
+  const bool skip_failing_prefixes =
+      rai::getParameter<bool>("skip_failing_prefixes", false);
+
+  std::unique_ptr<TranspositionTable> transposition_table;
+  if (use_transposition_table) {
+    transposition_table = std::make_unique<TranspositionTable>(
+        compute_scene_hash(C), skip_failing_prefixes);
+    if (transposition_table_path.N > 0) {
+      transposition_table->load(transposition_table_path.p);
+    }
+  }
+
+  // the budget only covers the search, not the keyframe computation
+  get_cancellation_token().set_time_budget(time_budget);
+
   // initial test
   if (mode == "test") {
     const auto plan = plan_multiple_arms_unsynchronized(
@@ -921,15 +1123,56 @@ int main(int argc, char **argv) {
     // random search
     const auto plan = plan_multiple_arms_random_search(
         C, robot_task_pose_mapping, home_poses, max_attempts,
-        avoid_repeated_evaluations);
+        avoid_repeated_evaluations, transposition_table.get());
   } 
   else if (mode == "greedy_random_search") {
     // greedy random search
     const auto plan = plan_multiple_arms_greedy_random_search(
-        C, robot_task_pose_mapping, home_poses, max_attempts);
+        C, robot_task_pose_mapping, home_poses, max_attempts,
+        transposition_table.get());
   } else if (mode == "simulated_annealing") {
     plan_multiple_arms_simulated_annealing(C, robot_task_pose_mapping,
-                                           home_poses);
+                                           home_poses,
+                                           transposition_table.get());
+  } else if (mode == "parallel_tempering") {
+    ParallelTemperingOptions options;
+    options.num_replicas = rai::getParameter<double>("num_replicas", 4);
+    options.max_iterations = max_attempts;
+    options.steps_per_round =
+        rai::getParameter<double>("pt_steps_per_round", 5);
+    options.min_temperature =
+        rai::getParameter<double>("pt_min_temperature", 1.);
+    options.max_temperature =
+        rai::getParameter<double>("pt_max_temperature", 100.);
+
+    plan_multiple_arms_parallel_tempering(C, robot_task_pose_mapping,
+                                          home_poses, options,
+                                          transposition_table.get());
+  } else if (mode == "mcts") {
+    MctsOptions options;
+    options.max_iterations = max_attempts;
+    options.exploration = rai::getParameter<double>("mcts_exploration", 0.5);
+    options.planner_rollouts =
+        rai::getParameter<bool>("mcts_planner_rollouts", true);
+
+    plan_multiple_arms_mcts(C, robot_task_pose_mapping, home_poses, options,
+                            transposition_table.get());
+  } else if (mode == "squeaky_wheel") {
+    plan_multiple_arms_squeaky_wheel(C, robot_task_pose_mapping, home_poses,
+                                     max_attempts, transposition_table.get());
+  }
+
+  finish_keyframes(robot_task_pose_mapping);
+
+  if (use_nogood_store) {
+    get_nogood_store().log_statistics();
+  }
+
+  if (transposition_table) {
+    transposition_table->log_statistics();
+    if (transposition_table_path.N > 0) {
+      transposition_table->save(transposition_table_path.p);
+    }
   }
 
   // std::cout<<"end"<<std::endl;
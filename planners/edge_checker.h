@@ -0,0 +1,298 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include <vector>
+
+#include <Geo/fclInterface.h>
+#include <PlanningSubroutines/ConfigurationProblem.h>
+
+#include "common/util.h"
+#include "static_sdf.h"
+
+// Continuous collision checking of a straight segment in space-time with
+// conservative advancement: at each checked point, the distance to the closest
+// obstacle is known from the collision query. The robot can only close this
+// distance by moving its links (bounded by the Lipschitz constant of the
+// forward kinematics of each joint) or by the other robots moving towards it
+// (bounded by the maximum speed of the animated frames during the segment).
+// The next point can thus be placed as far as this distance allows, instead
+// of sampling the segment at a fixed resolution.
+//
+// The same bound on the motion of the other robots is used for configurations
+// that are held over an interval of time steps (waiting, holding at a
+// keyframe, a goal that needs to stay free): a query with clearance d covers
+// all following time steps until the obstacles could have moved by d in the
+// accumulated sweep of the animation, which is zero once it ends.
+//
+// The collision query needs to report the distance of all pairs that are
+// closer than the cutoff. The fcl cutoff is thus set for the lifetime of the
+// checker, and restored afterwards.
+// If a static sdf query is given, the queries go through it, and the distance
+// to the static geometry is bounded by the field where fcl is skipped.
+class EdgeChecker {
+public:
+  EdgeChecker(TimedConfigurationProblem &_TP,
+              StaticSdfQuery *_sdf_query = nullptr,
+              const double _cutoff = 0.1, const double _min_step = 0.005)
+      : TP(_TP), sdf_query(_sdf_query), cutoff(_cutoff),
+        min_step(_min_step) {
+    prev_cutoff = TP.C.fcl()->cutoff;
+    prev_stop_early = TP.C.fcl()->stopEarly;
+    TP.C.fcl()->cutoff = cutoff;
+    TP.C.fcl()->stopEarly = false;
+
+    compute_lipschitz_constants();
+    compute_obstacle_motion();
+  }
+
+  ~EdgeChecker() {
+    TP.C.fcl()->cutoff = prev_cutoff;
+    TP.C.fcl()->stopEarly = prev_stop_early;
+  }
+
+  // true if the straight line from (q0, t0) to (q1, t1) is collision free.
+  // The end point is not checked.
+  bool check_edge(const arr &q0, const double t0, const arr &q1,
+                  const double t1) {
+    const arr dq = q1 - q0;
+
+    // bound on the distance that any point can move per unit of the segment.
+    // The obstacles move at most at their maximum speed during the time steps
+    // that the segment overlaps, including the jumps at the start of a part.
+    double motion = get_obstacle_speed(std::floor(std::min(t0, t1)),
+                                       std::ceil(std::max(t0, t1))) *
+                    std::fabs(t1 - t0);
+    for (uint l = 0; l < dq.N; ++l) {
+      motion += lipschitz(l) * std::fabs(dq(l));
+    }
+
+    double s = 0.;
+    while (s < 1.) {
+      const arr q = q0 + s * dq;
+      const double t = t0 + s * (t1 - t0);
+
+      const auto res = query(q, t);
+      if (!res->isFeasible) {
+        return false;
+      }
+
+      if (motion < 1e-12) {
+        break;
+      }
+
+      const double clearance = get_clearance(*res);
+      const double step = clearance / motion;
+      if (step < min_step) {
+        ++num_min_steps;
+      }
+      s += std::max(step, min_step);
+    }
+
+    return true;
+  }
+
+  // first time step between t_from and t_to (both included, going from t_from
+  // towards t_to, i.e. t_to can be smaller) at which the configuration q is
+  // not feasible, or -1 if it is feasible at all of them.
+  int query_interval(const arr &q, const uint t_from, const uint t_to) {
+    const int dir = t_to >= t_from ? 1 : -1;
+    int t = t_from;
+    while (true) {
+      const auto res = query(q, t);
+      if (!res->isFeasible) {
+        return t;
+      }
+
+      const int t_last = get_last_covered_time(t, get_clearance(*res), t_to);
+      if (t_last == int(t_to)) {
+        return -1;
+      }
+      t = t_last + dir;
+    }
+  }
+
+  // index i of the first segment (path[i], path[i+1]) that is not collision
+  // free, or -1 if the complete path, including its last point, is. Segments
+  // in which the configuration does not change are checked as one interval.
+  int find_first_infeasible_edge(const arr &path, const arr &t) {
+    uint i = 0;
+    while (i + 1 < path.d0) {
+      uint j = i;
+      while (j + 1 < path.d0 && absMax(path[j + 1] - path[i]) < 1e-12 &&
+             is_time_step(t(j)) && is_time_step(t(j + 1))) {
+        ++j;
+      }
+
+      if (j > i + 1) {
+        const int t_coll = query_interval(path[i], t(i), t(j) - 1);
+        if (t_coll >= 0) {
+          uint k = i;
+          while (t(k + 1) <= t_coll) {
+            ++k;
+          }
+          return k;
+        }
+        i = j;
+        continue;
+      }
+
+      if (!check_edge(path[i], t(i), path[i + 1], t(i + 1))) {
+        return i;
+      }
+      ++i;
+    }
+
+    if (path.d0 > 0) {
+      if (!query(path[-1], t(-1))->isFeasible) {
+        return path.d0 - 1;
+      }
+    }
+    return -1;
+  }
+
+  uint get_num_queries() const { return num_queries; }
+
+  // number of steps that were limited by the minimum step size, i.e. the
+  // segment could only be checked at this resolution
+  uint get_num_min_steps() const { return num_min_steps; }
+
+private:
+  std::shared_ptr<QueryResult> query(const arr &q, const double t) {
+    ++num_queries;
+    if (sdf_query != nullptr) {
+      return sdf_query->query(q, t);
+    }
+    return TP.query(q, t);
+  }
+
+  // the result needs to be the one of the last query
+  double get_clearance(const QueryResult &res) const {
+    double clearance =
+        res.coll_y.N > 0 ? std::min(min(res.coll_y), cutoff) : cutoff;
+    if (sdf_query != nullptr) {
+      clearance = std::min(clearance, sdf_query->get_last_static_clearance());
+    }
+    return clearance;
+  }
+
+  static bool is_time_step(const double t) {
+    return t >= 0 && t == std::floor(t);
+  }
+
+  // upper bound on the distance that the animated frames move between the
+  // time steps t0 and t1
+  double get_obstacle_motion(const int t0, const int t1) const {
+    const int T = cumulative_motion.N - 1;
+    const int a = std::min(std::min(t0, t1), T);
+    const int b = std::min(std::max(t0, t1), T);
+    return cumulative_motion(b) - cumulative_motion(a);
+  }
+
+  // upper bound on the distance per time step that the animated frames move
+  // between the time steps t0 < t1
+  double get_obstacle_speed(const int t0, const int t1) const {
+    double speed = 0.;
+    for (int t = std::max(t0, 0); t < std::min<int>(t1, step_motion.N); ++t) {
+      speed = std::max(speed, step_motion(t));
+    }
+    return speed;
+  }
+
+  // last time step between t and t_to, going from t towards t_to, up to which
+  // the obstacles can not close the distance d
+  int get_last_covered_time(const int t, const double d, const int t_to) const {
+    if (get_obstacle_motion(t, t_to) < d) {
+      return t_to;
+    }
+
+    const int dir = t_to >= t ? 1 : -1;
+    int t_last = t;
+    while (t_last != t_to && get_obstacle_motion(t, t_last + dir) < d) {
+      t_last += dir;
+    }
+    return t_last;
+  }
+
+  // For a revolute joint, a point at distance r from the joint moves at most
+  // r * |dq|, for a prismatic joint at most |dq|. r is bounded by the reach of
+  // the subtree below the joint, which does not depend on the configuration:
+  // the offsets between the frames are fixed.
+  void compute_lipschitz_constants() {
+    lipschitz = zeros(TP.C.getJointState().N);
+    for (auto *j : TP.C.activeJoints) {
+      const bool revolute = j->type == rai::JT_hingeX ||
+                            j->type == rai::JT_hingeY ||
+                            j->type == rai::JT_hingeZ;
+      const double L = revolute ? get_reach(j->frame) : 1.;
+      for (uint d = 0; d < j->dim; ++d) {
+        lipschitz(j->qIndex + d) = L;
+      }
+    }
+  }
+
+  double get_reach(rai::Frame *f) {
+    double reach = get_bounding_radius(f);
+    for (auto *c : f->children) {
+      const double offset = length(c->getPosition() - f->getPosition());
+      reach = std::max(reach, offset + get_reach(c));
+    }
+    return reach;
+  }
+
+  // maximum distance that a point of an animated frame moves in each time
+  // step, and accumulated over the time steps of the animation. Before a part
+  // starts, its frames are not animated, i.e. the start is a jump.
+  void compute_obstacle_motion() {
+    step_motion = zeros(TP.A.getT());
+    for (const auto &part : TP.A.A) {
+      if (part.start > 0 && part.start <= step_motion.N) {
+        step_motion(part.start - 1) = 1e6;
+      }
+
+      for (uint k = 0; k < part.frameIDs.N; ++k) {
+        if (part.frameIDs(k) >= TP.C.frames.N) {
+          continue;
+        }
+        const double radius =
+            get_bounding_radius(TP.C.frames(part.frameIDs(k)));
+        for (uint i = 0; i + 1 < part.X.d0; ++i) {
+          const arr x0 = part.X[i][k];
+          const arr x1 = part.X[i + 1][k];
+
+          const double translation = length(x1({0, 2}) - x0({0, 2}));
+          const double cos_half_angle =
+              std::min(1., std::fabs(scalarProduct(x0({3, 6}), x1({3, 6}))));
+          const double angle = 2. * std::acos(cos_half_angle);
+
+          const uint step = part.start + i;
+          if (step < step_motion.N) {
+            step_motion(step) =
+                std::max(step_motion(step), translation + radius * angle);
+          }
+        }
+      }
+    }
+
+    cumulative_motion = zeros(step_motion.N + 1);
+    for (uint i = 0; i < step_motion.N; ++i) {
+      cumulative_motion(i + 1) = cumulative_motion(i) + step_motion(i);
+    }
+  }
+
+  TimedConfigurationProblem &TP;
+  StaticSdfQuery *sdf_query;
+
+  double cutoff;
+  double min_step;
+
+  double prev_cutoff;
+  bool prev_stop_early;
+
+  arr lipschitz;
+  arr step_motion;
+  arr cumulative_motion;
+
+  uint num_queries = 0;
+  uint num_min_steps = 0;
+};
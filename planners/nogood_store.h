@@ -0,0 +1,203 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "common/config.h"
+#include "common/types.h"
+
+#include "planners/plan.h"
+
+// Memoizes the tasks that could not be planned. A failure is identified by
+// the robots, the primitive, the object, the set of objects that were handled
+// before, and the (bucketed) time at which the task was started.
+// The planner consults the store before planning a task, and rejects tasks
+// that failed in the same situation before. Since the sequence generators do
+// not know the start times of the tasks, they can only use the time agnostic
+// part: a task is rejected if it failed in the same situation at several
+// different start times.
+// The store is bounded, the least recently used signatures are evicted first.
+class NogoodStore {
+public:
+  NogoodStore(const uint _capacity = 10000, const uint _time_bucket_size = 20,
+              const uint _aggregate_threshold = 3)
+      : capacity(_capacity), time_bucket_size(_time_bucket_size),
+        aggregate_threshold(_aggregate_threshold) {}
+
+  // signature of the task, without the start time
+  static uint64_t get_situation_hash(const RobotTaskPair &rtp,
+                                     std::vector<uint> placed_objects) {
+    std::sort(placed_objects.begin(), placed_objects.end());
+    placed_objects.erase(
+        std::unique(placed_objects.begin(), placed_objects.end()),
+        placed_objects.end());
+
+    uint64_t h = hash_robot_task_pair(rtp);
+    for (const auto obj : placed_objects) {
+      h = fnv1a_hash(uint64_t(obj), h);
+    }
+    return h;
+  }
+
+  // objects that were handled by the parts of the plan so far
+  static std::vector<uint> get_placed_objects(const Plan &paths) {
+    std::vector<uint> placed_objects;
+    for (const auto &p : paths) {
+      for (const auto &part : p.second) {
+        if (!part.is_exit) {
+          placed_objects.push_back(part.task_index);
+        }
+      }
+    }
+    return placed_objects;
+  }
+
+  void add(const RobotTaskPair &rtp, const std::vector<uint> &placed_objects,
+           const uint start_time) {
+    const uint64_t situation = get_situation_hash(rtp, placed_objects);
+    const uint64_t key = get_key(situation, start_time);
+
+    std::lock_guard<std::mutex> lock(m);
+    ++num_inserts;
+
+    const auto it = entries.find(key);
+    if (it != entries.end()) {
+      touch(it->second);
+      return;
+    }
+
+    lru.push_front(key);
+    entries[key] = {situation, lru.begin()};
+    ++failures_per_situation[situation];
+
+    while (entries.size() > capacity) {
+      evict_oldest();
+    }
+  }
+
+  // checks if the task failed before in the same situation, at the same time
+  // bucket, or in at least aggregate_threshold different time buckets.
+  bool contains(const RobotTaskPair &rtp,
+                const std::vector<uint> &placed_objects,
+                const uint start_time) {
+    const uint64_t situation = get_situation_hash(rtp, placed_objects);
+    const uint64_t key = get_key(situation, start_time);
+
+    std::lock_guard<std::mutex> lock(m);
+    ++num_planner_lookups;
+
+    const auto it = entries.find(key);
+    if (it != entries.end()) {
+      touch(it->second);
+      ++num_planner_hits;
+      return true;
+    }
+
+    if (situation_always_fails(situation)) {
+      ++num_planner_hits;
+      return true;
+    }
+
+    return false;
+  }
+
+  // time agnostic check of a whole sequence
+  bool contains(const OrderedTaskSequence &seq) {
+    std::lock_guard<std::mutex> lock(m);
+    ++num_sequence_lookups;
+
+    if (failures_per_situation.empty()) {
+      return false;
+    }
+
+    std::vector<uint> placed_objects;
+    for (const auto &rtp : seq) {
+      if (situation_always_fails(
+              get_situation_hash(rtp, placed_objects))) {
+        ++num_sequence_hits;
+        return true;
+      }
+      placed_objects.push_back(rtp.task.object);
+    }
+    return false;
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock(m);
+    entries.clear();
+    lru.clear();
+    failures_per_situation.clear();
+  }
+
+  void log_statistics() const {
+    std::lock_guard<std::mutex> lock(m);
+    spdlog::info("Nogood store: {} entries, {} inserts, {} evictions",
+                 entries.size(), num_inserts, num_evictions);
+    spdlog::info("Nogood store: {} of {} tasks rejected in the planner, {} of "
+                 "{} sequences rejected",
+                 num_planner_hits, num_planner_lookups, num_sequence_hits,
+                 num_sequence_lookups);
+  }
+
+private:
+  struct Entry {
+    uint64_t situation;
+    std::list<uint64_t>::iterator lru_position;
+  };
+
+  uint64_t get_key(const uint64_t situation, const uint start_time) const {
+    return fnv1a_hash(uint64_t(start_time / std::max(1u, time_bucket_size)),
+                      situation);
+  }
+
+  bool situation_always_fails(const uint64_t situation) const {
+    const auto it = failures_per_situation.find(situation);
+    return it != failures_per_situation.end() &&
+           it->second >= aggregate_threshold;
+  }
+
+  void touch(Entry &e) { lru.splice(lru.begin(), lru, e.lru_position); }
+
+  void evict_oldest() {
+    const uint64_t key = lru.back();
+    lru.pop_back();
+
+    const uint64_t situation = entries.at(key).situation;
+    entries.erase(key);
+    if (--failures_per_situation[situation] == 0) {
+      failures_per_situation.erase(situation);
+    }
+
+    ++num_evictions;
+  }
+
+  mutable std::mutex m;
+
+  uint capacity;
+  uint time_bucket_size;
+  uint aggregate_threshold;
+
+  std::list<uint64_t> lru;
+  std::unordered_map<uint64_t, Entry> entries;
+  std::unordered_map<uint64_t, uint> failures_per_situation;
+
+  uint num_inserts = 0;
+  uint num_evictions = 0;
+  uint num_planner_lookups = 0;
+  uint num_planner_hits = 0;
+  uint num_sequence_lookups = 0;
+  uint num_sequence_hits = 0;
+};
+
+// store that is shared by all planners and searchers
+NogoodStore &get_nogood_store() {
+  static NogoodStore store(global_params.nogood_capacity,
+                           global_params.nogood_time_bucket_size,
+                           global_params.nogood_aggregate_threshold);
+  return store;
+}
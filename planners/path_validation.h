@@ -0,0 +1,230 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <PlanningSubroutines/ConfigurationProblem.h>
+
+#include "common/config.h"
+#include "common/env_util.h"
+#include "common/util.h"
+#include "plan.h"
+#include "static_sdf.h"
+
+// Outcome of checking all points of a path (or all time steps of a plan).
+struct PathValidationResult {
+  // index of the first infeasible point, -1 if all points are feasible
+  int first_infeasible_index = -1;
+
+  // penetration depth at the first infeasible point, 0 if the infeasibility
+  // is not caused by a collision
+  double penetration = 0.;
+
+  uint num_queries = 0;
+
+  bool is_feasible() const { return first_infeasible_index < 0; }
+};
+
+// The indices begin..end-1 in bisection order: the endpoints first, then the
+// midpoint, then the quarter points, and so on. Collisions typically span
+// several consecutive points, and are found after few queries in this order.
+std::vector<uint> get_bisection_order(const uint begin, const uint end) {
+  std::vector<uint> order;
+  if (end <= begin) {
+    return order;
+  }
+
+  order.push_back(begin);
+  if (end - begin == 1) {
+    return order;
+  }
+  order.push_back(end - 1);
+
+  std::vector<std::pair<uint, uint>> intervals = {{begin, end - 1}};
+  for (uint k = 0; k < intervals.size(); ++k) {
+    const uint lo = intervals[k].first;
+    const uint hi = intervals[k].second;
+    if (hi - lo < 2) {
+      continue;
+    }
+    const uint mid = (lo + hi) / 2;
+    order.push_back(mid);
+    intervals.push_back({lo, mid});
+    intervals.push_back({mid, hi});
+  }
+  return order;
+}
+
+namespace path_validation {
+// minimum number of points that a worker thread checks
+const uint min_chunk_size = 25;
+
+uint get_num_workers(const uint n, const uint num_threads) {
+  return std::max(1u, std::min(num_threads, n / min_chunk_size));
+}
+
+// Checks the indices 0..n-1, split into contiguous chunks over the workers,
+// each chunk in bisection order. query(w, i) checks index i with the
+// collision context of worker w. Indices after an already found infeasible
+// one are skipped, i.e. the first infeasible index is still exact.
+template <typename QueryFn>
+PathValidationResult check_indices(const uint n, const uint num_workers,
+                                   QueryFn query) {
+  std::atomic<int> first_infeasible(n);
+  std::atomic<uint> num_queries(0);
+  std::mutex m;
+  double penetration = 0.;
+
+  auto work = [&](const uint w) {
+    const uint begin = n * w / num_workers;
+    const uint end = n * (w + 1) / num_workers;
+    for (const uint i : get_bisection_order(begin, end)) {
+      if (int(i) >= first_infeasible.load()) {
+        continue;
+      }
+
+      const auto res = query(w, i);
+      ++num_queries;
+      if (res->isFeasible) {
+        continue;
+      }
+
+      std::lock_guard<std::mutex> lock(m);
+      if (int(i) < first_infeasible.load()) {
+        first_infeasible = i;
+        penetration =
+            res->coll_y.N > 0 ? std::max(0., -min(res->coll_y)) : 0.;
+      }
+    }
+  };
+
+  if (num_workers == 1) {
+    work(0);
+  } else {
+    std::vector<std::thread> threads;
+    for (uint w = 0; w < num_workers; ++w) {
+      threads.emplace_back(work, w);
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+  PathValidationResult res;
+  if (first_infeasible.load() < int(n)) {
+    res.first_infeasible_index = first_infeasible.load();
+    res.penetration = penetration;
+  }
+  res.num_queries = num_queries.load();
+  return res;
+}
+} // namespace path_validation
+
+// Checks the configurations path[i] at the times t(i). Long paths are split
+// over num_threads threads, each with its own copy of the problem. The copies
+// and the static sdf queries are expensive to set up, and are thus built on
+// first use and reused for all paths that are validated in the same problem.
+class PathValidator {
+public:
+  PathValidator(TimedConfigurationProblem &TP,
+                const uint _num_threads = global_params.validation_threads)
+      : num_threads(_num_threads), workers({&TP}) {}
+
+  PathValidationResult validate(const arr &path, const arr &t) {
+    const uint num_workers =
+        path_validation::get_num_workers(path.d0, num_threads);
+    add_workers(num_workers);
+
+    return path_validation::check_indices(
+        path.d0, num_workers, [&](const uint w, const uint i) {
+          if (!sdf_queries.empty()) {
+            return sdf_queries[w]->query(path[i], t(i));
+          }
+          return workers[w]->query(path[i], t(i));
+        });
+  }
+
+  // The static sdf query of the given problem, such that the other collision
+  // checks in this problem can share it. nullptr if the filter is disabled.
+  StaticSdfQuery *get_static_sdf_query() {
+    if (!global_params.use_static_sdf) {
+      return nullptr;
+    }
+    add_workers(1);
+    return sdf_queries[0].get();
+  }
+
+private:
+  // the first worker uses the given problem
+  void add_workers(const uint num_workers) {
+    TimedConfigurationProblem &TP = *workers[0];
+    while (workers.size() < num_workers) {
+      problems.push_back(
+          std::make_unique<TimedConfigurationProblem>(TP.C, TP.A));
+      problems.back()->activeOnly = TP.activeOnly;
+      problems.back()->C.fcl()->deactivatePairs(get_cant_collide_pairs(TP.C));
+      problems.back()->C.fcl()->stopEarly = TP.C.fcl()->stopEarly;
+      workers.push_back(problems.back().get());
+    }
+
+    // robot-static pairs are only checked with fcl close to the static
+    // geometry
+    if (global_params.use_static_sdf) {
+      while (sdf_queries.size() < workers.size()) {
+        sdf_queries.push_back(
+            std::make_unique<StaticSdfQuery>(*workers[sdf_queries.size()]));
+      }
+    }
+  }
+
+  uint num_threads;
+
+  std::vector<std::unique_ptr<TimedConfigurationProblem>> problems;
+  std::vector<TimedConfigurationProblem *> workers;
+  std::vector<std::unique_ptr<StaticSdfQuery>> sdf_queries;
+};
+
+// Checks a single path. If several paths are checked in the same problem, a
+// PathValidator should be reused instead.
+PathValidationResult
+validate_path(TimedConfigurationProblem &TP, const arr &path, const arr &t,
+              const uint num_threads = global_params.validation_threads) {
+  return PathValidator(TP, num_threads).validate(path, t);
+}
+
+// Checks the complete plan at every time step, with all robots at their
+// poses at this time. The index of the result is the time step.
+PathValidationResult
+validate_plan(rai::Configuration C, const std::vector<Robot> &robots,
+              const Plan &plan,
+              const std::unordered_map<Robot, arr> &home_poses,
+              const uint num_threads = global_params.validation_threads) {
+  const uint makespan = get_makespan_from_plan(plan);
+  const uint num_workers =
+      path_validation::get_num_workers(makespan, num_threads);
+
+  // the problems are set up with the joints that are active when querying
+  if (!robots.empty()) {
+    setActive(C, robots.back());
+  }
+
+  std::vector<std::unique_ptr<ConfigurationProblem>> problems;
+  for (uint w = 0; w < num_workers; ++w) {
+    problems.push_back(std::make_unique<ConfigurationProblem>(C));
+  }
+
+  return path_validation::check_indices(
+      makespan, num_workers, [&](const uint w, const uint t) {
+        ConfigurationProblem &cp = *problems[w];
+        for (const auto &r : robots) {
+          setActive(cp.C, r);
+          cp.C.setJointState(get_robot_pose_at_time(t, r, home_poses, plan));
+        }
+        return cp.query({}, false);
+      });
+}
@@ -2,7 +2,13 @@
 
 #include "spdlog/spdlog.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_set>
 #include <vector>
 
 #include "json/json.h"
@@ -17,8 +23,252 @@
 using json = nlohmann::ordered_json;
 
 typedef std::vector<arr> TaskPoses;
-typedef std::unordered_map<RobotTaskPair, std::vector<TaskPoses>>
-    RobotTaskPoseMap;
+
+// Computes the keyframes of robot-task pairs on demand.
+class KeyframeProvider {
+public:
+  virtual ~KeyframeProvider() {}
+
+  // Returns the keyframes of the given pair, and possibly of other pairs that
+  // are computed along the way. If the pair is not contained in the result,
+  // it is infeasible.
+  virtual std::unordered_map<RobotTaskPair, std::vector<TaskPoses>>
+  compute(const RobotTaskPair &rtp) = 0;
+
+  // All pairs that are potentially feasible, the most promising ones first.
+  virtual std::vector<RobotTaskPair> candidates() const = 0;
+};
+
+// Memoizes the results of a KeyframeProvider, including the pairs that are
+// infeasible. Optionally, a second provider (with its own configuration)
+// computes the candidates in the background.
+class LazyKeyframes {
+public:
+  LazyKeyframes(std::shared_ptr<KeyframeProvider> _provider)
+      : provider(_provider) {}
+
+  ~LazyKeyframes() { stop_prefetching(); }
+
+  // returns nullptr if the pair is infeasible
+  std::vector<TaskPoses> *get(const RobotTaskPair &rtp) {
+    {
+      std::unique_lock<std::mutex> lock(m);
+      while (true) {
+        if (poses.count(rtp) > 0) {
+          ++hits;
+          return &poses.at(rtp);
+        }
+        if (infeasible.count(rtp) > 0) {
+          ++hits;
+          return nullptr;
+        }
+        if (in_progress.count(rtp) == 0) {
+          break;
+        }
+        // the pair is currently computed by the prefetcher
+        cv.wait(lock);
+      }
+      ++misses;
+      in_progress.insert(rtp);
+    }
+
+    std::unordered_map<RobotTaskPair, std::vector<TaskPoses>> res;
+    {
+      std::lock_guard<std::mutex> lock(provider_mutex);
+      res = provider->compute(rtp);
+    }
+    store(rtp, res);
+
+    std::lock_guard<std::mutex> lock(m);
+    if (poses.count(rtp) > 0) {
+      return &poses.at(rtp);
+    }
+    return nullptr;
+  }
+
+  std::vector<RobotTaskPair> candidates() {
+    const auto all_candidates = provider->candidates();
+
+    std::lock_guard<std::mutex> lock(m);
+    std::vector<RobotTaskPair> res;
+    for (const auto &rtp : all_candidates) {
+      if (infeasible.count(rtp) == 0) {
+        res.push_back(rtp);
+      }
+    }
+    return res;
+  }
+
+  uint num_feasible() {
+    std::lock_guard<std::mutex> lock(m);
+    return poses.size();
+  }
+
+  std::unordered_map<RobotTaskPair, std::vector<TaskPoses>> computed() {
+    std::lock_guard<std::mutex> lock(m);
+    return poses;
+  }
+
+  void start_prefetching(std::shared_ptr<KeyframeProvider> prefetch_provider) {
+    stop_prefetching();
+    stop = false;
+
+    prefetcher = std::thread([this, prefetch_provider]() {
+      for (const auto &rtp : prefetch_provider->candidates()) {
+        if (stop) {
+          break;
+        }
+        {
+          std::lock_guard<std::mutex> lock(m);
+          if (poses.count(rtp) > 0 || infeasible.count(rtp) > 0 ||
+              in_progress.count(rtp) > 0) {
+            continue;
+          }
+          in_progress.insert(rtp);
+        }
+
+        store(rtp, prefetch_provider->compute(rtp));
+        ++prefetched;
+      }
+    });
+  }
+
+  void stop_prefetching() {
+    stop = true;
+    if (prefetcher.joinable()) {
+      prefetcher.join();
+    }
+  }
+
+  void log_statistics() {
+    std::lock_guard<std::mutex> lock(m);
+    spdlog::info("Lazy keyframes: {} feasible, {} infeasible, {} hits, {} "
+                 "misses, {} prefetched",
+                 poses.size(), infeasible.size(), hits, misses,
+                 prefetched.load());
+  }
+
+private:
+  void store(const RobotTaskPair &rtp,
+             const std::unordered_map<RobotTaskPair, std::vector<TaskPoses>>
+                 &res) {
+    std::lock_guard<std::mutex> lock(m);
+    for (const auto &e : res) {
+      if (poses.count(e.first) == 0) {
+        poses[e.first] = e.second;
+      }
+    }
+    if (res.count(rtp) == 0) {
+      infeasible.insert(rtp);
+    }
+    in_progress.erase(rtp);
+    cv.notify_all();
+  }
+
+  std::shared_ptr<KeyframeProvider> provider;
+  std::mutex provider_mutex;
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::unordered_map<RobotTaskPair, std::vector<TaskPoses>> poses;
+  std::unordered_set<RobotTaskPair> infeasible;
+  std::unordered_set<RobotTaskPair> in_progress;
+
+  uint hits = 0;
+  uint misses = 0;
+  std::atomic<uint> prefetched{0};
+
+  std::thread prefetcher;
+  std::atomic<bool> stop{false};
+};
+
+// Maps robot-task pairs to their keyframes. The keyframes are either computed
+// upfront and inserted, or computed lazily the first time they are queried.
+// The lazily computed keyframes are shared between all copies of the map.
+// Iterating only covers the keyframes that were inserted explicitly - use
+// candidates() to enumerate the pairs that are potentially feasible.
+class RobotTaskPoseMap {
+public:
+  typedef std::unordered_map<RobotTaskPair, std::vector<TaskPoses>> Map;
+  typedef Map::iterator iterator;
+  typedef Map::const_iterator const_iterator;
+  typedef Map::value_type value_type;
+
+  RobotTaskPoseMap() {}
+  RobotTaskPoseMap(std::shared_ptr<KeyframeProvider> provider)
+      : lazy(std::make_shared<LazyKeyframes>(provider)) {}
+
+  size_t count(const RobotTaskPair &rtp) const {
+    if (poses.count(rtp) > 0) {
+      return 1;
+    }
+    if (lazy && lazy->get(rtp) != nullptr) {
+      return 1;
+    }
+    return 0;
+  }
+
+  const std::vector<TaskPoses> &at(const RobotTaskPair &rtp) const {
+    if (poses.count(rtp) > 0 || !lazy) {
+      return poses.at(rtp);
+    }
+    const auto res = lazy->get(rtp);
+    if (res == nullptr) {
+      throw std::out_of_range("No keyframes for " + rtp.serialize());
+    }
+    return *res;
+  }
+
+  std::vector<TaskPoses> &operator[](const RobotTaskPair &rtp) {
+    if (lazy && poses.count(rtp) == 0) {
+      const auto res = lazy->get(rtp);
+      if (res != nullptr) {
+        return *res;
+      }
+    }
+    return poses[rtp];
+  }
+
+  template <class InputIt> void insert(InputIt first, InputIt last) {
+    poses.insert(first, last);
+  }
+
+  iterator begin() { return poses.begin(); }
+  iterator end() { return poses.end(); }
+  const_iterator begin() const { return poses.begin(); }
+  const_iterator end() const { return poses.end(); }
+
+  size_t size() const {
+    return poses.size() + (lazy ? lazy->num_feasible() : 0);
+  }
+
+  bool empty() const { return size() == 0; }
+
+  bool is_lazy() const { return lazy != nullptr; }
+
+  std::shared_ptr<LazyKeyframes> get_lazy_keyframes() const { return lazy; }
+
+  // All pairs that are potentially feasible. For the lazy map, this does not
+  // trigger the computation of the keyframes.
+  std::vector<RobotTaskPair> candidates() const {
+    std::vector<RobotTaskPair> res;
+    for (const auto &e : poses) {
+      res.push_back(e.first);
+    }
+    if (lazy) {
+      for (const auto &rtp : lazy->candidates()) {
+        if (poses.count(rtp) == 0) {
+          res.push_back(rtp);
+        }
+      }
+    }
+    return res;
+  }
+
+private:
+  Map poses;
+  std::shared_ptr<LazyKeyframes> lazy;
+};
 
 typedef std::vector<RobotTaskPair> OrderedTaskSequence;
 typedef std::unordered_map<Robot, std::vector<Task>> UnorderedTaskSequence;
@@ -102,10 +352,46 @@ std::string ordered_sequence_to_str(OrderedTaskSequence seq) {
   return ss.str();
 }
 
+// Order dependent hash of a sequence that can be extended task by task, i.e.
+// the hash of a prefix of a sequence is an intermediate result of the hash of
+// the whole sequence.
+const uint64_t empty_sequence_hash = 14695981039346656037ull;
+
+uint64_t extend_sequence_hash(const uint64_t prefix_hash,
+                              const RobotTaskPair &rtp) {
+  // splitmix64 finalizer, to spread the combination of the two hashes
+  uint64_t h = prefix_hash ^ (hash_robot_task_pair(rtp) + 0x9e3779b97f4a7c15ull +
+                              (prefix_hash << 6) + (prefix_hash >> 2));
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+  return h ^ (h >> 31);
+}
+
+uint64_t hash_sequence(const OrderedTaskSequence &seq) {
+  uint64_t h = empty_sequence_hash;
+  for (const auto &rtp : seq) {
+    h = extend_sequence_hash(h, rtp);
+  }
+  return h;
+}
+
+// hashes of all prefixes of the sequence, the i-th element is the hash of the
+// first i+1 tasks.
+std::vector<uint64_t> hash_sequence_prefixes(const OrderedTaskSequence &seq) {
+  std::vector<uint64_t> hashes;
+  hashes.reserve(seq.size());
+
+  uint64_t h = empty_sequence_hash;
+  for (const auto &rtp : seq) {
+    h = extend_sequence_hash(h, rtp);
+    hashes.push_back(h);
+  }
+  return hashes;
+}
+
 template <> struct std::hash<OrderedTaskSequence> {
   std::size_t operator()(OrderedTaskSequence const &seq) const {
-    std::hash<std::string> hasher;
-    return hasher(ordered_sequence_to_str(seq));
+    return hash_sequence(seq);
   }
 };
 
@@ -120,6 +406,11 @@ struct ComputeStatistics {
   double rrt_smoothing_time;
 
   double komo_compute_time;
+
+  // number of horizons that KOMO was run with, and whether the last run met
+  // the constraints
+  uint komo_attempts = 0;
+  bool komo_converged = false;
 };
 
 // this is the solution of one task
@@ -139,7 +430,7 @@ struct TaskPart {
   Robot r;
   uint task_index;
 
-  PrimitiveType primitive_type;
+  PrimitiveType primitive_type = PrimitiveType::go_to;
   // action name
   std::string name;
 
@@ -189,6 +480,10 @@ struct PlanResult {
 
   PlanStatus status;
   Plan plan;
+
+  // index of the task in the sequence that could not be planned if the status
+  // is failed. -1 if the failure is not due to a task.
+  int failed_task_index = -1;
 };
 
 double get_makespan_from_plan(const Plan &plan) {
@@ -666,7 +961,9 @@ void export_plan(rai::Configuration C, const std::vector<Robot> &robots,
           << ", " << task.stats.rrt_nn_time << ", "
           << task.stats.rrt_smoothing_time << ", "
           << task.stats.rrt_shortcut_time << ", "
-          << task.stats.komo_compute_time << "; ";
+          << task.stats.komo_compute_time << ", "
+          << task.stats.komo_attempts << ", " << task.stats.komo_converged
+          << "; ";
       }
       f << std::endl;
     }
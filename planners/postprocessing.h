@@ -9,12 +9,20 @@
 #include <PlanningSubroutines/ConfigurationProblem.h>
 #include <Kin/F_qFeatures.h>
 
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <thread>
+
 #include "common/util.h"
 #include "common/config.h"
 
-arr constructShortcutPath(const rai::Configuration &C, const arr &path,
-                          const uint i, const uint j,
-                          const std::vector<uint> short_ind) {
+#include "edge_checker.h"
+
+// joints whose state wraps around at +-pi. Computed once per configuration,
+// since it does not change during shortcutting.
+std::vector<bool> get_periodic_dimensions(const rai::Configuration &C) {
   auto periodicDimensions = std::vector<bool>(C.getJointState().N, false);
 
   for (auto *j : C.activeJoints) {
@@ -24,8 +32,12 @@ arr constructShortcutPath(const rai::Configuration &C, const arr &path,
     }
   }
 
-  const arr p1 = path[i]();
-  const arr p2 = path[j]();
+  return periodicDimensions;
+}
+
+// difference p2 - p1, taking the shorter direction for periodic joints
+arr periodic_delta(const std::vector<bool> &periodicDimensions, const arr &p1,
+                   const arr &p2) {
   arr delta = p2 - p1;
   for (uint l = 0; l < delta.N; ++l) {
     if (periodicDimensions[l]) {
@@ -33,15 +45,23 @@ arr constructShortcutPath(const rai::Configuration &C, const arr &path,
       const double start = p2(l);
       const double end = p1(l);
       delta(l) = std::fmod(start - end + 3. * RAI_PI, 2 * RAI_PI) - RAI_PI;
-      // delta(l) = start - end;
     }
   }
+  return delta;
+}
+
+// interpolates linearly between path[i] and path[j] in the dimensions that
+// are set in shortcut_mask, the other dimensions are copied from the path.
+arr constructShortcutPath(const std::vector<bool> &periodicDimensions,
+                          const arr &path, const uint i, const uint j,
+                          const std::vector<bool> &shortcut_mask) {
+  const arr delta = periodic_delta(periodicDimensions, path[i], path[j]);
 
   arr p(j - i + 1, path.d1);
 
   for (uint l = 0; l < p.d0; ++l) {
     for (uint k = 0; k < path.d1; ++k) {
-      if (std::find(short_ind.begin(), short_ind.end(), k) != short_ind.end()) {
+      if (shortcut_mask[k]) {
         const double a = 1. * l / (j - i);
         p(l, k) = path(i, k) + a * (delta(k));
 
@@ -58,6 +78,17 @@ arr constructShortcutPath(const rai::Configuration &C, const arr &path,
   return p;
 }
 
+arr constructShortcutPath(const rai::Configuration &C, const arr &path,
+                          const uint i, const uint j,
+                          const std::vector<uint> short_ind) {
+  std::vector<bool> shortcut_mask(path.d1, false);
+  for (const uint k : short_ind) {
+    shortcut_mask[k] = true;
+  }
+  return constructShortcutPath(get_periodic_dimensions(C), path, i, j,
+                               shortcut_mask);
+}
+
 double corput(int n, const int base = 2) {
   double q = 0, bk = (double)1 / base;
 
@@ -70,42 +101,327 @@ double corput(int n, const int base = 2) {
   return q;
 }
 
+double segment_cost(const std::vector<bool> &periodicDimensions,
+                    const arr &p1, const arr &p2, const bool inf_norm = true) {
+  const arr delta = periodic_delta(periodicDimensions, p1, p2);
+  if (!inf_norm) {
+    return length(delta);
+  }
+  return absMax(delta);
+}
+
 // compute path length while considering periodic dimensions
-const double path_length(const rai::Configuration &C, const arr &path, const bool inf_norm=true) {
+double path_length(const std::vector<bool> &periodicDimensions,
+                   const arr &path, const bool inf_norm = true) {
   double cost = 0.;
-  auto periodicDimensions = std::vector<bool>(C.getJointState().N, false);
+  for (uint i = 0; i + 1 < path.d0; ++i) {
+    cost += segment_cost(periodicDimensions, path[i], path[i + 1], inf_norm);
+  }
+  return cost;
+}
 
-  for (auto *j : C.activeJoints) {
-    if (j->type == rai::JT_hingeX || j->type == rai::JT_hingeY ||
-        j->type == rai::JT_hingeZ) {
-      periodicDimensions[j->qIndex] = true;
+const double path_length(const rai::Configuration &C, const arr &path, const bool inf_norm=true) {
+  return path_length(get_periodic_dimensions(C), path, inf_norm);
+}
+
+// Costs of the segments (path[k], path[k+1]) of a path in a Fenwick tree, such
+// that the cost of a part of the path, and updating the costs after a
+// shortcut, only take time logarithmic in the length of the path.
+class SegmentCosts {
+public:
+  SegmentCosts(const std::vector<bool> &_periodicDimensions, const arr &path,
+               const bool _inf_norm = true)
+      : periodicDimensions(_periodicDimensions), inf_norm(_inf_norm),
+        costs(path.d0 > 0 ? path.d0 - 1 : 0, 0.),
+        tree(costs.size() + 1, 0.) {
+    for (uint k = 0; k < costs.size(); ++k) {
+      set(k, segment_cost(periodicDimensions, path[k], path[k + 1], inf_norm));
+    }
+  }
+
+  // cost of the path from index i to index j
+  double get_cost(const uint i, const uint j) const {
+    return prefix_sum(j) - prefix_sum(i);
+  }
+
+  double get_total_cost() const { return prefix_sum(costs.size()); }
+
+  // the path was changed between index i and index j
+  void update(const arr &path, const uint i, const uint j) {
+    for (uint k = i; k < j; ++k) {
+      set(k, segment_cost(periodicDimensions, path[k], path[k + 1], inf_norm));
+    }
+  }
+
+private:
+  void set(const uint k, const double cost) {
+    const double diff = cost - costs[k];
+    costs[k] = cost;
+    for (uint n = k + 1; n < tree.size(); n += n & (~n + 1)) {
+      tree[n] += diff;
     }
   }
 
-  for (uint i = 0; i < path.d0 - 1; ++i) {
-    arr delta = path[i] - path[i+1];
+  // sum of the costs of the first n segments
+  double prefix_sum(uint n) const {
+    double sum = 0.;
+    for (; n > 0; n -= n & (~n + 1)) {
+      sum += tree[n];
+    }
+    return sum;
+  }
+
+  std::vector<bool> periodicDimensions;
+  bool inf_norm;
+
+  std::vector<double> costs;
+  std::vector<double> tree;
+};
+
+// samples the start and end index of a shortcut. Shortcuts do not cross the
+// time up to which the frames are preplanned.
+void sample_shortcut_indices(const TimedConfigurationProblem &TP,
+                             const uint path_length, const uint t0, uint &i,
+                             uint &j) {
+  while (true) {
+    i = get_thread_rng()() % path_length;
+    j = get_thread_rng()() % path_length;
+
+    if (i > j) {
+      std::swap(i, j);
+    }
+   
+    if (j-i > 1 &&
+        (TP.A.prePlannedFrames.N == 0 ||
+         (TP.A.prePlannedFrames.N > 0 &&
+          ((i >= TP.A.tPrePlanned - t0 && j >= TP.A.tPrePlanned - t0) ||
+           (i <= TP.A.tPrePlanned - t0 && j <= TP.A.tPrePlanned - t0))))) {
+      break;
+    }
+  }
+}
+
+// projects the part of the shortcut that overlaps with preplanned frames
+void project_shortcut(const TimedConfigurationProblem &TP,
+                      PathFinder_RRT_Time &planner, arr &ps, const uint i,
+                      const uint t0) {
+  if (TP.A.prePlannedFrames.N > 0){
+    for (uint n=0; n<ps.d0; ++n){
+      // project path
+      if (t0 + i + n <= TP.A.tPrePlanned){
+        const arr pProjected = planner.projectToManifold(ps[n], t0 + i + n);
+        ps[n] = pProjected*1.;
+      }
+
+      // planner.TP.C.setJointState(ps[n]);
+      // TP.query(ps[n], t0 + i + n);
+      // if (TP.A.prePlannedFrames.N != 0) planner.TP.C.watch(true);
+    }
+  }
+}
+
+// check if the new path is feasible (interpolate). The segments are checked
+// in random order, and each segment in van der corput order, such that a
+// collision is found early. If an edge checker is given, the segments are
+// checked continuously instead. The points are checked with the static sdf
+// query if one is given.
+bool shortcut_is_feasible(TimedConfigurationProblem &TP, const arr &ps,
+                          const uint i, const uint t0, const double resolution,
+                          std::mt19937 &rng, EdgeChecker *checker = nullptr,
+                          StaticSdfQuery *sdf_query = nullptr) {
+  std::vector<uint> q(ps.d0 - 1);
+  std::iota(q.begin(), q.end(), 0);
+  std::shuffle(q.begin(), q.end(), rng);
+
+  for (const uint n : q) {
+    if (checker != nullptr) {
+      if (!checker->check_edge(ps[n], t0 + i + n, ps[n + 1], t0 + i + n + 1)) {
+        return false;
+      }
+      continue;
+    }
+
+    const arr dir = ps[n + 1] - ps[n];
+    const double dist = length(dir);
+    const uint num_pts = uint(std::max(dist / resolution, 1.));
+    for (uint l = 0; l < num_pts; ++l) {
+      const double interp = corput(l);
+      const arr point = ps[n] + interp * 1. * dir;
+      const double t = t0 + i + n + 1. * interp;
+
+      // std::cout << t << " " << point << std::endl;
+
+      const auto qr = sdf_query != nullptr ? sdf_query->query(point, t)
+                                           : TP.query(point, t);
 
-    for (uint l = 0; l < delta.N; ++l) {
-      if (periodicDimensions[l]) {
-        // this is an angular joint -> we need to check the other direction
-        const double start = path[i](l);
-        const double end = path[i+1](l);
-        delta(l) = std::fmod(start - end + 3. * RAI_PI, 2 * RAI_PI) - RAI_PI;
+      if (!qr->isFeasible) {
+        // std::cout << "A" << std::endl;
+        return false;
       }
     }
+  }
+  return true;
+}
+
+// A batch of shortcuts on disjoint parts of the path. The shortcuts are
+// checked on global_params.shortcut_threads workers, each with its own copy
+// of the problem (and thus its own collision checker). Since the shortcuts
+// do not overlap, all feasible ones can be applied at once.
+arr partial_spacetime_shortcut_batched(TimedConfigurationProblem &TP,
+                                       const arr &initialPath,
+                                       const uint t0,
+                                       StaticSdfQuery *sdf_query = nullptr) {
+  const uint max_iter = 100;
+  const double resolution = 0.1;
+  const uint batch_size = global_params.shortcut_batch_size;
+  const uint num_threads = std::max(1u, global_params.shortcut_threads);
 
-    if (!inf_norm) {
-      cost += length(delta);
+  arr smoothedPath = initialPath;
+
+  const std::vector<bool> periodicDimensions =
+      get_periodic_dimensions(TP.C);
+  const std::vector<bool> shortcut_mask(smoothedPath.d1, true);
+
+  SegmentCosts segment_costs(periodicDimensions, smoothedPath);
+  const double initial_cost = segment_costs.get_total_cost();
+
+  // the first worker uses the given problem
+  std::vector<std::unique_ptr<TimedConfigurationProblem>> problems;
+  std::vector<TimedConfigurationProblem *> workers = {&TP};
+  for (uint w = 1; w < num_threads; ++w) {
+    problems.push_back(
+        std::make_unique<TimedConfigurationProblem>(TP.C, TP.A));
+    problems.back()->activeOnly = TP.activeOnly;
+    problems.back()->C.fcl()->deactivatePairs(get_cant_collide_pairs(TP.C));
+    problems.back()->C.fcl()->stopEarly =
+        global_params.use_early_coll_check_stopping;
+    workers.push_back(problems.back().get());
+  }
+
+  // hack, since I didnt wanna move my projection method
+  std::vector<std::unique_ptr<PathFinder_RRT_Time>> planners;
+
+  // the first worker uses the given sdf query, the others their own
+  std::vector<std::unique_ptr<StaticSdfQuery>> own_sdf_queries;
+  std::vector<StaticSdfQuery *> sdf_queries = {sdf_query};
+  for (uint w = 1; w < workers.size() && sdf_query != nullptr; ++w) {
+    own_sdf_queries.push_back(std::make_unique<StaticSdfQuery>(*workers[w]));
+    sdf_queries.push_back(own_sdf_queries.back().get());
+  }
+
+  std::vector<std::unique_ptr<EdgeChecker>> checkers;
+  for (uint w = 0; w < workers.size(); ++w) {
+    planners.push_back(std::make_unique<PathFinder_RRT_Time>(*workers[w]));
+    if (global_params.use_edge_checker) {
+      checkers.push_back(std::make_unique<EdgeChecker>(
+          *workers[w], sdf_query != nullptr ? sdf_queries[w] : nullptr));
+    }
+  }
+
+  struct Candidate {
+    uint i;
+    uint j;
+    uint seed;
+    arr path;
+    bool accepted = false;
+  };
+
+  uint k = 0;
+  uint num_rounds_without_improvement = 0;
+  while (k < max_iter) {
+    // sample non-overlapping shortcuts
+    std::vector<Candidate> candidates;
+    for (uint attempt = 0; attempt < 10 * batch_size &&
+                           candidates.size() < batch_size && k < max_iter;
+         ++attempt) {
+      Candidate c;
+      sample_shortcut_indices(TP, smoothedPath.d0, t0, c.i, c.j);
+
+      bool overlaps = false;
+      for (const auto &o : candidates) {
+        if (c.i < o.j && o.i < c.j) {
+          overlaps = true;
+          break;
+        }
+      }
+      if (overlaps) {
+        continue;
+      }
+
+      c.seed = get_thread_rng()();
+      candidates.push_back(c);
+      ++k;
+    }
+
+    std::mutex projection_mutex;
+    auto worker = [&](const uint w) {
+      TimedConfigurationProblem &TPWorker = *workers[w];
+      PathFinder_RRT_Time &planner = *planners[w];
+
+      for (uint n = w; n < candidates.size(); n += workers.size()) {
+        Candidate &c = candidates[n];
+        std::mt19937 rng(c.seed);
+
+        c.path = constructShortcutPath(periodicDimensions, smoothedPath, c.i,
+                                       c.j, shortcut_mask);
+        {
+          // the projection sets up komo, which reads the rai parameters
+          std::lock_guard<std::mutex> lock(projection_mutex);
+          project_shortcut(TPWorker, planner, c.path, c.i, t0);
+        }
+
+        if (segment_costs.get_cost(c.i, c.j) <=
+            path_length(periodicDimensions, c.path)) {
+          continue;
+        }
+
+        c.accepted = shortcut_is_feasible(
+            TPWorker, c.path, c.i, t0, resolution, rng,
+            checkers.empty() ? nullptr : checkers[w].get(),
+            sdf_query != nullptr ? sdf_queries[w] : nullptr);
+      }
+    };
+
+    if (workers.size() == 1) {
+      worker(0);
     } else {
-      cost += absMax(delta);
+      std::vector<std::thread> threads;
+      for (uint w = 0; w < workers.size(); ++w) {
+        threads.emplace_back(worker, w);
+      }
+      for (auto &thread : threads) {
+        thread.join();
+      }
+    }
+
+    bool improved = false;
+    for (const auto &c : candidates) {
+      if (!c.accepted) {
+        continue;
+      }
+      for (uint n = 1; n < c.path.d0; ++n) {
+        smoothedPath[c.i + n] = c.path[n];
+      }
+      segment_costs.update(smoothedPath, c.i, c.j);
+      improved = true;
+    }
+
+    // proxy measure for convergence: no improvement in a quarter of the
+    // shortcut budget
+    num_rounds_without_improvement = improved ? 0 : num_rounds_without_improvement + 1;
+    if (num_rounds_without_improvement * batch_size >= max_iter / 4) {
+      spdlog::info("Converged after {}, iterations", k);
+      break;
     }
   }
 
-  return cost;
+  spdlog::info("Change in path cost {}, {}", initial_cost,
+               segment_costs.get_total_cost());
+  return smoothedPath;
 }
 
 arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initialPath,
-                     const uint t0) {
+                     const uint t0, StaticSdfQuery *sdf_query = nullptr) {
   spdlog::info("Starting shortcutting");
   // We do not currently support preplaned frames here
   // if (TP.A.prePlannedFrames.N != 0) {
@@ -114,6 +430,10 @@ arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initial
 
   TP.C.fcl()->stopEarly = global_params.use_early_coll_check_stopping;
 
+  if (global_params.shortcut_batch_size > 1) {
+    return partial_spacetime_shortcut_batched(TP, initialPath, t0, sdf_query);
+  }
+
   arr smoothedPath = initialPath;
   /*for (uint i=0; i<smoothedPath.d0; i+=4){
     TP.query(smoothedPath[i], t0 + i);
@@ -123,8 +443,21 @@ arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initial
   // hack, since I didnt wanna move my projection method
   PathFinder_RRT_Time planner(TP);
 
+  const std::vector<bool> periodicDimensions =
+      get_periodic_dimensions(TP.C);
+
+  // all dimensions are shortcut
+  const std::vector<bool> shortcut_mask(smoothedPath.d1, true);
+
+  SegmentCosts segment_costs(periodicDimensions, smoothedPath);
+
+  std::unique_ptr<EdgeChecker> checker;
+  if (global_params.use_edge_checker) {
+    checker = std::make_unique<EdgeChecker>(TP, sdf_query);
+  }
+
   std::vector<double> costs;
-  costs.push_back(path_length(TP.C, initialPath));
+  costs.push_back(segment_costs.get_total_cost());
 
   const uint max_iter = 100;
   // const uint resolution = 2;
@@ -134,88 +467,24 @@ arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initial
   for (uint k = 0; k < max_iter; ++k) {
     // choose random indices
     uint i, j;
-    while (true) {
-      i = rand() % initialPath.d0;
-      j = rand() % initialPath.d0; 
-
-      if (i > j) {
-        std::swap(i, j);
-      }
-     
-      if (j-i > 1 &&
-          (TP.A.prePlannedFrames.N == 0 ||
-           (TP.A.prePlannedFrames.N > 0 &&
-            ((i >= TP.A.tPrePlanned - t0 && j >= TP.A.tPrePlanned - t0) ||
-             (i <= TP.A.tPrePlanned - t0 && j <= TP.A.tPrePlanned - t0))))) {
-        break;
-      }
-    }
-
-    // choose which indices to shortcut
-    std::vector<uint> ind;
-    for (uint q = 0; q < smoothedPath.d1; ++q) {
-      ind.push_back(q);
-
-      // const double r = 1. * rand() / RAND_MAX;
-      //if (r > 1. / smoothedPath.d1) {
-        // ind.push_back(q);
-      //}
-    }
+    sample_shortcut_indices(TP, initialPath.d0, t0, i, j);
 
     // construct the new path
-    auto p = constructShortcutPath(TP.C, smoothedPath, i, j, {});
-    auto ps = constructShortcutPath(TP.C, smoothedPath, i, j, ind);
-    
-    if (TP.A.prePlannedFrames.N > 0){
-      for (uint n=0; n<ps.d0; ++n){
-        // project path
-        if (t0 + i + n <= TP.A.tPrePlanned){
-          const arr pProjected = planner.projectToManifold(ps[n], t0 + i + n);
-          ps[n] = pProjected*1.;
-        }
-
-        // planner.TP.C.setJointState(ps[n]);
-        // TP.query(ps[n], t0 + i + n);
-        // if (TP.A.prePlannedFrames.N != 0) planner.TP.C.watch(true);
-      }
-    }
+    auto ps = constructShortcutPath(periodicDimensions, smoothedPath, i, j,
+                                    shortcut_mask);
+    project_shortcut(TP, planner, ps, i, t0);
 
-    const double len = path_length(TP.C, ps);
+    const double len = path_length(periodicDimensions, ps);
 
     // if the path length of the shortcut path is not shorter than the original one, don't consider it
-    if (path_length(TP.C, p) <= len){
+    if (segment_costs.get_cost(i, j) <= len){
       continue;
     }
 
-    // check if the new path is feasible (interpolate)
-    // permute the indices that we check
-    uintA q;
-    q.setStraightPerm(j - i);
-    q.permuteRandomly();
-
-    // enable not checking everything here
-    bool shortcutFeasible = true;
-    for (const uint n : q) {
-      const arr dir = ps[n + 1] - ps[n];
-      const double dist = length(dir);
-      const uint num_pts = uint(std::max(dist / resolution, 1.));
-      for (uint l = 0; l < num_pts; ++l) {
-        const double interp = corput(l);
-        const arr point = ps[n] + interp * 1. * dir;
-        const double t = t0 + i + n + 1. * interp;
-
-        // std::cout << t << " " << point << std::endl;
-
-        const auto qr = TP.query(point, t);
-
-        if (!qr->isFeasible) {
-          // std::cout << "A" << std::endl;
-          shortcutFeasible = false;
-          break;
-        }
-      }
-      if (!shortcutFeasible){break;}
-    }
+    std::mt19937 rng(get_thread_rng()());
+    const bool shortcutFeasible =
+        shortcut_is_feasible(TP, ps, i, t0, resolution, rng, checker.get(),
+                             sdf_query);
 
     // if path is valid, copy it over
     // we already know that it is shorter (from the check above)
@@ -223,10 +492,10 @@ arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initial
       for (uint n = 1; n < ps.d0; ++n) {
         smoothedPath[i + n] = ps[n];
       }
+      segment_costs.update(smoothedPath, i, j);
     }
 
-    const auto c = path_length(TP.C, smoothedPath);
-    costs.push_back(c);
+    costs.push_back(segment_costs.get_total_cost());
 
     // proxy measure for convergence
     const uint conv = 100;
@@ -237,64 +506,23 @@ arr partial_spacetime_shortcut(TimedConfigurationProblem &TP, const arr &initial
   }
 
   spdlog::info("Change in path cost {}, {}", costs[0], costs.back());
+  if (checker) {
+    spdlog::info("Edge checker: {} queries, {} minimum steps",
+                 checker->get_num_queries(), checker->get_num_min_steps());
+  }
   return smoothedPath;
 }
 
-// this currently happens in full resolution, this tends to be slow
-// mostly due to the necessary collision checks that are done
-arr smoothing(const rai::Animation &A, rai::Configuration &C, const arr &ts,
-              const arr &path, const std::string prefix) {
-  if (A.prePlannedFrames.N != 0) {
-    return path;
-  }
-
-  const double skip = 1;
-  const uint num_timesteps = ts.N / skip;
-
-  arr scaled_ts(num_timesteps);
-  for (uint i=0; i<num_timesteps; ++i){
-    scaled_ts(i) = ts(0) + (ts(-1) - ts(0)) / (num_timesteps-1) * i;
-  }
-
-  TimedPath tp(path, ts);
-  arr scaled_path = tp.resample(scaled_ts, C);
-  // const arr scaled_path = tmp;
-
-   // correct path for periodic stuff - komo does not deal well with transition from -pi to pi
-  auto periodicDimensions = std::vector<bool>(C.getJointState().N, false);
-
-  for (auto *j: C.activeJoints){
-    if (j->type == rai::JT_hingeX || j->type == rai::JT_hingeY|| j->type == rai::JT_hingeZ){
-      periodicDimensions[j->qIndex] = true;
-    }
-  }
-
-  arr tmp(scaled_path.d0, scaled_path.d1);
-  tmp = 0;
-  tmp[0] = scaled_path[0]();
-
-  for (uint i=0; i<scaled_path.d0-1; ++i){
-    const arr p1 = scaled_path[i]();
-    const arr p2 = scaled_path[i+1]();
-    arr delta = p2 - p1;
-    for (uint j=0; j<delta.N; ++j){
-      if (periodicDimensions[j]){
-        // this is an angular joint -> we need to check the other direction
-        const double start = p2(j);
-        const double end = p1(j);
-        delta(j) = std::fmod(start - end + 3.*RAI_PI, 2*RAI_PI) - RAI_PI;
-      }
-    }
-    
-    tmp[i+1] = tmp[i] + delta;
-    // std::cout << path[i] << std::endl;
-    // std::cout << tmp[i] << std::endl;
-  }
-
-  scaled_path = tmp;
+// Runs KOMO on the given path at the times scaled_ts, with the other robots
+// at the states of the animation. The path is used as initialization. Returns
+// an empty path if the constraints are violated.
+arr smooth_with_komo(rai::Configuration &C, AnimationFrameCache &anim,
+                     const arr &scaled_ts, const arr &scaled_path,
+                     const std::string prefix, const uint stop_iters = 50) {
+  const uint num_timesteps = scaled_path.d0;
 
   OptOptions options;
-  options.stopIters = 50;
+  options.stopIters = stop_iters;
   options.damping = 10;
   // options.stopTolerance = 0.1;
   options.allowOverstep = false;
@@ -302,9 +530,6 @@ arr smoothing(const rai::Animation &A, rai::Configuration &C, const arr &ts,
   options.wolfe = 0.001;
   // options.maxStep = 0.01;
 
-  auto pairs = get_cant_collide_pairs(C);
-  C.fcl()->deactivatePairs(pairs);
-
   spdlog::debug("setting up komo for smoothing");
 
   KOMO komo;
@@ -329,7 +554,7 @@ arr smoothing(const rai::Animation &A, rai::Configuration &C, const arr &ts,
 
   // komo.add_qControlObjective({}, 3, 1e-1);
 
-  setKomoToAnimation(komo, C, A, scaled_ts);
+  setKomoToAnimation(komo, anim, scaled_ts);
 
   komo.setConfiguration(-2, scaled_path[0]);
   komo.setConfiguration(-1, scaled_path[0]);
@@ -362,43 +587,19 @@ arr smoothing(const rai::Animation &A, rai::Configuration &C, const arr &ts,
                     2); // slow at end
 
   for (uint j = 0; j < num_timesteps; ++j) {
-    // interpolate q
-    //arr q = path[next_idx] - path[prev_idx];
-    //const arr q = path[j*skip];
-    const arr q = scaled_path[j];
-    komo.setConfiguration(j, q);
-
-    // komo.addObjective({1. * j/num_timesteps}, FS_qItself, {}, OT_sos, {1e1}, q);
+    komo.setConfiguration(j, scaled_path[j]);
   }
 
-  // komo.addObjective({0.5}, FS_qItself, {}, OT_eq, {1e2}, scaled_path[int(num_timesteps / 2)]);
-
   spdlog::debug("running komo");
   komo.run_prepare(0.0);
-
-  // std::cout << "A" <<std::endl;
-  // std::cout << komo.getPath_q(-1) << std::endl;
-  // std::cout << komo.getPath_q(-2) << std::endl;
-  // std::cout << komo.getPath_q(0) << std::endl;
-
-  // std::cout << "B" <<std::endl;
-  // std::cout << komo.pathConfig.getJointStateSlice(2) << std::endl;
-  // std::cout << scaled_path[0] << std::endl;
-
-  // std::cout << "A" <<std::endl;
-
-  // std::cout << komo.pathConfig.getJointStateSlice(num_timesteps) << std::endl;
-  // std::cout << scaled_path[-1] << std::endl;
-
-  // komo.pathConfig.watch(true);
-
   komo.run(options);
   spdlog::debug("done komo");
 
   const double ineq = komo.getReport(false).get<double>("ineq");
   const double eq = komo.getReport(false).get<double>("eq");
 
-  spdlog::info("smoothing komo ineq: {} eq: {}", ineq, eq);
+  spdlog::info("smoothing komo ({} steps) ineq: {} eq: {}", num_timesteps, ineq,
+               eq);
 
   if (eq > 2 || ineq > 2){
     // komo.getReport(true);
@@ -406,19 +607,92 @@ arr smoothing(const rai::Animation &A, rai::Configuration &C, const arr &ts,
     return {};
   }
 
-  // komo.pathConfig.watch(true);
-
-  // check if the path is actually feasible
-  arr smooth(scaled_ts.N, path[0].N);
-  for (uint j = 0; j < scaled_ts.N; ++j) {
+  arr smooth(num_timesteps, scaled_path.d1);
+  for (uint j = 0; j < num_timesteps; ++j) {
     smooth[j] = komo.getPath_q(j);
   }
-  
+
   // force boundary conditions to be true
   smooth[0] = scaled_path[0];
   smooth[-1] = scaled_path[-1];
 
-  TimedPath tp_smooth(smooth, scaled_ts);
+  return smooth;
+}
+
+// Coarse-to-fine smoothing: the path is first smoothed with a fraction of the
+// timesteps, and the result is upsampled as initialization of the next finer
+// level, such that the expensive full resolution optimization only needs few
+// iterations. The number of levels is global_params.smoothing_levels, every
+// level doubles the resolution. The states of the animated frames are only
+// computed once for the whole time window.
+arr smoothing(const rai::Animation &A, rai::Configuration &C, const arr &ts,
+              const arr &path, const std::string prefix) {
+  if (A.prePlannedFrames.N != 0) {
+    return path;
+  }
+
+  const uint num_levels = std::max(1u, global_params.smoothing_levels);
+  const uint num_timesteps = ts.N;
+
+  // correct path for periodic stuff - komo does not deal well with transition
+  // from -pi to pi
+  const std::vector<bool> periodicDimensions = get_periodic_dimensions(C);
+
+  arr unwrapped_path(path.d0, path.d1);
+  unwrapped_path[0] = path[0];
+  for (uint i = 0; i + 1 < path.d0; ++i) {
+    unwrapped_path[i + 1] =
+        unwrapped_path[i] + periodic_delta(periodicDimensions, path[i], path[i + 1]);
+  }
+
+  auto pairs = get_cant_collide_pairs(C);
+  C.fcl()->deactivatePairs(pairs);
+
+  // the times in setKomoToAnimation are truncated to full timesteps, i.e. all
+  // levels share the states at the full timesteps of the window.
+  AnimationFrameCache anim(C, A);
+
+  arr smooth;
+  arr smooth_ts;
+  for (int level = num_levels - 1; level >= 0; --level) {
+    const uint factor = 1u << level;
+    const uint n = std::max(4u, (num_timesteps - 1) / factor + 1);
+    if (level > 0 && n >= num_timesteps) {
+      continue;
+    }
+
+    arr scaled_ts(n);
+    for (uint i = 0; i < n; ++i) {
+      scaled_ts(i) = ts(0) + (ts(-1) - ts(0)) / (n - 1) * i;
+    }
+
+    // warm start from the coarser level if it succeeded
+    arr init;
+    if (smooth.N > 0) {
+      init = TimedPath(smooth, smooth_ts).resample(scaled_ts, C);
+    } else {
+      init = TimedPath(unwrapped_path, ts).resample(scaled_ts, C);
+    }
+
+    // the finer levels only refine the initialization
+    const uint stop_iters = smooth.N > 0 ? 20 : 50;
+    const arr res = smooth_with_komo(C, anim, scaled_ts, init, prefix, stop_iters);
+
+    if (res.N == 0) {
+      if (level == 0) {
+        return {};
+      }
+      spdlog::info("Smoothing at {} steps failed, continuing without warm start",
+                   n);
+      smooth.clear();
+      continue;
+    }
+
+    smooth = res;
+    smooth_ts = scaled_ts;
+  }
+
+  TimedPath tp_smooth(smooth, smooth_ts);
   arr unscaled_path = tp_smooth.resample(ts, C);
 
   spdlog::info("Done with smoothing");
@@ -426,6 +700,195 @@ arr smoothing(const rai::Animation &A, rai::Configuration &C, const arr &ts,
 }
 
 
+// A window of the joint trajectory of all robots that is reoptimized with
+// KOMO. The first and last configuration of the window stay fixed.
+struct ReoptimizationWindow {
+  uint start;
+  uint length;
+};
+
+// Runs KOMO on a single window of the trajectory. The window is initialized
+// with the current trajectory, and the configurations before the window are
+// used as prefix. Returns an empty array if the result violates the
+// constraints or is in collision.
+arr reoptimize_window(rai::Configuration &C, TimedConfigurationProblem &TP,
+                      const arr &path, const ReoptimizationWindow &w,
+                      const Plan &plan,
+                      const std::unordered_map<Robot, StringA> &per_robot_joints,
+                      StaticSdfQuery *sdf_query = nullptr) {
+  // KOMO and OptOptions read the rai parameters while they are set up, which
+  // is not thread safe. Only the optimization runs in parallel.
+  static std::mutex setup_mutex;
+  std::unique_lock<std::mutex> setup_lock(setup_mutex);
+
+  OptOptions options;
+  options.stopIters = 10;
+
+  KOMO komo;
+  komo.setModel(C, true);
+  komo.setTiming(1., w.length, 1, 2);
+  komo.verbose = 0;
+  komo.solver = rai::KS_sparse;
+
+  komo.add_collision(true, .001, 1e1);
+  komo.add_qControlObjective({}, 2, 1e1);
+  komo.add_qControlObjective({}, 1, 1e1);
+
+  // start constraint
+  const uint i = w.start;
+  komo.setConfiguration(-2, path[i >= 2 ? i - 2 : 0]);
+  komo.setConfiguration(-1, path[i >= 1 ? i - 1 : 0]);
+  komo.setConfiguration(0, path[i]);
+
+  // warm start
+  for (uint j = 0; j < w.length; ++j) {
+    komo.setConfiguration(j, path[i + j]);
+  }
+
+  // goal constraint
+  komo.addObjective({1}, FS_qItself, {}, OT_eq, {1e1}, path[i + w.length]);
+
+  // the robots need to be at the keyframes of the tasks when they end
+  for (const auto &robot_tasks : plan) {
+    const auto r = robot_tasks.first;
+    for (const auto &task : robot_tasks.second) {
+      const double task_end_time = task.t(0) + task.t.d0;
+      if (task_end_time < i || task_end_time >= i + w.length) {
+        continue;
+      }
+
+      const double scaled_time = 1. * (task_end_time - i) / w.length;
+      const double constr_start_time =
+          std::max(0., scaled_time - 0.5 / w.length);
+      const double constr_end_time =
+          std::min(1., scaled_time + 0.5 / w.length);
+
+      // position
+      komo.addObjective({constr_start_time, constr_end_time},
+                        make_shared<F_qItself>(F_qItself::byJointNames,
+                                               per_robot_joints.at(r),
+                                               komo.world),
+                        {}, OT_eq, {1e1}, task.path[-1]);
+
+      // velocity
+      komo.addObjective({constr_start_time, constr_end_time},
+                        make_shared<F_qItself>(F_qItself::byJointNames,
+                                               per_robot_joints.at(r),
+                                               komo.world),
+                        {}, OT_eq, {1e1}, {}, 1);
+    }
+  }
+
+  setup_lock.unlock();
+
+  komo.run_prepare(0.0, true);
+  komo.run(options);
+
+  const double ineq = komo.getReport(false).get<double>("ineq");
+  const double eq = komo.getReport(false).get<double>("eq");
+  spdlog::debug("reoptimized window at {}: ineq {} eq {}", i, ineq, eq);
+
+  if (eq > 2 || ineq > 2) {
+    return {};
+  }
+
+  arr res(w.length, path.d1);
+  for (uint j = 0; j < w.length; ++j) {
+    res[j] = komo.getPath_q(j);
+  }
+  // the start of the window is fixed
+  res[0] = path[i];
+
+  for (uint j = 0; j < w.length; ++j) {
+    const auto qr = sdf_query != nullptr ? sdf_query->query(res[j], i + j)
+                                         : TP.query(res[j], i + j);
+    if (!qr->isFeasible) {
+      spdlog::debug("reoptimized window at {} in collision at {}", i, i + j);
+      return {};
+    }
+  }
+
+  return res;
+}
+
+// the frames of the robots are prefixed with the name of the robot
+bool is_robot_frame_of_plan(const rai::String &name, const Plan &plan) {
+  for (const auto &p : plan) {
+    if (name.contains(STRING(p.first))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The time steps [start, end] in which a task of the plan moves a frame that is
+// not part of a robot, i.e. in which a robot holds an object.
+std::vector<std::pair<uint, uint>> get_carrying_intervals(const Plan &plan) {
+  std::vector<std::pair<uint, uint>> intervals;
+  for (const auto &p : plan) {
+    for (const auto &part : p.second) {
+      if (part.t.N == 0) {
+        continue;
+      }
+      for (const auto &name : part.anim.frameNames) {
+        if (!is_robot_frame_of_plan(name, plan)) {
+          intervals.push_back({uint(part.t(0)), uint(part.t(-1))});
+          break;
+        }
+      }
+    }
+  }
+  return intervals;
+}
+
+// Animation of the frames of the plan that are not part of a robot, i.e. the
+// objects that are carried or placed. The robots themselves are queried at the
+// reoptimized joint states. The carried objects thus follow the original
+// trajectory, which is why windows in which an object is held are not
+// reoptimized.
+rai::Animation make_object_animation_from_plan(const Plan &plan) {
+  rai::Animation A;
+  for (const auto &p : plan) {
+    for (const auto &part : p.second) {
+      const auto &anim = part.anim;
+
+      std::vector<uint> columns;
+      for (uint k = 0; k < anim.frameNames.N; ++k) {
+        if (!is_robot_frame_of_plan(anim.frameNames(k), plan)) {
+          columns.push_back(k);
+        }
+      }
+      if (columns.empty()) {
+        continue;
+      }
+
+      rai::Animation::AnimationPart objects;
+      objects.start = anim.start;
+      objects.X.resize(anim.X.d0, columns.size(), 7);
+      for (uint k = 0; k < columns.size(); ++k) {
+        objects.frameIDs.append(anim.frameIDs(columns[k]));
+        objects.frameNames.append(anim.frameNames(columns[k]));
+        for (uint i = 0; i < anim.X.d0; ++i) {
+          for (uint d = 0; d < 7; ++d) {
+            objects.X(i, k, d) = anim.X(i, columns[k], d);
+          }
+        }
+      }
+      A.A.append(objects);
+    }
+  }
+  return A;
+}
+
+// Reoptimizes the joint trajectory of all robots in windows of
+// horizon_length steps. The windows of one pass do not overlap, and are
+// optimized in parallel on global_params.reoptimization_threads workers, each
+// with its own configuration. A second pass over windows that are shifted by
+// half a window smoothes the transitions between the windows of the first
+// pass. Every window starts from the result of the previous pass, and is only
+// accepted if it is collision free. Windows that overlap a time in which a
+// robot holds an object are skipped: the held object would stay on its
+// original trajectory, detached from the reoptimized end effector.
 Plan reoptimize_plan(rai::Configuration C,
                 const Plan &unscaled_plan,
                 const std::unordered_map<Robot, arr> &home_poses) {
@@ -435,29 +898,40 @@ Plan reoptimize_plan(rai::Configuration C,
     all_robots.push_back(per_robot_plan.first);
   }
 
-  for (const auto &element : all_robots) {
-    std::cout << element << std::endl;
-  }
-
   setActive(C, all_robots);
 
   rai::Animation A = make_animation_from_plan(unscaled_plan);
 
-  setActive(C, all_robots);
+  // the columns of the stacked trajectory are in the order of the active
+  // joints of C, which is the order that KOMO and the collision queries use
+  const uint dim = C.getJointState().N;
+  std::unordered_map<Robot, uint> offsets;
+  for (const auto &r : all_robots) {
+    offsets[r] = dim;
+  }
+  for (auto *j : C.activeJoints) {
+    for (const auto &r : all_robots) {
+      if (j->frame->name.contains(STRING(r))) {
+        offsets[r] = std::min(offsets[r], j->qIndex);
+      }
+    }
+  }
+  for (const auto &r : all_robots) {
+    if (offsets[r] + home_poses.at(r).N > dim) {
+      spdlog::error("Joints of robot {} not found, not reoptimizing.",
+                    r.prefix);
+      return unscaled_plan;
+    }
+  }
 
-  // extract complete trajectory
-  std::cout << "extracting traj" << std::endl;
-  arr smoothed_path(A.getT(), (unscaled_plan.begin()->second)[0].path.d1 *
-                                  all_robots.size());
-  for (uint i = 0; i < A.getT(); ++i) {
-    uint offset = 0;
-    for (uint j = 0; j < all_robots.size(); ++j) {
-      const arr pose =
-          get_robot_pose_at_time(i, all_robots[j], home_poses, unscaled_plan);
+  const uint total_length = A.getT();
+  arr smoothed_path(total_length, dim);
+  for (uint i = 0; i < total_length; ++i) {
+    for (const auto &r : all_robots) {
+      const arr pose = get_robot_pose_at_time(i, r, home_poses, unscaled_plan);
       for (uint k = 0; k < pose.N; ++k) {
-        smoothed_path[i](k + offset) = pose(k);
+        smoothed_path(i, k + offsets[r]) = pose(k);
       }
-      offset += pose.N;
     }
   }
 
@@ -472,151 +946,122 @@ Plan reoptimize_plan(rai::Configuration C,
   }
 
   const uint horizon_length = 50;
-  const uint total_length = A.getT();
-  const uint step_size = 20;
-
-  OptOptions options;
-  options.stopIters = 10;
-  // options.damping = 1e-3;
-  // options.stopLineSteps = 5;
-
-  KOMO komo;
-  komo.setModel(C, true);
-  komo.setTiming(1., horizon_length, 1, 2);
-  komo.verbose = 0;
-  komo.solver = rai::KS_sparse;
+  const uint num_threads = std::max(1u, global_params.reoptimization_threads);
+
+  // the configurations for the workers are copied once
+  std::vector<std::unique_ptr<rai::Configuration>> configurations;
+  std::vector<std::unique_ptr<TimedConfigurationProblem>> problems;
+  std::vector<std::unique_ptr<StaticSdfQuery>> sdf_queries;
+  // the objects are moved as in the original plan
+  const rai::Animation object_animation =
+      make_object_animation_from_plan(unscaled_plan);
+  const auto pairs = get_cant_collide_pairs(C);
+  for (uint k = 0; k < num_threads; ++k) {
+    configurations.push_back(std::make_unique<rai::Configuration>());
+    configurations.back()->copy(C);
+
+    problems.push_back(std::make_unique<TimedConfigurationProblem>(
+        *configurations.back(), object_animation));
+    problems.back()->C.fcl()->deactivatePairs(pairs);
+    problems.back()->activeOnly = true;
+
+    if (global_params.use_static_sdf) {
+      sdf_queries.push_back(std::make_unique<StaticSdfQuery>(*problems.back()));
+    }
+  }
 
-  for (uint i = 0; i < total_length - horizon_length; i += step_size) {
-    std::cout << "iteration " << i << std::endl;
-    komo.add_collision(true, .001, 1e1);
-    komo.add_qControlObjective({}, 2, 1e1);
-    komo.add_qControlObjective({}, 1, 1e1);
-
-    // start constraint
-    if (i > 0) {
-      komo.setConfiguration(-2, smoothed_path[i - 2]);
-      komo.setConfiguration(-1, smoothed_path[i - 1]);
-    }
-
-    const arr q0 = smoothed_path[i];
-    komo.setConfiguration(0, q0);
-
-    for (uint j = 0; j < horizon_length; ++j) {
-      komo.setConfiguration(j, smoothed_path[i + j]);
-    }
-
-    // goal constraint
-    const arr q_final = smoothed_path[i + horizon_length];
-
-    komo.addObjective({1}, FS_qItself, {}, OT_eq, {1e1}, q_final);
-
-    // add constraints for positions of actions
-    // TODO: check if this is actually correct
-    for (const auto &robot_tasks : unscaled_plan) {
-      const auto r = robot_tasks.first;
-      const auto tasks = robot_tasks.second;
-
-      for (const auto &task : tasks) {
-        const double task_end_time = task.t(0) + task.t.d0;
-        if (task_end_time >= i && task_end_time < i + horizon_length) {
-          const double scaled_time = 1. * (task_end_time - i) / horizon_length;
-          const double constr_start_time =
-              std::max(0., scaled_time - 0.5 / horizon_length);
-          const double constr_end_time =
-              std::min(1., scaled_time + 0.5 / horizon_length);
-
-          std::cout << "Adding constraint at time " << task_end_time
-                    << std::endl;
-          std::cout << "for robot " << r << std::endl;
-          std::cout << scaled_time << std::endl;
-          std::cout << constr_start_time << " " << constr_end_time << std::endl;
-
-          // position
-          komo.addObjective({constr_start_time, constr_end_time},
-                            make_shared<F_qItself>(F_qItself::byJointNames,
-                                                   per_robot_joints[r],
-                                                   komo.world),
-                            {}, OT_eq, {1e1}, task.path[-1]);
-
-          // velocity
-          komo.addObjective({constr_start_time, constr_end_time},
-                            make_shared<F_qItself>(F_qItself::byJointNames,
-                                                   per_robot_joints[r],
-                                                   komo.world),
-                            {}, OT_eq, {1e1}, {}, 1);
+  const auto carrying_intervals = get_carrying_intervals(unscaled_plan);
+
+  uint num_accepted = 0;
+  uint num_rejected = 0;
+  uint num_skipped = 0;
+  for (const uint offset : {0u, horizon_length / 2}) {
+    std::vector<ReoptimizationWindow> windows;
+    for (uint i = offset; i + horizon_length < total_length;
+         i += horizon_length) {
+      // the window reads the configurations from i-2 to i+horizon_length
+      const uint lo = i >= 2 ? i - 2 : 0;
+      bool carrying = false;
+      for (const auto &interval : carrying_intervals) {
+        if (lo <= interval.second && interval.first <= i + horizon_length) {
+          carrying = true;
+          break;
         }
       }
+      if (carrying) {
+        ++num_skipped;
+        continue;
+      }
+      windows.push_back({i, horizon_length});
     }
 
-    // optimize
-    komo.run_prepare(0.0, true);
-    std::cout << "running" << std::endl;
-    komo.run(options);
-    std::cout << "done" << std::endl;
-
-    // TODO: ensure that everything is collision free
+    // the windows read the result of the previous pass, and write to disjoint
+    // parts of the new trajectory
+    const arr prev_path = smoothed_path;
+    std::vector<arr> results(windows.size());
+
+    auto worker = [&](const uint k) {
+      for (uint n = k; n < windows.size(); n += num_threads) {
+        results[n] = reoptimize_window(*configurations[k], *problems[k],
+                                       prev_path, windows[n], unscaled_plan,
+                                       per_robot_joints,
+                                       sdf_queries.empty()
+                                           ? nullptr
+                                           : sdf_queries[k].get());
+      }
+    };
 
-    // get results from komo
-    for (uint j = 0; j < horizon_length; ++j) {
-      smoothed_path[i + j] = komo.getPath_q(j);
+    if (num_threads == 1) {
+      worker(0);
+    } else {
+      std::vector<std::thread> threads;
+      for (uint k = 0; k < num_threads; ++k) {
+        threads.emplace_back(worker, k);
+      }
+      for (auto &thread : threads) {
+        thread.join();
+      }
     }
 
-    const double ineq = komo.getReport(false).get<double>("ineq");
-    const double eq = komo.getReport(false).get<double>("eq");
-
-    std::cout << ineq << " " << eq << std::endl;
-
-    if (false) {
-      std::cout << komo.getReport(true, 0) << std::endl;
-      komo.pathConfig.watch(true);
+    for (uint n = 0; n < windows.size(); ++n) {
+      if (results[n].N == 0) {
+        ++num_rejected;
+        continue;
+      }
+      ++num_accepted;
+      for (uint j = 0; j < windows[n].length; ++j) {
+        smoothed_path[windows[n].start + j] = results[n][j];
+      }
     }
-
-    komo.clearObjectives();
-  }
-
-  std::unordered_map<Robot, arr> per_robot_paths;
-  for (const auto &r : all_robots) {
-    per_robot_paths[r].resize(A.getT(), home_poses.at(r).d0);
   }
 
-  for (uint i = 0; i < A.getT(); ++i) {
-    C.setJointState(smoothed_path[i]);
-    C.watch(false);
-    rai::wait(0.01);
-
-    for (const auto &r : all_robots) {
-      setActive(C, r);
-      const arr pose = C.getJointState();
-      per_robot_paths[r][i] = pose;
-    }
-
-    setActive(C, all_robots);
-  }
+  spdlog::info("Reoptimized plan: {} windows accepted, {} rejected, {} skipped "
+               "while carrying",
+               num_accepted, num_rejected, num_skipped);
 
   Plan optimized_plan;
 
   for (const auto &per_robot_plan : unscaled_plan) {
     const auto robot = per_robot_plan.first;
     const auto tasks = per_robot_plan.second;
+    const uint n = home_poses.at(robot).N;
 
+    setActive(C, robot);
     for (const auto &task : tasks) {
-      TaskPart new_task_part;
-
-      new_task_part.t = task.t;
-      new_task_part.r = task.r;
-      new_task_part.task_index = task.task_index;
-      new_task_part.algorithm = task.algorithm;
-      new_task_part.name = task.name;
-      new_task_part.is_exit = task.is_exit;
+      TaskPart new_task_part = task;
 
-      new_task_part.path =
-          per_robot_paths[task.r]({task.t(0), task.t(0) + task.t.d0 - 1});
+      new_task_part.path.resize(task.t.d0, n);
+      for (uint j = 0; j < task.t.d0; ++j) {
+        for (uint k = 0; k < n; ++k) {
+          new_task_part.path(j, k) =
+              smoothed_path(uint(task.t(0)) + j, offsets[robot] + k);
+        }
+      }
 
       FrameL robot_frames;
       for (const auto &frame : task.anim.frameNames) {
         robot_frames.append(C[frame]);
       }
-      setActive(C, robot);
       const auto anim_part =
           make_animation_part(C, new_task_part.path, robot_frames, task.t(0));
       new_task_part.anim = anim_part;
@@ -2360,11 +2360,15 @@
 #include <Manip/rrt-time.h>
 #include <Geo/fclInterface.h>
 
+#include "edge_checker.h"
+#include "nogood_store.h"
+#include "path_validation.h"
 #include "plan.h"
 #include "postprocessing.h"
 
 #include "common/util.h"
 #include "common/env_util.h"
+#include "common/cancellation.h"
 #include "common/config.h"
 
 #include "json/json.h"
@@ -2478,10 +2482,32 @@ FrameL get_robot_joints(rai::Configuration &C, const Robot &robot) {
   return joints;
 }
 
-arr plan_with_komo_given_horizon(const rai::Animation &A, rai::Configuration &C,
+// Resamples a path to the given number of timesteps, i.e. the same poses are
+// traversed faster or slower.
+arr time_scale_path(const arr &path, const uint num_timesteps,
+                    rai::Configuration &C) {
+  arr stretched_ts(path.d0);
+  for (uint i = 0; i < path.d0; ++i) {
+    stretched_ts(i) = 1. * (num_timesteps - 1) * i / (path.d0 - 1);
+  }
+
+  arr ts(num_timesteps);
+  for (uint i = 0; i < num_timesteps; ++i) {
+    ts(i) = i;
+  }
+
+  TimedPath tp(path, stretched_ts);
+  return tp.resample(ts, C);
+}
+
+// init is an optional initialization of the path at the times ts, e.g. the
+// path found by the RRT, or the solution of a run with a different horizon.
+// The states of the animated frames are taken from the cache, which can be
+// shared by several runs with the same animation.
+arr plan_with_komo_given_horizon(AnimationFrameCache &anim, rai::Configuration &C,
                                  const arr &q0, const arr &q1, const arr &ts,
                                  const Robot r, double &ineq,
-                                 double &eq) {
+                                 double &eq, const arr &init = arr()) {
   // TODO: smarter scaling computation
   const double scaling = 3;
   const uint num_timesteps = ts.N / scaling;
@@ -2549,7 +2575,17 @@ arr plan_with_komo_given_horizon(const rai::Animation &A, rai::Configuration &C,
                       1); // slow at beginning
   }
 
-  setKomoToAnimation(komo, C, A, scaled_ts);
+  setKomoToAnimation(komo, anim, scaled_ts);
+
+  // start and goal are constrained, the initialization only sets the poses in
+  // between
+  if (init.d0 == ts.N) {
+    TimedPath tp_init(init, ts);
+    const arr scaled_init = tp_init.resample(scaled_ts, C);
+    for (uint j = 0; j < scaled_ts.N; ++j) {
+      komo.setConfiguration(j, scaled_init[j]);
+    }
+  }
 
   spdlog::info("Running komo planner");
 
@@ -2618,12 +2654,24 @@ double get_max_speed(const arr &path) {
 }
 
 double get_earliest_feasible_time(TimedConfigurationProblem &TP, const arr &q,
-                                  const uint t_max, const uint t_min) {
+                                  const uint t_max, const uint t_min,
+                                  StaticSdfQuery *sdf_query = nullptr) {
   // idea: start at the maximum time (where we know that ut is feasible),
   // and decrease the time, and check if it is feasible at this time
+  if (global_params.use_edge_checker && t_max > t_min) {
+    EdgeChecker checker(TP, sdf_query);
+    const int t_coll = checker.query_interval(q, t_max, t_min + 1);
+    if (t_coll < 0) {
+      return t_min;
+    }
+    spdlog::info("Not feasible at time {}", t_coll);
+    return t_coll + 2;
+  }
+
   uint t_earliest_feas = t_max;
   while (t_earliest_feas > t_min) {
-    const auto res = TP.query(q, t_earliest_feas);
+    const auto res = sdf_query != nullptr ? sdf_query->query(q, t_earliest_feas)
+                                          : TP.query(q, t_earliest_feas);
     if (!res->isFeasible) {
       spdlog::info("Not feasible at time {}", t_earliest_feas);
       t_earliest_feas += 2;
@@ -2642,10 +2690,15 @@ double get_earliest_feasible_time(TimedConfigurationProblem &TP, const arr &q,
   return t_earliest_feas;
 }
 
+// If a path is given as initialization (e.g. the one found by the RRT), it is
+// scaled to the horizon. Further attempts with a longer horizon are
+// initialized with the solution of the previous attempt.
 TaskPart plan_in_animation_komo(TimedConfigurationProblem &TP,
                                 const uint t0, const arr &q0, const arr &q1,
                                 const uint time_lb, const Robot prefix,
-                                const int time_ub_prev_found = -1) {
+                                const int time_ub_prev_found = -1,
+                                const arr &init_path = arr(),
+                                StaticSdfQuery *sdf_query = nullptr) {
   // return TaskPart();
 
   // Check if start q is feasible
@@ -2678,8 +2731,9 @@ TaskPart plan_in_animation_komo(TimedConfigurationProblem &TP,
   // exit path, thus we include the others
   const uint t_max_to_check = std::max({time_lb, t0 + dt_max_vel, TP.A.getT()});
   // establish time at which the goal is free, and stays free
-  const double t_earliest_feas = get_earliest_feasible_time(
-      TP, q1, t_max_to_check, std::max({time_lb, t0 + dt_max_vel}));
+  const double t_earliest_feas =
+      get_earliest_feasible_time(TP, q1, t_max_to_check,
+                                 std::max({time_lb, t0 + dt_max_vel}), sdf_query);
 
   spdlog::info("Final time for komo: {}, dt: ", t_earliest_feas, t_earliest_feas - t0);
   // std::cout << "Final time for komo: " << t_earliest_feas
@@ -2694,7 +2748,22 @@ TaskPart plan_in_animation_komo(TimedConfigurationProblem &TP,
 
   const uint max_komo_run_attempts = 3;
   uint iters = 0;
+
+  arr warm_start = init_path;
+  AnimationFrameCache anim(TP.C, TP.A);
+  auto failed = [&]() {
+    TaskPart tp;
+    tp.stats.komo_attempts = iters + 1;
+    tp.stats.komo_converged = false;
+    return tp;
+  };
+
   while (true) {
+    if (search_is_cancelled()) {
+      spdlog::info("Search was cancelled, stopping KOMO.");
+      return failed();
+    }
+
     spdlog::info("running komo with horizon {}", horizon);
     arr ts(horizon);
     for (uint j = 0; j < horizon; ++j) {
@@ -2703,7 +2772,7 @@ TaskPart plan_in_animation_komo(TimedConfigurationProblem &TP,
 
     if (time_ub_prev_found > 0 && time_ub_prev_found < ts(-1)) {
       spdlog::info("found cheaper path before, aborting.");
-      return TaskPart();
+      return failed();
     }
 
     // ensure that the goal is truly free. Sanity check.
@@ -2716,7 +2785,7 @@ TaskPart plan_in_animation_komo(TimedConfigurationProblem &TP,
       // TP.C.setJointState(q1);
       // TP.C.watch(true);
 
-      return TaskPart();
+      return failed();
     }
 
     if (false) {
@@ -2731,11 +2800,16 @@ TaskPart plan_in_animation_komo(TimedConfigurationProblem &TP,
 
     double ineq = 0;
     double eq = 0;
-    const arr path =
-        plan_with_komo_given_horizon(TP.A, TP.C, q0, q1, ts, prefix, ineq, eq);
+    arr init;
+    if (warm_start.d0 > 1) {
+      init = time_scale_path(warm_start, horizon, TP.C);
+    }
+
+    const arr path = plan_with_komo_given_horizon(anim, TP.C, q0, q1, ts,
+                                                  prefix, ineq, eq, init);
 
     if (path.d0 == 0){
-      return TaskPart();
+      return failed();
     }
 
     if (false) {
@@ -2763,17 +2837,20 @@ TaskPart plan_in_animation_komo(TimedConfigurationProblem &TP,
 
     // if the violations are this high, we give up
     if (eq > 15 && ineq > 15) {
-      return TaskPart();
+      return failed();
     }
 
     if (max_speed <= prefix.vmax && eq < 1.5 && ineq < 1.5) {
       spdlog::info("done, found a komo solution with ineq {}, and eq {}", ineq, eq);
-      return TaskPart(ts, path);
+      TaskPart tp(ts, path);
+      tp.stats.komo_attempts = iters + 1;
+      tp.stats.komo_converged = true;
+      return tp;
     }
 
     if (iters >= max_komo_run_attempts) {
       spdlog::info("Stopping komo attempts, too many attempts. ineq {}, eq {}", ineq, eq);
-      return TaskPart();
+      return failed();
     }
 
     // const uint num_add_timesteps = std::max({uint((iters+1)*2), uint(req_t -
@@ -2788,10 +2865,11 @@ TaskPart plan_in_animation_komo(TimedConfigurationProblem &TP,
 
     if (num_add_timesteps > 300){
       spdlog::info("komo path too long, aborting.");;
-      return TaskPart();
+      return failed();
     }
 
     horizon += num_add_timesteps;
+    warm_start = path;
 
     spdlog::info("rerunning komo, current violation: ineq {}, eq {}", ineq, eq);
 
@@ -2802,7 +2880,11 @@ TaskPart plan_in_animation_komo(TimedConfigurationProblem &TP,
 TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
                                const uint t0, const arr &q0, const arr &q1,
                                const uint time_lb, const Robot prefix,
-                               int time_ub_prev_found, const bool sipp) {
+                               int time_ub_prev_found, const bool sipp,
+                               PathValidator &validator) {
+  // the collision checks below share the static sdf query of the validator
+  StaticSdfQuery *sdf_query = validator.get_static_sdf_query();
+
   // TimedConfigurationProblem TP(C, A);
   // deleteUnnecessaryFrames(TP.C);
   // const auto pairs = get_cant_collide_pairs(TP.C);
@@ -2867,8 +2949,9 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
     // exit path, thus we include the others
     const uint t_max_to_check = std::max({time_lb, t0 + dt_max_vel, TP.A.getT()});
     // establish time at which the goal is free, and stays free
-    const uint t_earliest_feas = get_earliest_feasible_time(
-        TP, q1, t_max_to_check, std::max({time_lb, t0 + dt_max_vel}));
+    const uint t_earliest_feas =
+        get_earliest_feasible_time(TP, q1, t_max_to_check,
+                                   std::max({time_lb, t0 + dt_max_vel}), sdf_query);
 
     spdlog::info("t_earliest_feas {}", t_earliest_feas);
     spdlog::info("last anim time {}", TP.A.getT());
@@ -2905,6 +2988,11 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
         spdlog::info("Aborting bc. faster path found");
         break;
       }
+
+      if (search_is_cancelled()) {
+        spdlog::info("Search was cancelled, stopping RRT.");
+        break;
+      }
       // planner.TP.min_time = t0;
       // planner.TP.max_time = time_ub; 
       // planner.TP.init_safe_interval_collisison_check(q0,t0,time_ub);
@@ -2969,15 +3057,14 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
     }
     //========================================================================================================================
     
-    for(uint i = 0; i < timedPath.path.d0; i++) 
-          {
-            double t_i = timedPath.time(i);
-            // json_path.push_back({{"q", q_i}, {"t", t_i}});
-            const auto zd = TP.query(timedPath.path[i], t_i);
-            if (!zd->isFeasible) {
-              spdlog::error("path is not feasible!");
-            }
-          }
+    {
+      const auto res = validator.validate(timedPath.path, timedPath.time);
+      if (!res.is_feasible()) {
+        spdlog::error("path is not feasible at time {}, penetration {}!",
+                      timedPath.time(res.first_infeasible_index),
+                      res.penetration);
+      }
+    }
 
     // resample
     const uint N = std::ceil(timedPath.time(timedPath.time.N - 1) - t0) + 1;
@@ -2996,18 +3083,21 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
     }
 
     // check if resampled path is still fine
-    for (uint i = 0; i < t.N; ++i) {
-      const auto res = TP.query(path[i], t(i));
-      if (!res->isFeasible) {
-        spdlog::error("resampled path is not feasible! This should not happen.");
-        start_res->writeDetails(cout, TP.C);
+    {
+      const auto res = validator.validate(path, t);
+      if (!res.is_feasible()) {
+        spdlog::error("resampled path is not feasible at time {}! This should "
+                      "not happen.",
+                      t(res.first_infeasible_index));
+        TP.query(path[res.first_infeasible_index], t(res.first_infeasible_index))
+            ->writeDetails(cout, TP.C);
       }
     }
 
     // shortcutting
     // TODO: add timing
     const auto shortcut_start_time = std::chrono::high_resolution_clock::now();
-    const bool should_shortcut = rai::getParameter<bool>("shortcutting", true);
+    const bool should_shortcut = global_params.shortcutting;
 
     arr new_path = path;
     if (should_shortcut && path.d0 > 2){
@@ -3029,20 +3119,23 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
       //   }
       // }
 
-      new_path = partial_spacetime_shortcut(TP, path, t0);
+      new_path = partial_spacetime_shortcut(TP, path, t0, sdf_query);
 
-      for (uint i = 0; i < new_path.d0; ++i) {
-        const auto res = TP.query(new_path[i], t(i));
-        if (!res->isFeasible) {
-          // std::cout << i << std::endl;
-          // TP.C.watch(true);
-          res->writeDetails(std::cout, TP.C);
-          if (res->coll_y.N > 0){
-            spdlog::warn("shortcut path infeasible, penetration {} at time {} "
-                        "(timestep {} / {})",
-                        min(res->coll_y), t(i), i, new_path.d0);
-          }
-          break;
+      if (global_params.use_edge_checker) {
+        EdgeChecker checker(TP, sdf_query);
+        const int i = checker.find_first_infeasible_edge(new_path, t);
+        if (i >= 0) {
+          spdlog::warn("shortcut path infeasible at time {} (timestep {} / {})",
+                       t(i), i, new_path.d0);
+        }
+      } else {
+        const auto res = validator.validate(new_path, t);
+        if (!res.is_feasible()) {
+          const uint i = res.first_infeasible_index;
+          TP.query(new_path[i], t(i))->writeDetails(std::cout, TP.C);
+          spdlog::warn("shortcut path infeasible, penetration {} at time {} "
+                       "(timestep {} / {})",
+                       res.penetration, t(i), i, new_path.d0);
         }
       }
 
@@ -3064,7 +3157,7 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
     
     // TP.C.fcl()->stopEarly = false;
 
-    const bool should_smooth = rai::getParameter<bool>("smoothing", false);
+    const bool should_smooth = global_params.smoothing;
 
     arr smooth_path = new_path * 1.;
     if (should_smooth){
@@ -3076,29 +3169,24 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
         smooth_path = new_path;
       }
       else{
-        for (uint i = 0; i < smooth_path.d0; ++i) {
-          const auto res = TP.query(smooth_path[i], t(i));
-          // if (!res->isFeasible && res->coll_y.N > 0 && min(res->coll_y) < -0.05) {
-          // if (i < smooth_path.d0 -1){
-          //   if (absMax(smooth_path[i] - smooth_path[i+1]) > prefix.vmax){
-          //     spdlog::warn("smoothed path too fast {} vs {}.",
-          //                  absMax(smooth_path[i] - smooth_path[i + 1]),
-          //                  prefix.vmax);
-          //     smooth_path = new_path;
-          //     break;
-          //   }
-          // }
-          // std::cout << "checking at time " << t(i) << std::endl;
-          if (!res->isFeasible) {
-            // std::cout << i << std::endl;
-            // TP.C.watch(true);
+        if (global_params.use_edge_checker) {
+          EdgeChecker checker(TP, sdf_query);
+          const int i = checker.find_first_infeasible_edge(smooth_path, t);
+          if (i >= 0) {
+            spdlog::warn("smoothed path infeasible at time {} (timestep {} / {})",
+                         t(i), i, smooth_path.d0);
+            smooth_path = new_path;
+          }
+        } else {
+          const auto res = validator.validate(smooth_path, t);
+          if (!res.is_feasible()) {
+            const uint i = res.first_infeasible_index;
             spdlog::warn(
                 "smoothed path infeasible, penetration {} at time {} (timestep {} / {})",
-                min(res->coll_y), t(i), i, smooth_path.d0);
-            res->writeDetails(std::cout, TP.C);
+                res.penetration, t(i), i, smooth_path.d0);
+            TP.query(smooth_path[i], t(i))->writeDetails(std::cout, TP.C);
 
             smooth_path = new_path;
-            break;
           }
         }
       }
@@ -3142,7 +3230,7 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
     // planner.step_time = 5;
     planner.maxIter = 500;
     planner.goalSampleProbability = 0.9; // 0.9
-    const bool informed_sampling = rai::getParameter<bool>("informed_sampling", true);
+    const bool informed_sampling = global_params.informed_sampling;
     planner.informed_sampling = informed_sampling;
 
     //  const uint dt_max_vel = uint(std::ceil(absMax(q0 - q1) / prefix.vmax));
@@ -3156,7 +3244,8 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
       const uint t_max_to_check = std::max({time_lb, t0 + dt_max_vel, TP.A.getT()});
       // establish time at which the goal is free, and stays free
       const uint t_earliest_feas = get_earliest_feasible_time(
-          TP, q1, t_max_to_check, std::max({time_lb, t0 + dt_max_vel}));
+          TP, q1, t_max_to_check, std::max({time_lb, t0 + dt_max_vel}),
+          sdf_query);
 
       spdlog::info("t_earliest_feas {}", t_earliest_feas);
       spdlog::info("last anim time {}", TP.A.getT());
@@ -3193,6 +3282,11 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
           break;
         }
 
+        if (search_is_cancelled()) {
+          spdlog::info("Search was cancelled, stopping RRT.");
+          break;
+        }
+
         const auto rrt_start_time = std::chrono::high_resolution_clock::now();
         auto res = planner.plan(q0, t0, q1, t_earliest_feas, time_ub);
         
@@ -3264,18 +3358,21 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
       }
 
       // check if resampled path is still fine
-      for (uint i = 0; i < t.N; ++i) {
-        const auto res = TP.query(path[i], t(i));
-        if (!res->isFeasible) {
-          spdlog::error("resampled path is not feasible! This should not happen.");
-          start_res->writeDetails(cout, TP.C);
+      {
+        const auto res = validator.validate(path, t);
+        if (!res.is_feasible()) {
+          spdlog::error("resampled path is not feasible at time {}! This should "
+                        "not happen.",
+                        t(res.first_infeasible_index));
+          TP.query(path[res.first_infeasible_index], t(res.first_infeasible_index))
+              ->writeDetails(cout, TP.C);
         }
       }
 
       // shortcutting
       // TODO: add timing
       const auto shortcut_start_time = std::chrono::high_resolution_clock::now();
-      const bool should_shortcut = rai::getParameter<bool>("shortcutting", true);
+      const bool should_shortcut = global_params.shortcutting;
 
       arr new_path = path;
       if (should_shortcut && path.d0 > 2){
@@ -3297,20 +3394,23 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
         //   }
         // }
 
-        new_path = partial_spacetime_shortcut(TP, path, t0);
-
-        for (uint i = 0; i < new_path.d0; ++i) {
-          const auto res = TP.query(new_path[i], t(i));
-          if (!res->isFeasible) {
-            // std::cout << i << std::endl;
-            // TP.C.watch(true);
-            res->writeDetails(std::cout, TP.C);
-            if (res->coll_y.N > 0){
-              spdlog::warn("shortcut path infeasible, penetration {} at time {} "
-                          "(timestep {} / {})",
-                          min(res->coll_y), t(i), i, new_path.d0);
-            }
-            break;
+        new_path = partial_spacetime_shortcut(TP, path, t0, sdf_query);
+
+        if (global_params.use_edge_checker) {
+          EdgeChecker checker(TP, sdf_query);
+          const int i = checker.find_first_infeasible_edge(new_path, t);
+          if (i >= 0) {
+            spdlog::warn("shortcut path infeasible at time {} (timestep {} / {})",
+                         t(i), i, new_path.d0);
+          }
+        } else {
+          const auto res = validator.validate(new_path, t);
+          if (!res.is_feasible()) {
+            const uint i = res.first_infeasible_index;
+            TP.query(new_path[i], t(i))->writeDetails(std::cout, TP.C);
+            spdlog::warn("shortcut path infeasible, penetration {} at time {} "
+                         "(timestep {} / {})",
+                         res.penetration, t(i), i, new_path.d0);
           }
         }
 
@@ -3332,7 +3432,7 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
       
       // TP.C.fcl()->stopEarly = false;
 
-      const bool should_smooth = rai::getParameter<bool>("smoothing", false);
+      const bool should_smooth = global_params.smoothing;
 
       arr smooth_path = new_path * 1.;
       if (should_smooth){
@@ -3344,29 +3444,24 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
           smooth_path = new_path;
         }
         else{
-          for (uint i = 0; i < smooth_path.d0; ++i) {
-            const auto res = TP.query(smooth_path[i], t(i));
-            // if (!res->isFeasible && res->coll_y.N > 0 && min(res->coll_y) < -0.05) {
-            // if (i < smooth_path.d0 -1){
-            //   if (absMax(smooth_path[i] - smooth_path[i+1]) > prefix.vmax){
-            //     spdlog::warn("smoothed path too fast {} vs {}.",
-            //                  absMax(smooth_path[i] - smooth_path[i + 1]),
-            //                  prefix.vmax);
-            //     smooth_path = new_path;
-            //     break;
-            //   }
-            // }
-            // std::cout << "checking at time " << t(i) << std::endl;
-            if (!res->isFeasible) {
-              // std::cout << i << std::endl;
-              // TP.C.watch(true);
+          if (global_params.use_edge_checker) {
+            EdgeChecker checker(TP, sdf_query);
+            const int i = checker.find_first_infeasible_edge(smooth_path, t);
+            if (i >= 0) {
+              spdlog::warn("smoothed path infeasible at time {} (timestep {} / {})",
+                           t(i), i, smooth_path.d0);
+              smooth_path = new_path;
+            }
+          } else {
+            const auto res = validator.validate(smooth_path, t);
+            if (!res.is_feasible()) {
+              const uint i = res.first_infeasible_index;
               spdlog::warn(
                   "smoothed path infeasible, penetration {} at time {} (timestep {} / {})",
-                  min(res->coll_y), t(i), i, smooth_path.d0);
-              res->writeDetails(std::cout, TP.C);
+                  res.penetration, t(i), i, smooth_path.d0);
+              TP.query(smooth_path[i], t(i))->writeDetails(std::cout, TP.C);
 
               smooth_path = new_path;
-              break;
             }
           }
         }
@@ -3401,9 +3496,32 @@ TaskPart plan_in_animation_rrt(TimedConfigurationProblem &TP,
 
 // policy should have other inputs:
 // policy(start_pos, end_pos, robot, mode)
-void run_waiting_policy(TaskPart &path, const uint lower = 5, const uint upper = 15){
+void run_waiting_policy(TimedConfigurationProblem &TP, TaskPart &path,
+                        const uint lower = 5, const uint upper = 15,
+                        StaticSdfQuery *sdf_query = nullptr) {
   // TODO: fix distribution
-  const uint wait_time = rand() % (upper - lower) + lower;
+  uint wait_time = get_thread_rng()() % (upper - lower) + lower;
+
+  // the robot only waits as long as its configuration stays free
+  const arr q = path.path[-1];
+  const uint t_end = path.t(-1);
+  if (global_params.use_edge_checker) {
+    EdgeChecker checker(TP, sdf_query);
+    const int t_coll = checker.query_interval(q, t_end + 1, t_end + wait_time);
+    if (t_coll >= 0) {
+      wait_time = t_coll - t_end - 1;
+    }
+  } else {
+    for (uint i = 1; i <= wait_time; ++i) {
+      const auto res = sdf_query != nullptr ? sdf_query->query(q, t_end + i)
+                                            : TP.query(q, t_end + i);
+      if (!res->isFeasible) {
+        wait_time = i - 1;
+        break;
+      }
+    }
+  }
+
     for (uint i=0; i<wait_time; ++i){
       path.path.append(path.path[-1]);
       path.t.append(path.t(-1) + 1);
@@ -3443,14 +3561,18 @@ TaskPart plan_in_animation(TimedConfigurationProblem &TP,
   // run rrt
   // TP.C.fcl()->stopEarly = false;
 
-  TaskPart rrt_path = plan_in_animation_rrt(TP, t0, q0, q1, time_lb, r, -1,sipp);
+  // shared by the validation of the rrt and the komo paths
+  PathValidator validator(TP);
+
+  TaskPart rrt_path =
+      plan_in_animation_rrt(TP, t0, q0, q1, time_lb, r, -1, sipp, validator);
   rrt_path.algorithm = "rrt";
 
   // add waiting times for grabbing
   // TODO: sample from actual ststistical model
   // TODO: should be a policy that does the final movement
   if (global_params.randomize_mod_switch_durations && !exit_path && rrt_path.t.d0 > 0){
-    run_waiting_policy(rrt_path);
+    run_waiting_policy(TP, rrt_path, 5, 15, validator.get_static_sdf_query());
   }
 
   // TP.C.fcl()->stopEarly = false;
@@ -3491,12 +3613,15 @@ TaskPart plan_in_animation(TimedConfigurationProblem &TP,
 
   // attempt komo
   const auto komo_start_time = std::chrono::high_resolution_clock::now();
-  const bool attempt_komo_planning = rai::getParameter<bool>("attempt_komo", true);
+  const bool attempt_komo_planning = global_params.attempt_komo;
   
   TaskPart komo_path;
   if (attempt_komo_planning){
-    komo_path =
-        plan_in_animation_komo(TP, t0, q0, q1, time_lb, r, time_ub);
+    // the rrt path (if there is one) is used as initialization
+    const arr komo_init = rrt_path.has_solution ? rrt_path.path : arr();
+    komo_path = plan_in_animation_komo(TP, t0, q0, q1, time_lb, r, time_ub,
+                                       komo_init,
+                                       validator.get_static_sdf_query());
     komo_path.algorithm = "komo";
 
     /*if(komo_path.has_solution){
@@ -3513,17 +3638,12 @@ TaskPart plan_in_animation(TimedConfigurationProblem &TP,
       // TP.activeOnly = true;
 
       spdlog::info("Checking komo path for colisions");
-      for (uint i = 0; i < komo_path.t.N; ++i) {
-        const auto res = TP.query(komo_path.path[i], komo_path.t(i));
-        if (!res->isFeasible){
-          spdlog::warn("komo path is colliding, penetrating {}", min(res->coll_y));
-        }
-        // if (!res->isFeasible && min(res->coll_y) < -0.01) {
-        if (!res->isFeasible) {
-          spdlog::warn("komo actually infeasible");
-          komo_path.has_solution = false;
-          break;
-        }
+      const auto res = validator.validate(komo_path.path, komo_path.t);
+      // if (!res.is_feasible() && res.penetration > 0.01) {
+      if (!res.is_feasible()) {
+        spdlog::warn("komo path is colliding, penetrating {}", res.penetration);
+        spdlog::warn("komo actually infeasible");
+        komo_path.has_solution = false;
       }
     }
   }
@@ -3555,6 +3675,9 @@ TaskPart plan_in_animation(TimedConfigurationProblem &TP,
   komo_path.stats.rrt_shortcut_time = rrt_path.stats.rrt_shortcut_time;
   komo_path.stats.rrt_plan_time = rrt_path.stats.rrt_plan_time;
 
+  rrt_path.stats.komo_attempts = komo_path.stats.komo_attempts;
+  rrt_path.stats.komo_converged = komo_path.stats.komo_converged;
+
   if (komo_path.has_solution && !rrt_path.has_solution) {
     spdlog::info("Using KOMO");
     return komo_path;
@@ -3594,9 +3717,34 @@ class PrioritizedTaskPlanner {
           best_makespan_so_far(_best_makespan_so_far),
           early_stopping(_early_stopping), sipp(_sipp) {}
 
-    // TODO: swap to std::map<Robot, uint> finishing_times;
+    // Tasks that failed before in the same situation are rejected without
+    // planning them, new failures are recorded.
     PlanStatus plan(rai::Configuration &C, const RobotTaskPair &rtp,
                     const uint prev_finishing_time, Plan &paths) {
+      if (!global_params.use_nogood_store) {
+        return plan_task(C, rtp, prev_finishing_time, paths);
+      }
+
+      NogoodStore &nogoods = get_nogood_store();
+      const auto placed_objects = NogoodStore::get_placed_objects(paths);
+      if (nogoods.contains(rtp, placed_objects, prev_finishing_time)) {
+        spdlog::info("Not planning {}, since it failed before in the same "
+                     "situation.",
+                     rtp.serialize());
+        return PlanStatus::failed;
+      }
+
+      const PlanStatus res = plan_task(C, rtp, prev_finishing_time, paths);
+      // failures due to a cancelled search say nothing about the task
+      if (res == PlanStatus::failed && !search_is_cancelled()) {
+        nogoods.add(rtp, placed_objects, prev_finishing_time);
+      }
+      return res;
+    }
+
+    // TODO: swap to std::map<Robot, uint> finishing_times;
+    PlanStatus plan_task(rai::Configuration &C, const RobotTaskPair &rtp,
+                         const uint prev_finishing_time, Plan &paths) {
       rai::Animation tmp;
       TimedConfigurationProblem TP(C, tmp);
 
@@ -3740,6 +3888,7 @@ class PrioritizedTaskPlanner {
             path.is_exit = false;
             path.name = "pick";
             path.task_index = rtp.task.object;
+            path.primitive_type = rtp.task.type;
 
             if (early_stopping && path.t(-1) > best_makespan_so_far) {
               spdlog::info("Stopping early due to better prev. path. ({})", best_makespan_so_far);
@@ -3955,6 +4104,7 @@ class PrioritizedTaskPlanner {
               r1_path.is_exit = false;
               r1_path.name = "handover";
               r1_path.task_index = rtp.task.object;
+              r1_path.primitive_type = rtp.task.type;
 
               if (early_stopping && path.t(-1) > best_makespan_so_far) {
                 spdlog::info("Stopping early due to better prev. path. ({})", best_makespan_so_far);
@@ -3995,6 +4145,7 @@ class PrioritizedTaskPlanner {
               r2_path.is_exit = false;
               r2_path.name = "handover";
               r2_path.task_index = rtp.task.object;
+              r2_path.primitive_type = rtp.task.type;
 
               if (early_stopping && path.t(-1) > best_makespan_so_far) {
                 spdlog::info("Stopping early due to better prev. path. ({})", best_makespan_so_far);
@@ -4064,7 +4215,8 @@ class PrioritizedTaskPlanner {
            
             exit_path.anim = exit_anim_part;
             exit_path.r = r1;
-            exit_path.task_index = 0;
+            exit_path.task_index = rtp.task.object;
+            exit_path.primitive_type = rtp.task.type;
             exit_path.is_exit = true;
             exit_path.name = "exit";
 
@@ -4117,6 +4269,7 @@ class PrioritizedTaskPlanner {
             path.anim = anim_part;
             path.r = r2;
             path.task_index = rtp.task.object;
+            path.primitive_type = rtp.task.type;
             path.is_exit = false;
             path.name = "place";
 
@@ -4164,6 +4317,7 @@ class PrioritizedTaskPlanner {
             exit_path.anim = exit_anim_part;
             exit_path.r = r2;
             exit_path.task_index = rtp.task.object;
+            exit_path.primitive_type = rtp.task.type;
             exit_path.is_exit = true;
             exit_path.name = "exit";
 
@@ -4314,6 +4468,7 @@ class PrioritizedTaskPlanner {
 
           path.r = robot;
           path.task_index = task;
+          path.primitive_type = rtp.task.type;
 
           if (is_bin_picking) {
             if (j == 0) {
@@ -4430,6 +4585,7 @@ class PrioritizedTaskPlanner {
                               
         exit_path.r = robot;
         exit_path.task_index = task;
+        exit_path.primitive_type = rtp.task.type;
         exit_path.is_exit = true;
         exit_path.name = "exit";
 
@@ -4476,10 +4632,12 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
     robot_frames[robot] = get_robot_frames(CPlanner, robot);
   }
 
-  // remove things from paths
-  std::vector<uint> unplanned_tasks;
+  // remove things from paths. The parts are identified by the object and the
+  // primitive, since both parts of a pick-pick handle the same object.
+  std::vector<std::pair<uint, PrimitiveType>> unplanned_tasks;
   for (uint i = start_index; i < sequence.size(); ++i) {
-    unplanned_tasks.push_back(sequence[i].task.object);
+    unplanned_tasks.push_back(
+        {sequence[i].task.object, sequence[i].task.type});
   }
 
   std::unordered_map<Robot, std::vector<TaskPart>> paths;
@@ -4488,7 +4646,8 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
     const auto r = p.first;
     for (auto plan : p.second) {
       if (std::find(unplanned_tasks.begin(), unplanned_tasks.end(),
-                    plan.task_index) == unplanned_tasks.end()) {
+                    std::make_pair(plan.task_index, plan.primitive_type)) ==
+          unplanned_tasks.end()) {
         paths[r].push_back(plan);
         spdlog::info("adding robot {}, plan for object {}", r.prefix, plan.task_index);
       }
@@ -4526,6 +4685,11 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
       continue;
     }
 
+    // the exit path from the start pose is part of the previous plan already
+    if (paths.count(robot) > 0 && paths[robot].size() > 0) {
+      continue;
+    }
+
     if (euclideanDistance(robot.start_pose, robot.home_pose) > 1e-6){
       spdlog::info("Planning an exit path for robot {} since it starts not at the home pose", robot.prefix);
       robot_exit_paths.push_back({robot.prefix, 0});
@@ -4566,10 +4730,13 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
 
     arr start_pose = robot.start_pose;
     int task_index = 0;
+    // the exit path from the start pose does not belong to any task
+    PrimitiveType primitive_type = PrimitiveType::go_to;
 
-    if (paths.count(robot) > 0){
+    if (paths.count(robot) > 0 && paths[robot].size() > 0){
       start_pose = paths[robot].back().path[-1];
       task_index = paths[robot].back().task_index;
+      primitive_type = paths[robot].back().primitive_type;
     }
 
     auto exit_path =
@@ -4577,6 +4744,7 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
                           home_poses.at(robot), p.second + 5, robot, true,sipp);
     exit_path.r = robot;
     exit_path.task_index = task_index;
+    exit_path.primitive_type = primitive_type;
     exit_path.is_exit = true;
     exit_path.name = "exit";
 
@@ -4612,6 +4780,10 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
   
   // actually plan
   for (uint i = start_index; i < sequence.size(); ++i) {
+    if (search_is_cancelled()) {
+      return PlanResult(PlanStatus::aborted);
+    }
+
     uint prev_finishing_time = 0;
 
     for (const auto &p : paths) {
@@ -4652,7 +4824,15 @@ PlanResult plan_multiple_arms_given_subsequence_and_prev_plan(
 
     if (res != PlanStatus::success) {
       spdlog::info("Failed planning");
-      return PlanResult(res);
+      if (search_is_cancelled()) {
+        return PlanResult(PlanStatus::aborted);
+      }
+
+      PlanResult result(res);
+      if (res == PlanStatus::failed) {
+        result.failed_task_index = i;
+      }
+      return result;
     }
 
     // TODO: compute better estimate for early stopping
@@ -0,0 +1,559 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include <Geo/fclInterface.h>
+#include <PlanningSubroutines/ConfigurationProblem.h>
+
+#include "common/config.h"
+#include "common/util.h"
+
+// Signed distance field of the static geometry of a scene (table, obstacles,
+// conveyors), sampled on a voxel grid. The links of the planned robot are
+// approximated by spheres, which are checked against the field. Only if one
+// of the spheres is close to the static geometry, the exact collision check
+// against it is necessary.
+//
+// The shapes are represented by their exact signed distance (boxes, spheres,
+// cylinders, capsules), meshes by their bounding box, i.e. the field is a
+// lower bound on the distance to the actual geometry. Distances are truncated
+// at the padding of the grid.
+
+namespace sdf {
+// robots are prefixed with a<index>_ in the configuration
+bool is_robot_frame(const rai::Frame *f) {
+  const char *name = f->name.p;
+  if (name == nullptr || name[0] != 'a' || !std::isdigit(name[1])) {
+    return false;
+  }
+  uint i = 1;
+  while (std::isdigit(name[i])) {
+    ++i;
+  }
+  return name[i] == '_';
+}
+
+bool has_joint_above(const rai::Frame *f) {
+  while (f) {
+    if (f->joint) {
+      return true;
+    }
+    f = f->parent;
+  }
+  return false;
+}
+
+// signed distance of p to a box with the given half extents, centered at the
+// origin
+double box_distance(const double p[3], const double h[3]) {
+  double outside = 0.;
+  double inside = -1e6;
+  for (uint i = 0; i < 3; ++i) {
+    const double d = std::fabs(p[i]) - h[i];
+    outside += std::max(d, 0.) * std::max(d, 0.);
+    inside = std::max(inside, d);
+  }
+  return std::sqrt(outside) + std::min(inside, 0.);
+}
+
+// A static shape, with everything that is needed to evaluate its signed
+// distance precomputed. Meshes are represented by their bounding box.
+struct Shape {
+  rai::ShapeType type;
+  arr size;
+  arr pos;
+  arr rot;
+
+  // bounding box of meshes, in the frame of the shape
+  double center[3] = {0., 0., 0.};
+  double half[3] = {0., 0., 0.};
+};
+
+Shape make_shape(rai::Frame *f) {
+  Shape s;
+  s.type = f->shape->type();
+  s.size = f->shape->size;
+  s.pos = f->getPosition();
+  s.rot = f->getRotationMatrix();
+
+  const bool is_primitive =
+      s.type == rai::ST_box || s.type == rai::ST_ssBox ||
+      s.type == rai::ST_sphere || s.type == rai::ST_cylinder ||
+      s.type == rai::ST_capsule;
+  if (!is_primitive) {
+    const arr &V = f->shape->mesh().V;
+    for (uint i = 0; i < 3 && V.d0 > 0; ++i) {
+      const double lo = min(V.col(i));
+      const double hi = max(V.col(i));
+      s.center[i] = 0.5 * (lo + hi);
+      s.half[i] = 0.5 * (hi - lo);
+    }
+  }
+  return s;
+}
+
+// signed distance of the point p (in world coordinates) to the shape
+double shape_distance(const Shape &s, const double p[3]) {
+  double q[3] = {0., 0., 0.};
+  for (uint i = 0; i < 3; ++i) {
+    for (uint j = 0; j < 3; ++j) {
+      q[i] += s.rot(j, i) * (p[j] - s.pos(j));
+    }
+  }
+
+  const arr &size = s.size;
+  switch (s.type) {
+  case rai::ST_box: {
+    const double h[3] = {0.5 * size(0), 0.5 * size(1), 0.5 * size(2)};
+    return box_distance(q, h);
+  }
+  case rai::ST_ssBox: {
+    const double r = size(3);
+    const double h[3] = {0.5 * size(0) - r, 0.5 * size(1) - r,
+                         0.5 * size(2) - r};
+    return box_distance(q, h) - r;
+  }
+  case rai::ST_sphere:
+    return std::sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2]) - size(-1);
+  case rai::ST_cylinder: {
+    const double radial = std::sqrt(q[0] * q[0] + q[1] * q[1]) - size(1);
+    const double axial = std::fabs(q[2]) - 0.5 * size(0);
+    const double outside =
+        std::sqrt(std::max(radial, 0.) * std::max(radial, 0.) +
+                  std::max(axial, 0.) * std::max(axial, 0.));
+    return outside + std::min(std::max(radial, axial), 0.);
+  }
+  case rai::ST_capsule: {
+    const double z = std::max(-0.5 * size(0), std::min(0.5 * size(0), q[2]));
+    return std::sqrt(q[0] * q[0] + q[1] * q[1] + (q[2] - z) * (q[2] - z)) -
+           size(1);
+  }
+  default:
+    break;
+  }
+
+  const double r[3] = {q[0] - s.center[0], q[1] - s.center[1],
+                       q[2] - s.center[2]};
+  return box_distance(r, s.half);
+}
+
+// FNV-1a, such that the hash of a scene is the same across runs
+uint64_t hash_string(const std::string &str) {
+  uint64_t h = 14695981039346656037ull;
+  for (const char c : str) {
+    h ^= uint8_t(c);
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+} // namespace sdf
+
+// Frames with collision shapes that never move: not attached to a joint, not
+// part of a robot, not animated, and not one of the objects.
+FrameL get_static_frames(const rai::Configuration &C,
+                         const rai::Animation &A) {
+  std::vector<bool> is_animated(C.frames.N, false);
+  for (const auto &part : A.A) {
+    for (const uint id : part.frameIDs) {
+      if (id < C.frames.N) {
+        is_animated[id] = true;
+      }
+    }
+  }
+
+  FrameL frames;
+  for (auto *f : C.frames) {
+    if (!f->shape || f->getShape().cont == 0 || f->name.contains("obj") ||
+        sdf::is_robot_frame(f) || sdf::has_joint_above(f)) {
+      continue;
+    }
+
+    bool animated = false;
+    for (const rai::Frame *g = f; g; g = g->parent) {
+      if (is_animated[g->ID]) {
+        animated = true;
+        break;
+      }
+    }
+    if (!animated) {
+      frames.append(f);
+    }
+  }
+  return frames;
+}
+
+class StaticSdf {
+public:
+  StaticSdf(const FrameL &frames, const double _resolution = 0.02,
+            const double _padding = 0.2)
+      : resolution(_resolution), padding(_padding) {
+    hash = compute_hash(frames, resolution, padding);
+    if (frames.N == 0) {
+      return;
+    }
+
+    // bounding box of all shapes
+    double lo[3] = {1e6, 1e6, 1e6};
+    double hi[3] = {-1e6, -1e6, -1e6};
+    for (auto *f : frames) {
+      const arr pos = f->getPosition();
+      const double r = get_bounding_radius(f);
+      for (uint i = 0; i < 3; ++i) {
+        lo[i] = std::min(lo[i], pos(i) - r);
+        hi[i] = std::max(hi[i], pos(i) + r);
+      }
+    }
+    for (uint i = 0; i < 3; ++i) {
+      origin[i] = lo[i] - padding;
+      n[i] = uint(std::ceil((hi[i] - lo[i] + 2 * padding) / resolution)) + 1;
+    }
+
+    std::vector<sdf::Shape> shapes;
+    for (auto *f : frames) {
+      shapes.push_back(sdf::make_shape(f));
+    }
+
+    values.assign(n[0] * n[1] * n[2], padding);
+    for (uint x = 0; x < n[0]; ++x) {
+      for (uint y = 0; y < n[1]; ++y) {
+        for (uint z = 0; z < n[2]; ++z) {
+          const double p[3] = {origin[0] + x * resolution,
+                               origin[1] + y * resolution,
+                               origin[2] + z * resolution};
+
+          double d = padding;
+          for (const auto &shape : shapes) {
+            d = std::min(d, sdf::shape_distance(shape, p));
+          }
+          values[index(x, y, z)] = d;
+        }
+      }
+    }
+  }
+
+  // the scene is identified by the shapes and poses of its static frames, and
+  // the parameters of the grid
+  static uint64_t compute_hash(const FrameL &frames, const double resolution,
+                               const double padding) {
+    std::stringstream ss;
+    ss << std::setprecision(6) << std::fixed << resolution << " " << padding;
+    for (auto *f : frames) {
+      ss << " " << f->name << " " << int(f->shape->type()) << " "
+         << f->shape->size << " " << f->getPose();
+    }
+    return sdf::hash_string(ss.str());
+  }
+
+  uint64_t get_hash() const { return hash; }
+
+  // Lower bound on the signed distance of p to the static geometry. The
+  // trilinear interpolation of a 1-Lipschitz function is off by at most the
+  // distance to the farthest corner of the voxel.
+  double get_distance(const arr &p) const {
+    if (values.empty()) {
+      return padding;
+    }
+
+    double f[3];
+    uint c[3];
+    for (uint i = 0; i < 3; ++i) {
+      const double g = (p(i) - origin[i]) / resolution;
+      if (g < 0 || g >= n[i] - 1) {
+        return padding;
+      }
+      c[i] = uint(g);
+      f[i] = g - c[i];
+    }
+
+    double d = 0.;
+    for (uint k = 0; k < 8; ++k) {
+      double w = 1.;
+      uint v[3];
+      for (uint i = 0; i < 3; ++i) {
+        const bool upper = (k >> i) & 1;
+        v[i] = c[i] + upper;
+        w *= upper ? f[i] : 1. - f[i];
+      }
+      d += w * values[index(v[0], v[1], v[2])];
+    }
+    return d - std::sqrt(3.) * resolution;
+  }
+
+  bool save(const std::string &path) const {
+    std::ofstream f(path, std::ios::binary);
+    if (!f.is_open()) {
+      return false;
+    }
+    f.write(reinterpret_cast<const char *>(&hash), sizeof(hash));
+    f.write(reinterpret_cast<const char *>(&resolution), sizeof(resolution));
+    f.write(reinterpret_cast<const char *>(&padding), sizeof(padding));
+    f.write(reinterpret_cast<const char *>(origin), sizeof(origin));
+    f.write(reinterpret_cast<const char *>(n), sizeof(n));
+    f.write(reinterpret_cast<const char *>(values.data()),
+            values.size() * sizeof(float));
+    return f.good();
+  }
+
+  // loads the field if the file exists and belongs to the same scene
+  static std::shared_ptr<StaticSdf> load(const std::string &path,
+                                         const uint64_t hash) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f.is_open()) {
+      return nullptr;
+    }
+
+    auto res = std::shared_ptr<StaticSdf>(new StaticSdf());
+    f.read(reinterpret_cast<char *>(&res->hash), sizeof(res->hash));
+    if (!f.good() || res->hash != hash) {
+      return nullptr;
+    }
+    f.read(reinterpret_cast<char *>(&res->resolution), sizeof(res->resolution));
+    f.read(reinterpret_cast<char *>(&res->padding), sizeof(res->padding));
+    f.read(reinterpret_cast<char *>(res->origin), sizeof(res->origin));
+    f.read(reinterpret_cast<char *>(res->n), sizeof(res->n));
+    res->values.resize(res->n[0] * res->n[1] * res->n[2]);
+    f.read(reinterpret_cast<char *>(res->values.data()),
+           res->values.size() * sizeof(float));
+    if (!f.good()) {
+      return nullptr;
+    }
+    return res;
+  }
+
+private:
+  StaticSdf() {}
+
+  uint index(const uint x, const uint y, const uint z) const {
+    return (x * n[1] + y) * n[2] + z;
+  }
+
+  uint64_t hash = 0;
+  double resolution;
+  double padding;
+
+  double origin[3] = {0., 0., 0.};
+  uint n[3] = {0, 0, 0};
+  std::vector<float> values;
+};
+
+// The fields are kept in memory, and on disk in
+// global_params.static_sdf_cache_path, named by the hash of the scene.
+std::shared_ptr<const StaticSdf> get_static_sdf(const FrameL &frames) {
+  static std::mutex m;
+  static std::unordered_map<uint64_t, std::shared_ptr<const StaticSdf>> cache;
+
+  const double resolution = 0.02;
+  const double padding = 0.2;
+  const uint64_t hash = StaticSdf::compute_hash(frames, resolution, padding);
+
+  std::lock_guard<std::mutex> lock(m);
+  if (cache.count(hash) > 0) {
+    return cache[hash];
+  }
+
+  const std::string folder = global_params.static_sdf_cache_path;
+  std::stringstream ss;
+  ss << folder << std::hex << hash << ".sdf";
+  const std::string path = ss.str();
+
+  std::shared_ptr<const StaticSdf> res = StaticSdf::load(path, hash);
+  if (res) {
+    spdlog::info("Loaded static sdf from {}", path);
+  } else {
+    spdlog::info("Computing static sdf of {} frames", frames.N);
+    auto computed = std::make_shared<StaticSdf>(frames, resolution, padding);
+
+    const int ret = system(STRING("mkdir -p " << folder).p);
+    (void)ret;
+    if (!computed->save(path)) {
+      spdlog::warn("Could not write static sdf to {}", path);
+    }
+    res = computed;
+  }
+
+  cache[hash] = res;
+  return res;
+}
+
+// Sphere that contains a part of the shape of a link, with the center in the
+// frame of the link.
+struct LinkSphere {
+  rai::Frame *frame;
+  arr center;
+  double radius;
+};
+
+// Covers the shape of a frame with spheres. Elongated shapes are split along
+// their main axis into slices, each covered by one sphere.
+std::vector<LinkSphere> get_link_spheres(rai::Frame *f) {
+  const arr &size = f->shape->size;
+
+  // main axis, length along it, and radius of the cross section
+  uint axis = 2;
+  double length = 0.;
+  double cross_radius = 0.;
+  switch (f->shape->type()) {
+  case rai::ST_box:
+  case rai::ST_ssBox: {
+    axis = argmax(size({0, 2}));
+    length = size(axis);
+    const double a = 0.5 * size((axis + 1) % 3);
+    const double b = 0.5 * size((axis + 2) % 3);
+    cross_radius = std::sqrt(a * a + b * b);
+    break;
+  }
+  case rai::ST_cylinder:
+    length = size(0);
+    cross_radius = size(1);
+    break;
+  case rai::ST_capsule: {
+    // spheres on the axis cover the capsule exactly if they are dense enough
+    const uint num = std::max(1u, uint(std::ceil(size(0) / size(1))));
+    const double step = size(0) / num;
+    std::vector<LinkSphere> spheres;
+    for (uint k = 0; k <= num; ++k) {
+      arr c = zeros(3);
+      c(2) = -0.5 * size(0) + k * step;
+      spheres.push_back(
+          {f, c, std::sqrt(size(1) * size(1) + 0.25 * step * step)});
+    }
+    return spheres;
+  }
+  case rai::ST_sphere:
+    return {{f, zeros(3), size(-1)}};
+  default:
+    return {{f, zeros(3), get_bounding_radius(f)}};
+  }
+
+  const uint num =
+      std::max(1u, uint(std::ceil(length / std::max(2 * cross_radius, 1e-3))));
+  const double step = length / num;
+
+  std::vector<LinkSphere> spheres;
+  for (uint k = 0; k < num; ++k) {
+    arr c = zeros(3);
+    c(axis) = -0.5 * length + (k + 0.5) * step;
+    spheres.push_back(
+        {f, c, std::sqrt(cross_radius * cross_radius + 0.25 * step * step)});
+  }
+  return spheres;
+}
+
+// Query that only checks the planned robot against the static geometry with
+// fcl if one of its link spheres is closer to it than the margin. Otherwise, a
+// copy of the problem is queried, in which the pairs of robot links and static
+// frames are deactivated.
+// Setting up the copy is expensive: a query should be built once per problem,
+// and passed to the collision checks of the planner and the postprocessing.
+// The animation and the active joints of the problem must not change
+// afterwards.
+class StaticSdfQuery {
+public:
+  StaticSdfQuery(TimedConfigurationProblem &_TP, const double _margin = 0.02)
+      : TP(_TP), margin(_margin) {
+    const FrameL static_frames = get_static_frames(TP.C, TP.A);
+    field = get_static_sdf(static_frames);
+
+    // the frames that move with the active joints
+    std::vector<bool> is_link(TP.C.frames.N, false);
+    for (auto *j : TP.C.activeJoints) {
+      std::vector<rai::Frame *> stack = {j->frame};
+      while (!stack.empty()) {
+        rai::Frame *f = stack.back();
+        stack.pop_back();
+        is_link[f->ID] = true;
+        for (auto *c : f->children) {
+          stack.push_back(c);
+        }
+      }
+    }
+
+    FrameL links;
+    for (auto *f : TP.C.frames) {
+      if (is_link[f->ID] && f->shape && f->getShape().cont != 0) {
+        links.append(f);
+        for (const auto &s : get_link_spheres(f)) {
+          spheres.push_back(s);
+        }
+      }
+    }
+
+    uintA pairs = get_cant_collide_pairs(TP.C);
+    pairs.reshape(-1);
+    for (auto *a : links) {
+      for (auto *b : static_frames) {
+        pairs.append(TUP(a->ID, b->ID));
+      }
+    }
+    pairs.reshape(-1, 2);
+
+    TP_dynamic = std::make_unique<TimedConfigurationProblem>(TP.C, TP.A);
+    TP_dynamic->activeOnly = TP.activeOnly;
+    TP_dynamic->C.fcl()->deactivatePairs(pairs);
+    TP_dynamic->C.fcl()->stopEarly = TP.C.fcl()->stopEarly;
+  }
+
+  // lower bound on the distance of the links to the static geometry at q
+  double get_static_clearance(const arr &q) {
+    TP_dynamic->C.setJointState(q);
+
+    double clearance = 1e6;
+    for (const auto &s : spheres) {
+      rai::Frame *f = TP_dynamic->C.frames(s.frame->ID);
+      const arr p = f->getPosition() + f->getRotationMatrix() * s.center;
+      clearance = std::min(clearance, field->get_distance(p) - s.radius);
+    }
+    return clearance;
+  }
+
+  // The settings of the collision checker of the problem (e.g. the cutoff of
+  // an edge checker) are applied to the copy before each query.
+  std::shared_ptr<QueryResult> query(const arr &q, const double t) {
+    const double clearance = get_static_clearance(q);
+    if (clearance > margin) {
+      ++num_filtered;
+      last_static_clearance = clearance;
+      TP_dynamic->activeOnly = TP.activeOnly;
+      TP_dynamic->C.fcl()->cutoff = TP.C.fcl()->cutoff;
+      TP_dynamic->C.fcl()->stopEarly = TP.C.fcl()->stopEarly;
+      return TP_dynamic->query(q, t);
+    }
+    ++num_narrow_phase;
+    last_static_clearance = std::numeric_limits<double>::infinity();
+    return TP.query(q, t);
+  }
+
+  // lower bound on the distance to the static geometry at the last query if it
+  // was filtered, i.e. if the result does not contain these distances.
+  // Infinity otherwise.
+  double get_last_static_clearance() const { return last_static_clearance; }
+
+  uint get_num_filtered() const { return num_filtered; }
+  uint get_num_narrow_phase() const { return num_narrow_phase; }
+
+private:
+  TimedConfigurationProblem &TP;
+  double margin;
+
+  std::shared_ptr<const StaticSdf> field;
+  std::vector<LinkSphere> spheres;
+
+  std::unique_ptr<TimedConfigurationProblem> TP_dynamic;
+
+  double last_static_clearance = std::numeric_limits<double>::infinity();
+
+  uint num_filtered = 0;
+  uint num_narrow_phase = 0;
+};
@@ -0,0 +1,239 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <limits>
+#include <set>
+#include <tuple>
+
+#include <Kin/kin.h>
+
+#include "common/types.h"
+
+#include "samplers/pick_constraints.h"
+#include "samplers/reachability_map.h"
+
+// Prunes and orders the grasp directions that are attempted by the samplers.
+// The objects are boxes resting on a surface, i.e. we can reject directions
+// that would require approaching from below, or grasping a side of the box
+// that is wider than the gripper. The remaining combinations are ordered such
+// that the ones that approach from the top are attempted first.
+namespace direction_planner {
+// maximum width that the two finger gripper can grasp, same as in
+// add_pick_constraints
+const double max_grasp_width = 0.1;
+
+// approaches with a (world) z-component larger than this are from below
+const double max_approach_z = 0.5;
+
+// width of the object between the fingers if grasped from direction dir
+double get_grasp_width(const arr &size, const PickDirection dir) {
+  const uint axis = (uint)dir / 2;
+  double width = std::numeric_limits<double>::max();
+  for (uint i = 0; i < 3; ++i) {
+    if (i != axis) {
+      width = std::min(width, size(i));
+    }
+  }
+  return width;
+}
+
+bool is_graspable(const arr &size, const PickDirection dir,
+                  const EndEffectorType ee_type) {
+  if (ee_type != EndEffectorType::two_finger) {
+    return true;
+  }
+  return get_grasp_width(size, dir) <= max_grasp_width;
+}
+
+// z-component of the approach direction of the end effector if the object is
+// at the given frame
+double get_approach_z(const rai::Configuration &C, const rai::String &frame,
+                      const PickDirection dir) {
+  return get_approach_direction(C, frame, dir)(2);
+}
+
+// z-component of the approach direction if the object is resting on the side
+// opposite of intermediate_dir, i.e. intermediate_dir points up
+double get_intermediate_approach_z(const PickDirection dir,
+                                   const PickDirection intermediate_dir) {
+  return scalarProduct(dir_to_vec(dir), dir_to_vec(intermediate_dir));
+}
+
+// prefers grasps that leave a margin to the maximum width of the gripper. The
+// cost is small compared to the approach direction, which is the z-component
+// of the approach vector.
+double get_width_cost(const arr &size, const PickDirection dir,
+                      const EndEffectorType ee_type) {
+  if (ee_type != EndEffectorType::two_finger) {
+    return 0.;
+  }
+  return 0.1 * get_grasp_width(size, dir) / max_grasp_width;
+}
+
+template <typename T>
+std::vector<T> sort_by_cost(std::vector<std::pair<double, T>> &scored) {
+  std::stable_sort(scored.begin(), scored.end(),
+                   [](const auto &a, const auto &b) {
+                     return a.first < b.first;
+                   });
+
+  std::vector<T> res;
+  for (const auto &s : scored) {
+    res.push_back(s.second);
+  }
+  return res;
+}
+} // namespace direction_planner
+
+// If the object is already held, the pick direction is given by the current
+// grasp and all directions are only checked at the goal.
+std::vector<PickDirection>
+plan_pick_directions(const rai::Configuration &C, const Robot &r,
+                     const rai::String &obj, const rai::String &goal,
+                     const std::vector<PickDirection> &directions,
+                     const bool is_held) {
+  using namespace direction_planner;
+
+  const arr size = C[obj]->shape->size;
+
+  std::vector<std::pair<double, PickDirection>> scored;
+  for (const auto dir : directions) {
+    if (!is_graspable(size, dir, r.ee_type)) {
+      continue;
+    }
+
+    const double pick_z = is_held ? 0. : get_approach_z(C, obj, dir);
+    const double place_z = get_approach_z(C, goal, dir);
+    if (pick_z > max_approach_z || place_z > max_approach_z) {
+      continue;
+    }
+
+    scored.push_back(
+        {pick_z + place_z + get_width_cost(size, dir, r.ee_type), dir});
+  }
+
+  const auto res = sort_by_cost(scored);
+  spdlog::info("Attempting {} of {} pick directions for {}", res.size(),
+               directions.size(), obj.p);
+  return res;
+}
+
+std::vector<std::pair<PickDirection, PickDirection>> plan_handover_directions(
+    const rai::Configuration &C, const Robot &r1, const Robot &r2,
+    const rai::String &obj, const rai::String &goal,
+    const std::vector<std::pair<PickDirection, PickDirection>> &directions,
+    const bool is_held) {
+  using namespace direction_planner;
+
+  const arr size = C[obj]->shape->size;
+
+  std::set<std::pair<PickDirection, PickDirection>> seen;
+  std::vector<std::pair<double, std::pair<PickDirection, PickDirection>>>
+      scored;
+  for (auto dirs : directions) {
+    // the first direction is fixed by the current grasp if the object is held
+    // already, so all combinations that only differ in it are equivalent
+    if (is_held) {
+      dirs.first = !dirs.second;
+    }
+    if (seen.count(dirs) > 0) {
+      continue;
+    }
+    seen.insert(dirs);
+
+    // both grippers can not approach from the same side
+    if (!is_held && dirs.first == dirs.second) {
+      continue;
+    }
+
+    if (!is_graspable(size, dirs.second, r2.ee_type) ||
+        (!is_held && !is_graspable(size, dirs.first, r1.ee_type))) {
+      continue;
+    }
+
+    const double pick_z = is_held ? 0. : get_approach_z(C, obj, dirs.first);
+    const double place_z = get_approach_z(C, goal, dirs.second);
+    if (pick_z > max_approach_z || place_z > max_approach_z) {
+      continue;
+    }
+
+    const double cost =
+        pick_z + place_z +
+        (is_held ? 0. : get_width_cost(size, dirs.first, r1.ee_type)) +
+        get_width_cost(size, dirs.second, r2.ee_type);
+    scored.push_back({cost, dirs});
+  }
+
+  const auto res = sort_by_cost(scored);
+  spdlog::info("Attempting {} of {} handover directions for {}", res.size(),
+               directions.size(), obj.p);
+  return res;
+}
+
+std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
+plan_pick_pick_directions(
+    const rai::Configuration &C, const Robot &r1, const Robot &r2,
+    const rai::String &obj, const rai::String &goal,
+    const std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
+        &directions,
+    const bool is_held) {
+  using namespace direction_planner;
+
+  const arr size = C[obj]->shape->size;
+
+  typedef std::tuple<PickDirection, PickDirection, PickDirection> Directions;
+
+  std::set<Directions> seen;
+  std::vector<std::pair<double, Directions>> scored;
+  for (auto dirs : directions) {
+    // the first grasp is given by the current grasp if the object is held
+    // already, i.e. all combinations that only differ in it are equivalent
+    if (is_held) {
+      std::get<0>(dirs) = !std::get<1>(dirs);
+    }
+    if (seen.count(dirs) > 0) {
+      continue;
+    }
+    seen.insert(dirs);
+
+    const PickDirection pd1 = std::get<0>(dirs);
+    const PickDirection intermediate = std::get<1>(dirs);
+    const PickDirection pd2 = std::get<2>(dirs);
+
+    // the object is placed with the intermediate direction pointing up, i.e.
+    // the robot would have to grasp from below
+    if ((!is_held && pd1 == intermediate) || pd2 == intermediate) {
+      continue;
+    }
+
+    if ((!is_held && !is_graspable(size, pd1, r1.ee_type)) ||
+        !is_graspable(size, pd2, r2.ee_type)) {
+      continue;
+    }
+
+    const double pick_z = is_held ? 0. : get_approach_z(C, obj, pd1);
+    const double intermediate_place_z =
+        is_held ? 0. : get_intermediate_approach_z(pd1, intermediate);
+    const double intermediate_pick_z =
+        get_intermediate_approach_z(pd2, intermediate);
+    const double place_z = get_approach_z(C, goal, pd2);
+
+    if (pick_z > max_approach_z || intermediate_place_z > max_approach_z ||
+        intermediate_pick_z > max_approach_z || place_z > max_approach_z) {
+      continue;
+    }
+
+    const double cost =
+        pick_z + intermediate_place_z + intermediate_pick_z + place_z +
+        (is_held ? 0. : get_width_cost(size, pd1, r1.ee_type)) +
+        get_width_cost(size, pd2, r2.ee_type);
+    scored.push_back({cost, dirs});
+  }
+
+  const auto res = sort_by_cost(scored);
+  spdlog::info("Attempting {} of {} pick-pick directions for {}", res.size(),
+               directions.size(), obj.p);
+  return res;
+}
@@ -10,7 +10,11 @@
 #include "planners/plan.h"
 #include "planners/prioritized_planner.h"
 
+#include "samplers/direction_planner.h"
+#include "samplers/keyframe_library.h"
 #include "samplers/pick_constraints.h"
+#include "samplers/reachability_map.h"
+#include "samplers/sampler_utils.h"
 
 // TODO: unify the two things
 // - reduce code duplication of actual solver and subproblem
@@ -330,11 +334,17 @@ public:
 
     const auto link_to_frame = STRING("table");
 
-    // TODO: solve subproblems to check for feasibility.
-    // For now: hardcode the radius of the ur5
-    if (euclideanDistance(obj_pos, r1_pos) > 1. ||
-        euclideanDistance(goal_pos, r2_pos) > 1. ||
-        euclideanDistance(r1_pos, r2_pos) > 1. * 2) {
+    const bool pick_reachable =
+        !sample_pick ||
+        is_reachable(C, r1, obj_pos,
+                     get_approach_direction(C, obj, pick_direction_1));
+    const bool place_reachable = is_reachable(
+        C, r2, goal_pos, get_approach_direction(C, goal, pick_direction_2));
+
+    if (!pick_reachable || !place_reachable ||
+        euclideanDistance(r1_pos, r2_pos) >
+            get_workspace_from_robot_type(r1.type) +
+                get_workspace_from_robot_type(r2.type)) {
       spdlog::info("Skipping handover keyframe copmutation for obj {} and "
                    "robots {}, {}",
                    obj.p, r1.prefix, r2.prefix);
@@ -453,6 +463,10 @@ public:
 
     ConfigurationProblem cp(C);
 
+    KeyframeLibraryQuery library_query(
+        C, {r1, r2}, PrimitiveType::handover, obj, goal,
+        {pick_direction_1, pick_direction_2}, sample_pick);
+
     const uint max_attempts = 10;
     for (uint j = 0; j < max_attempts; ++j) {
       spdlog::debug("Attempting to solve {}th time", j);
@@ -524,6 +538,11 @@ public:
         // komo.pathConfig.watch(true);
       }
 
+      // the first attempt is initialized from the closest known solution
+      if (j == 0 && library_query.initialize(komo)) {
+        komo.pathConfig.setJointState(komo.x);
+      }
+
       // initialize object pose to start and goal respectively
       spdlog::debug("Setting object poses");
       uintA objID;
@@ -546,7 +565,9 @@ public:
       spdlog::debug("Initialized values, running optimizer");
       komo.run_prepare(0.0, false);
 
+      library_query.start(komo);
       komo.run(options);
+      library_query.stop(komo);
 
       const arr q0 = komo.getPath()[0]();
       const arr q1 = komo.getPath()[1]();
@@ -601,6 +622,8 @@ public:
 
       if (res1->isFeasible && res2->isFeasible && res3->isFeasible &&
           ineq < 1. && eq < 1.) {
+        library_query.add_solution(komo.x);
+
         // komo.pathConfig.watch(true);
         const auto home = C.getJointState();
 
@@ -657,17 +680,8 @@ std::vector<arr> compute_handover_pose(
   return sampler.sample(r1, r2, obj, goal, pick_direction_1, pick_direction_2);
 }
 
-RobotTaskPoseMap
-compute_all_handover_poses(rai::Configuration C,
-                           const std::vector<Robot> &robots,
-                           const bool attempt_all_directions = false) {
-  uint num_objects = 0;
-  for (auto f : C.frames) {
-    if (f->name.contains("obj")) {
-      num_objects += 1;
-    }
-  }
-
+std::vector<std::pair<PickDirection, PickDirection>>
+get_handover_directions(const bool attempt_all_directions) {
   std::vector<std::pair<PickDirection, PickDirection>> directions;
   if (attempt_all_directions) {
     for (int i = 5; i >= 0; --i) {
@@ -679,116 +693,97 @@ compute_all_handover_poses(rai::Configuration C,
   } else {
     directions = {std::make_pair(PickDirection::NegZ, PickDirection::NegZ)};
   }
+  return directions;
+}
 
-  delete_unnecessary_frames(C);
-  const auto pairs = get_cant_collide_pairs(C);
-  C.fcl()->deactivatePairs(pairs);
-
-  HandoverSampler sampler(C);
+// Computes the handover keyframes of robots r1 and r2 for the i-th object.
+RobotTaskPoseMap compute_handover_poses_for_object(
+    HandoverSampler &sampler, const Robot &r1, const Robot &r2, const uint i,
+    const std::vector<std::pair<PickDirection, PickDirection>> &directions,
+    const std::vector<std::pair<Robot, rai::String>> &held_objs) {
   RobotTaskPoseMap rtpm;
 
-  // check if we are currently holding an object with the robot that we are computing the keyframe for
-  std::vector<std::pair<Robot, rai::String>> held_objs;
-  for (const Robot &r : robots) {
-    for (const auto &c: sampler.C[STRING(r.prefix + "pen_tip")]->children){
-      // std::cout << c->name << std::endl;
-      if (c->name.contains("obj")){
-        held_objs.push_back(std::make_pair(r, c->name));
-      }
-    }
+  if (r1 == r2) {
+    return rtpm;
   }
 
-  for (const auto &r1 : robots) {
-    for (const auto &r2 : robots) {
-      for (const auto &robot_obj_pair: held_objs){
-        if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
-          // if we are planning keyframes for this robot, and the robot is holding something, 
-          // we need to disable the collision for this object
-          sampler.C[robot_obj_pair.second]->setContact(0);
-          break;
-        }
-      }
+  const auto obj = STRING("obj" << i + 1);
+  const auto goal = STRING("goal" << i + 1);
 
-      if (r1 == r2) {
-        continue;
-      }
+  bool is_held_by_other_robot = false;
+  bool is_held_by_this_robot = false;
+  for (const auto &robot_obj_pair : held_objs) {
+    if (robot_obj_pair.second == obj && (robot_obj_pair.first != r1)) {
+      is_held_by_other_robot = true;
+      break;
+    }
+    if (robot_obj_pair.second == obj && robot_obj_pair.first == r1) {
+      is_held_by_this_robot = true;
+      break;
+    }
+  }
 
-      setActive(C, std::vector<Robot>{r1, r2});
+  if (is_held_by_other_robot) {
+    return rtpm;
+  }
 
-      for (uint i = 0; i < num_objects; ++i) {
-        const auto obj = STRING("obj" << i + 1);
-        const auto goal = STRING("goal" << i + 1);
-
-        bool is_held_by_other_robot = false;
-        bool is_held_by_this_robot = false;
-        for (const auto &robot_obj_pair: held_objs){
-          if (robot_obj_pair.second == obj && (robot_obj_pair.first != r1)){
-            is_held_by_other_robot = true;
-            break;
-          }
-          if (robot_obj_pair.second == obj && robot_obj_pair.first == r1){
-            is_held_by_this_robot = true;
-            break;
-          }
+  set_contact_of_held_object(sampler.C, {r1, r2}, held_objs, false);
 
-        }
+  spdlog::info("computing handover for {0}, {1}, obj {2}", r1.prefix,
+               r2.prefix, i + 1);
 
-        if (is_held_by_other_robot){
-          continue;
-        }
+  const auto planned_directions = plan_handover_directions(
+      sampler.C, r1, r2, obj, goal, directions, is_held_by_this_robot);
 
-        spdlog::info("computing handover for {0}, {1}, obj {2}", r1.prefix,
-                     r2.prefix, i + 1);
+  for (const auto &dirs : planned_directions) {
+    const auto sol = sampler.sample(r1, r2, obj, goal, dirs.first,
+                                    dirs.second, !is_held_by_this_robot);
 
-        const auto obj_quat = C[obj]->getRelativeQuaternion();
+    if (sol.size() > 0) {
+      RobotTaskPair rtp;
+      rtp.robots = {r1, r2};
+      rtp.task = Task{.object = i, .type = PrimitiveType::handover};
 
-        std::vector<std::pair<PickDirection, PickDirection>> reordered_directions;
-        for (const auto &d: directions){
-          if (euclideanDistance(dir_to_vec(d.first), -get_pos_z_axis_dir(obj_quat)) < 1e-6 || 
-              euclideanDistance(dir_to_vec(d.second), -get_pos_z_axis_dir(obj_quat)) < 1e-6 ){
-            reordered_directions.push_back(d);
-          }
-        }
+      rtpm[rtp].push_back(sol);
+      break;
+    } else {
+      spdlog::info("Could not find a solution.");
+    }
+  }
 
-        for (const auto &dir: directions){
-          if (std::find(reordered_directions.begin(), reordered_directions.end(), dir) == reordered_directions.end()){
-            reordered_directions.push_back(dir);
-          }
-        }
+  set_contact_of_held_object(sampler.C, {r1, r2}, held_objs, true);
 
-        for (const auto &dirs : reordered_directions) {
+  return rtpm;
+}
 
-          const auto sol =
-              sampler.sample(r1, r2, obj, goal, dirs.first, dirs.second, !is_held_by_this_robot);
+RobotTaskPoseMap
+compute_all_handover_poses(rai::Configuration C,
+                           const std::vector<Robot> &robots,
+                           const bool attempt_all_directions = false) {
+  const uint num_objects = get_num_objects(C);
 
-          // const auto sol = compute_handover_pose(C, r1, r2, obj, goal);
+  const auto directions = get_handover_directions(attempt_all_directions);
 
-          if (sol.size() > 0) {
-            RobotTaskPair rtp;
-            rtp.robots = {r1, r2};
-            rtp.task = Task{.object = i, .type = PrimitiveType::handover};
+  delete_unnecessary_frames(C);
+  const auto pairs = get_cant_collide_pairs(C);
+  C.fcl()->deactivatePairs(pairs);
 
-            rtpm[rtp].push_back(sol);
-            break;
-          }
+  HandoverSampler sampler(C);
+  RobotTaskPoseMap rtpm;
 
-          else {
-            spdlog::info("Could not find a solution.");
-          }
-        }
-      
-      }
+  // check if we are currently holding an object with the robot that we are
+  // computing the keyframe for
+  const auto held_objs = get_held_objects(sampler.C, robots);
 
-      for (const auto &robot_obj_pair: held_objs){
-        if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
-          // if we are planning keyframes for this robot, and the robot is holding something, 
-          // we need to disable the collision for this object
-          sampler.C[robot_obj_pair.second]->setContact(1);
-          break;
-        }
+  for (const auto &r1 : robots) {
+    for (const auto &r2 : robots) {
+      for (uint i = 0; i < num_objects; ++i) {
+        const auto res = compute_handover_poses_for_object(
+            sampler, r1, r2, i, directions, held_objs);
+        rtpm.insert(res.begin(), res.end());
       }
     }
   }
 
   return rtpm;
-}
\ No newline at end of file
+}
@@ -0,0 +1,351 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include <chrono>
+#include <fstream>
+#include <limits>
+#include <mutex>
+#include <unordered_map>
+
+#include <KOMO/komo.h>
+#include <Kin/kin.h>
+
+#include "json/json.h"
+
+#include "common/config.h"
+#include "common/types.h"
+
+#include "samplers/pick_constraints.h"
+
+using json = nlohmann::ordered_json;
+
+// Experience library for the keyframe optimization: solved keyframe problems
+// are stored together with the pose of the object and the goal relative to
+// the base of the (first) robot. A new problem with the same structure is
+// initialized with the solution of the closest previously solved problem.
+class KeyframeLibrary {
+public:
+  struct Entry {
+    arr features;
+    arr x;
+  };
+
+  struct Statistics {
+    uint lookups = 0;
+    uint hits = 0;
+
+    uint cold_solves = 0;
+    uint cold_evals = 0;
+    double cold_time = 0.;
+
+    uint warm_solves = 0;
+    uint warm_evals = 0;
+    double warm_time = 0.;
+  };
+
+  // maximum number of solutions we keep per problem structure
+  uint max_entries_per_key = 2000;
+
+  // returns the stored solution closest to the features, or an empty array if
+  // no solution for this problem structure is known
+  arr query(const std::string &key, const arr &features) {
+    std::lock_guard<std::mutex> lock(m);
+    ++stats.lookups;
+
+    if (entries.count(key) == 0) {
+      return {};
+    }
+
+    const Entry *best = nullptr;
+    double min_dist = std::numeric_limits<double>::max();
+    for (const Entry &e : entries.at(key)) {
+      if (e.features.N != features.N) {
+        continue;
+      }
+      const double dist = sqrDistance(e.features, features);
+      if (dist < min_dist) {
+        min_dist = dist;
+        best = &e;
+      }
+    }
+
+    if (!best) {
+      return {};
+    }
+
+    ++stats.hits;
+    return best->x;
+  }
+
+  void add(const std::string &key, const arr &features, const arr &x) {
+    std::lock_guard<std::mutex> lock(m);
+    auto &bucket = entries[key];
+    if (bucket.size() >= max_entries_per_key) {
+      bucket.erase(bucket.begin());
+    }
+    bucket.push_back({features, x});
+  }
+
+  // records the effort of a single solver run
+  void record_solve(const bool warm_started, const uint evals,
+                    const double time) {
+    std::lock_guard<std::mutex> lock(m);
+    if (warm_started) {
+      ++stats.warm_solves;
+      stats.warm_evals += evals;
+      stats.warm_time += time;
+    } else {
+      ++stats.cold_solves;
+      stats.cold_evals += evals;
+      stats.cold_time += time;
+    }
+  }
+
+  Statistics get_statistics() {
+    std::lock_guard<std::mutex> lock(m);
+    return stats;
+  }
+
+  uint size() {
+    std::lock_guard<std::mutex> lock(m);
+    uint cnt = 0;
+    for (const auto &e : entries) {
+      cnt += e.second.size();
+    }
+    return cnt;
+  }
+
+  void log_statistics() {
+    const Statistics s = get_statistics();
+    spdlog::info("Keyframe library: {} lookups, {} hits", s.lookups, s.hits);
+    if (s.cold_solves > 0) {
+      spdlog::info("Cold solves: {}, avg. evals {:.1f}, avg. time {:.3f}s",
+                   s.cold_solves, 1. * s.cold_evals / s.cold_solves,
+                   s.cold_time / s.cold_solves);
+    }
+    if (s.warm_solves > 0) {
+      spdlog::info("Warm solves: {}, avg. evals {:.1f}, avg. time {:.3f}s",
+                   s.warm_solves, 1. * s.warm_evals / s.warm_solves,
+                   s.warm_time / s.warm_solves);
+    }
+  }
+
+  void save(const std::string &path) {
+    std::lock_guard<std::mutex> lock(m);
+
+    json data;
+    for (const auto &e : entries) {
+      json bucket;
+      for (const auto &entry : e.second) {
+        json j;
+        j["features"] = std::vector<double>(entry.features.begin(),
+                                            entry.features.end());
+        j["x"] = std::vector<double>(entry.x.begin(), entry.x.end());
+        bucket.push_back(j);
+      }
+      data["entries"][e.first] = bucket;
+    }
+
+    std::ofstream f(path);
+    f << data;
+  }
+
+  // Adds the entries stored in the file, keeping the newest
+  // max_entries_per_key per problem structure. A corrupt file (e.g. from an
+  // interrupted save) is ignored, and the library starts empty.
+  bool load(const std::string &path) {
+    std::ifstream ifs(path);
+    if (!ifs.good()) {
+      return false;
+    }
+
+    std::unordered_map<std::string, std::vector<Entry>> loaded;
+    try {
+      const json data = json::parse(ifs);
+      for (const auto &item : data.at("entries").items()) {
+        auto &bucket = loaded[item.key()];
+        for (const auto &j : item.value()) {
+          bucket.push_back({to_arr(j.at("features").get<std::vector<double>>()),
+                            to_arr(j.at("x").get<std::vector<double>>())});
+        }
+      }
+    } catch (const json::exception &e) {
+      spdlog::warn("Could not read keyframe library {}: {}. Starting with an "
+                   "empty library.",
+                   path, e.what());
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m);
+    for (auto &item : loaded) {
+      auto &bucket = entries[item.first];
+      bucket.insert(bucket.end(), item.second.begin(), item.second.end());
+      if (bucket.size() > max_entries_per_key) {
+        bucket.erase(bucket.begin(), bucket.end() - max_entries_per_key);
+      }
+    }
+
+    return true;
+  }
+
+private:
+  static arr to_arr(const std::vector<double> &v) {
+    arr a(v.size());
+    for (uint i = 0; i < v.size(); ++i) {
+      a(i) = v[i];
+    }
+    return a;
+  }
+
+  std::mutex m;
+  std::unordered_map<std::string, std::vector<Entry>> entries;
+
+  Statistics stats;
+};
+
+std::string get_keyframe_library_filename() {
+  return global_params.keyframe_library_path;
+}
+
+KeyframeLibrary &get_keyframe_library() {
+  static KeyframeLibrary library;
+  static std::once_flag loaded;
+
+  std::call_once(loaded, []() {
+    if (library.load(get_keyframe_library_filename())) {
+      spdlog::info("Loaded keyframe library with {} entries.", library.size());
+    }
+  });
+
+  return library;
+}
+
+void save_keyframe_library() {
+  if (!global_params.use_keyframe_library) {
+    return;
+  }
+
+  auto &library = get_keyframe_library();
+  library.log_statistics();
+  library.save(get_keyframe_library_filename());
+}
+
+// The structure of the problem: the optimization variables only have the same
+// meaning if the robots, the primitive and the grasp directions are the same.
+std::string make_keyframe_library_key(const std::vector<Robot> &robots,
+                                      const PrimitiveType type,
+                                      const std::vector<PickDirection> &dirs,
+                                      const bool sample_pick = true) {
+  std::stringstream ss;
+  for (const auto &r : robots) {
+    ss << robot_type_to_string(r.type) << "_" << ee_type_to_string(r.ee_type)
+       << ";";
+  }
+  ss << primitive_type_to_string(type) << ";";
+  for (const auto &d : dirs) {
+    ss << to_string(d) << ";";
+  }
+  ss << sample_pick;
+  return ss.str();
+}
+
+// Position, z- and x-axis of the object and the goal in the base frame of the
+// first robot, and the pose of the other robots relative to it.
+arr make_keyframe_library_features(const rai::Configuration &C,
+                                   const std::vector<Robot> &robots,
+                                   const rai::String &obj,
+                                   const rai::String &goal) {
+  const auto base = STRING(robots[0].prefix << "base");
+  const arr base_pos = C[base]->getPosition();
+  const arr base_rot = C[base]->getRotationMatrix();
+
+  arr features;
+  for (const auto &name : {obj, goal}) {
+    const arr rot = ~base_rot * C[name]->getRotationMatrix();
+    features.append(~base_rot * (C[name]->getPosition() - base_pos));
+    features.append(arr{rot(0, 2), rot(1, 2), rot(2, 2)});
+    features.append(arr{rot(0, 0), rot(1, 0), rot(2, 0)});
+  }
+
+  for (uint i = 1; i < robots.size(); ++i) {
+    const auto other_base = STRING(robots[i].prefix << "base");
+    const arr rot = ~base_rot * C[other_base]->getRotationMatrix();
+    features.append(~base_rot * (C[other_base]->getPosition() - base_pos));
+    features.append(arr{rot(0, 0), rot(1, 0)});
+  }
+
+  return features;
+}
+
+// Bookkeeping of a single keyframe optimization that (possibly) uses the
+// library for initialization.
+class KeyframeLibraryQuery {
+public:
+  KeyframeLibraryQuery(const rai::Configuration &C,
+                       const std::vector<Robot> &robots,
+                       const PrimitiveType type, const rai::String &obj,
+                       const rai::String &goal,
+                       const std::vector<PickDirection> &dirs,
+                       const bool sample_pick = true) {
+    if (!global_params.use_keyframe_library) {
+      return;
+    }
+    enabled = true;
+
+    key = make_keyframe_library_key(robots, type, dirs, sample_pick);
+    features = make_keyframe_library_features(C, robots, obj, goal);
+    seed = get_keyframe_library().query(key, features);
+  }
+
+  // overwrites the initialization of the optimizer if we know a solution to a
+  // similar problem
+  bool initialize(KOMO &komo) {
+    if (!enabled || seed.N == 0 || seed.N != komo.x.N) {
+      warm_started = false;
+      return false;
+    }
+
+    komo.x = seed;
+    warm_started = true;
+    return true;
+  }
+
+  // the effort is counted with the evaluations of the given problem only, the
+  // global counters of rai are shared with other threads (e.g. prefetching)
+  void start(const KOMO &komo) {
+    evals_at_start = komo.evalCount;
+    start_time = std::chrono::high_resolution_clock::now();
+  }
+
+  void stop(const KOMO &komo) {
+    if (!enabled) {
+      return;
+    }
+
+    const auto end_time = std::chrono::high_resolution_clock::now();
+    const double duration =
+        std::chrono::duration<double>(end_time - start_time).count();
+    const uint evals = komo.evalCount - evals_at_start;
+
+    get_keyframe_library().record_solve(warm_started, evals, duration);
+  }
+
+  void add_solution(const arr &x) {
+    if (!enabled) {
+      return;
+    }
+    get_keyframe_library().add(key, features, x);
+  }
+
+private:
+  bool enabled = false;
+  bool warm_started = false;
+
+  std::string key;
+  arr features;
+  arr seed;
+
+  uint evals_at_start = 0;
+  std::chrono::high_resolution_clock::time_point start_time;
+};
@@ -8,7 +8,12 @@
 #include "planners/plan.h"
 #include "planners/prioritized_planner.h"
 
+#include "samplers/direction_planner.h"
+#include "samplers/keyframe_library.h"
 #include "samplers/pick_constraints.h"
+#include "samplers/reachability_map.h"
+#include "samplers/sampler_utils.h"
+#include "samplers/ur5_ik.h"
 
 class PickAndPlaceSampler {
 public:
@@ -53,16 +58,32 @@ public:
 
     setActive(C, r);
 
-    // TODO: solve subproblems to check for feasibility.
-    // For now: hardcode the radius of the ur5
-    if (euclideanDistance(obj_pos, r1_pos) > 1. ||
-        euclideanDistance(goal_pos, r1_pos) > 1.) {
+    // the object keeps its pose relative to the end effector, i.e. we place
+    // with the same approach direction relative to the goal
+    const bool pick_reachable =
+        sample_only_place ||
+        is_reachable(C, r, obj_pos,
+                     get_approach_direction(C, obj, pick_direction));
+    const bool place_reachable = is_reachable(
+        C, r, goal_pos, get_approach_direction(C, goal, pick_direction));
+
+    if (!pick_reachable || !place_reachable) {
       spdlog::info("Skipping pick keyframe computation for obj {} and "
                    "robot {}",
                    obj, r.prefix);
       return {};
     }
 
+    if (global_params.use_analytical_ik && r.type == RobotType::ur5 &&
+        pick_direction == PickDirection::NegZ) {
+      const auto sol = sample_with_analytical_ik(r, obj, goal, sample_only_place);
+      if (sol.size() > 0) {
+        return sol;
+      }
+      spdlog::info("No feasible analytical solution, falling back to the "
+                   "optimizer.");
+    }
+
     KOMO komo;
     komo.verbose = 0;
     komo.setModel(C, true);
@@ -126,6 +147,9 @@ public:
     komo.run_prepare(0.0, false);
     const auto inital_state = komo.pathConfig.getJointState();
 
+    KeyframeLibraryQuery library_query(C, {r}, PrimitiveType::pick, obj, goal,
+                                       {pick_direction}, !sample_only_place);
+
     const uint max_attempts = 10;
     for (uint j = 0; j < max_attempts; ++j) {
       // reset komo to initial state
@@ -157,6 +181,11 @@ public:
         }
       }
 
+      // the first attempt is initialized from the closest known solution
+      if (j == 0) {
+        library_query.initialize(komo);
+      }
+
       komo.pathConfig.setJointState(komo.x);
 
       uintA objID;
@@ -172,7 +201,9 @@ public:
       komo.run_prepare(0.);
       // std::cout << "init confg" << std::endl;
       // komo.pathConfig.watch(true);
+      library_query.start(komo);
       komo.run(options);
+      library_query.stop(komo);
 
       const arr q0 = komo.getPath()[0]();
       const arr q1 = komo.getPath()[1]();
@@ -197,6 +228,7 @@ public:
       const double eq = komo.getReport(false).get<double>("eq");
 
       if (res1->isFeasible && res2->isFeasible && ineq < 1. && eq < 1.) {
+        library_query.add_solution(komo.x);
         return {q0, q1};
 
         // std::cout << q0 << std::endl;
@@ -227,126 +259,208 @@ public:
     std::vector<arr> infeasible;
     return infeasible;
   }
-};
 
-RobotTaskPoseMap compute_all_pick_and_place_positions(
-    rai::Configuration C, const std::vector<Robot> &robots,
-    const bool attempt_all_directions = false) {
-  RobotTaskPoseMap rtpm;
+  // Top-down pick and place with the closed form inverse kinematics of the
+  // UR5: all branches for the pick and the place pose are enumerated, and the
+  // collision free pair that is closest to the home pose is returned.
+  TaskPoses sample_with_analytical_ik(const Robot &r, const rai::String &obj,
+                                      const rai::String &goal,
+                                      const bool sample_only_place) {
+    setActive(C, r);
 
-  uint num_objects = 0;
-  for (auto f : C.frames) {
-    if (f->name.contains("obj")) {
-      num_objects += 1;
+    const UR5InverseKinematics &ik = get_ik(r);
+    if (!ik.is_valid()) {
+      return {};
     }
-  }
 
-  delete_unnecessary_frames(C);
+    const arr q_current = C.getJointState();
+    const arr q_home = r.home_pose.N == q_current.N ? r.home_pose : q_current;
 
-  std::vector<PickDirection> all_directions = {PickDirection::NegZ};
-  if (attempt_all_directions) {
-    all_directions = {PickDirection::NegZ, PickDirection::NegX,
-                      PickDirection::NegY, PickDirection::PosZ,
-                      PickDirection::PosX, PickDirection::PosY};
-  }
-
-  const auto pairs = get_cant_collide_pairs(C);
-  C.fcl()->deactivatePairs(pairs);
+    const auto pen_tip = STRING(r.prefix << r.ee_frame_name);
 
-  PickAndPlaceSampler sampler(C);
+    const arr obj_pose = ur5_ik::get_frame_transform(C[obj]);
+    const arr goal_pose = ur5_ik::get_frame_transform(C[goal]);
 
-  // check if we are currently holding an object with the robot that we are computing the keyframe for
-  std::vector<std::pair<Robot, rai::String>> held_objs;
-  for (const Robot &r : robots) {
-    for (const auto &c: sampler.C[STRING(r.prefix + "pen_tip")]->children){
-      // std::cout << c->name << std::endl;
-      if (c->name.contains("obj")){
-        held_objs.push_back(std::make_pair(r, c->name));
-      }
+    // if we are holding the object already, the grasp is fixed
+    std::vector<arr> grasp_poses;
+    if (sample_only_place) {
+      grasp_poses = {ur5_ik::get_frame_transform(C[pen_tip])};
+    } else {
+      grasp_poses = get_top_grasp_poses(C, obj, r.ee_type);
     }
-  }
 
-  for (const Robot &r : robots) {
-    for (const auto &robot_obj_pair: held_objs){
-      if (r == robot_obj_pair.first){
-        // if we are planning keyframes for this robot, and the robot is holding something, 
-        // we need to disable the collision for this object
-        sampler.C[robot_obj_pair.second]->setContact(0);
-        break;
-      }
+    ConfigurationProblem cp_pick(C);
+
+    ConfigurationProblem cp_place(C);
+    {
+      // link object to robot
+      auto from = cp_place.C[pen_tip];
+      auto to = cp_place.C[obj];
+      to->unLink();
+      to->linkFrom(from, true);
     }
+    cp_place.C.calc_indexedActiveJoints();
 
-    for (uint i = 0; i < num_objects; ++i) {
-      const auto obj = STRING("obj" << i + 1);
-      const auto goal = STRING("goal" << i + 1);
-
-      bool is_held_by_other_robot = false;
-      bool is_held_by_this_robot = false;
-      for (const auto &robot_obj_pair: held_objs){
-        if (robot_obj_pair.second == obj && robot_obj_pair.first != r){
-          is_held_by_other_robot = true;
-          break;
-        }
-        if (robot_obj_pair.second == obj && robot_obj_pair.first == r){
-          is_held_by_this_robot = true;
-          break;
-        }
+    TaskPoses best;
+    double min_dist = std::numeric_limits<double>::max();
+
+    for (const arr &grasp_pose : grasp_poses) {
+      std::vector<arr> pick_solutions;
+      if (sample_only_place) {
+        pick_solutions = {q_current};
+      } else {
+        pick_solutions = ik.solve(grasp_pose, q_home);
       }
 
-      if (is_held_by_other_robot){
+      // the object keeps its pose relative to the end effector
+      const arr place_pose = goal_pose * ur5_ik::invert_transform(obj_pose) *
+                             grasp_pose;
+      const auto place_solutions = ik.solve(place_pose, q_home);
+
+      if (pick_solutions.size() == 0 || place_solutions.size() == 0) {
         continue;
       }
 
-      // TODO: figure out which direction is pointing in pos z-direction in
-      // world frame, and prioritize this on in our search
-      const auto obj_quat = C[obj]->getRelativeQuaternion();
-
-      // reorder the directions to make sure we try the one that points to the top first
-      std::vector<PickDirection> reordered_directions;
-      PickDirection pos_z_dir;
-      for (const auto &dir: all_directions){
-        if (euclideanDistance(dir_to_vec(dir), -get_pos_z_axis_dir(obj_quat)) < 1e-6){
-          reordered_directions.push_back(dir);
-          pos_z_dir = dir;
+      // solutions are sorted by their distance to the home pose, i.e. we can
+      // stop at the first feasible one
+      for (const arr &q0 : pick_solutions) {
+        const double d0 = euclideanDistance(q0, q_home);
+        if (d0 >= min_dist) {
           break;
         }
-      }
-
-      for (const auto &dir: all_directions){
-        if (dir != pos_z_dir){
-          reordered_directions.push_back(dir);
-        }
-      }
-
-      for (const auto dir : reordered_directions) {
-        // C.watch(true);
-        if (euclideanDistance(dir_to_vec(dir), get_pos_z_axis_dir(obj_quat)) < 1e-6) {
-          spdlog::info("skipping direction " + to_string(dir) + " in pick-pose computation.");
+        if (!sample_only_place && !cp_pick.query(q0)->isFeasible) {
           continue;
         }
 
-        const auto sol = sampler.sample(r, obj, goal, dir, is_held_by_this_robot);
+        // the object has to be at the pick pose when checking the place pose
+        cp_place.C.setJointState(q0);
+        for (const arr &q1 : place_solutions) {
+          const double d1 = euclideanDistance(q1, q_home);
+          if (d0 + d1 >= min_dist) {
+            break;
+          }
+          if (!cp_place.query(q1)->isFeasible) {
+            continue;
+          }
 
-        if (sol.size() > 0) {
-          RobotTaskPair rtp;
-          rtp.robots = {r};
-          rtp.task = Task{.object = i, .type = PrimitiveType::pick};
-          rtpm[rtp].push_back({sol[0], sol[1]});
-          spdlog::info("Found a solution");
+          min_dist = d0 + d1;
+          best = {q0, q1};
           break;
-        } else {
-          spdlog::info("Did not find a solution");
         }
       }
     }
-    for (const auto &robot_obj_pair: held_objs){
-      if (r == robot_obj_pair.first){
-        // if we are planning keyframes for this robot, and the robot is holding something, 
-        // we need to re-enable the collision for this object
-        sampler.C[robot_obj_pair.second]->setContact(1);
-      }
+
+    if (best.size() > 0) {
+      spdlog::info("Found analytical pick/place solution for robot {} and {}",
+                   r.prefix, obj);
+    }
+
+    return best;
+  }
+
+private:
+  // the solvers only depend on the kinematics of the robots, and are built
+  // once per robot
+  const UR5InverseKinematics &get_ik(const Robot &r) {
+    if (ik_solvers.count(r) == 0) {
+      ik_solvers[r] = std::make_shared<const UR5InverseKinematics>(C, r);
+    }
+    return *ik_solvers[r];
+  }
+
+  std::unordered_map<Robot, std::shared_ptr<const UR5InverseKinematics>>
+      ik_solvers;
+};
+
+std::vector<PickDirection>
+get_pick_directions(const bool attempt_all_directions) {
+  if (attempt_all_directions) {
+    return {PickDirection::NegZ, PickDirection::NegX, PickDirection::NegY,
+            PickDirection::PosZ, PickDirection::PosX, PickDirection::PosY};
+  }
+  return {PickDirection::NegZ};
+}
+
+// Computes the pick and place keyframes of robot r for the i-th object.
+// If the robot is already holding the object, only the place pose is sampled.
+RobotTaskPoseMap compute_pick_and_place_positions_for_object(
+    PickAndPlaceSampler &sampler, const Robot &r, const uint i,
+    const std::vector<PickDirection> &all_directions,
+    const std::vector<std::pair<Robot, rai::String>> &held_objs) {
+  RobotTaskPoseMap rtpm;
+
+  const auto obj = STRING("obj" << i + 1);
+  const auto goal = STRING("goal" << i + 1);
+
+  bool is_held_by_other_robot = false;
+  bool is_held_by_this_robot = false;
+  for (const auto &robot_obj_pair : held_objs) {
+    if (robot_obj_pair.second == obj && robot_obj_pair.first != r) {
+      is_held_by_other_robot = true;
+      break;
+    }
+    if (robot_obj_pair.second == obj && robot_obj_pair.first == r) {
+      is_held_by_this_robot = true;
+      break;
+    }
+  }
+
+  if (is_held_by_other_robot) {
+    return rtpm;
+  }
+
+  set_contact_of_held_object(sampler.C, {r}, held_objs, false);
+
+  const auto directions = plan_pick_directions(
+      sampler.C, r, obj, goal, all_directions, is_held_by_this_robot);
+
+  for (const auto dir : directions) {
+    const auto sol = sampler.sample(r, obj, goal, dir, is_held_by_this_robot);
+
+    if (sol.size() > 0) {
+      RobotTaskPair rtp;
+      rtp.robots = {r};
+      rtp.task = Task{.object = i, .type = PrimitiveType::pick};
+      rtpm[rtp].push_back({sol[0], sol[1]});
+      spdlog::info("Found a solution");
+      break;
+    } else {
+      spdlog::info("Did not find a solution");
+    }
+  }
+
+  set_contact_of_held_object(sampler.C, {r}, held_objs, true);
+
+  return rtpm;
+}
+
+RobotTaskPoseMap compute_all_pick_and_place_positions(
+    rai::Configuration C, const std::vector<Robot> &robots,
+    const bool attempt_all_directions = false) {
+  RobotTaskPoseMap rtpm;
+
+  const uint num_objects = get_num_objects(C);
+
+  delete_unnecessary_frames(C);
+
+  const auto all_directions = get_pick_directions(attempt_all_directions);
+
+  const auto pairs = get_cant_collide_pairs(C);
+  C.fcl()->deactivatePairs(pairs);
+
+  PickAndPlaceSampler sampler(C);
+
+  // check if we are currently holding an object with the robot that we are
+  // computing the keyframe for
+  const auto held_objs = get_held_objects(sampler.C, robots);
+
+  for (const Robot &r : robots) {
+    for (uint i = 0; i < num_objects; ++i) {
+      const auto res = compute_pick_and_place_positions_for_object(
+          sampler, r, i, all_directions, held_objs);
+      rtpm.insert(res.begin(), res.end());
     }
   }
 
   return rtpm;
-}
\ No newline at end of file
+}
@@ -0,0 +1,319 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <Kin/kin.h>
+
+#include "common/config.h"
+#include "common/env_util.h"
+#include "common/types.h"
+
+#include "samplers/pick_constraints.h"
+
+// Voxel grid over the workspace of a robot, expressed in the base frame of the
+// robot. Each voxel stores a bitmask over the six axis-aligned approach
+// directions (i.e. the z-axis of the end effector) with which the end effector
+// was able to reach the voxel.
+// The map is built from a finite number of random joint states, i.e. it is an
+// under-approximation: a voxel that no sample hit may still be reachable. It
+// is only used to discard keyframe problems that can not be solved anyways,
+// the samples are thus dilated by one voxel, and a query additionally accepts
+// reachable voxels within a safety margin around the position.
+class ReachabilityMap {
+public:
+  static constexpr uint32_t file_magic = 0x50414d52; // "RMAP"
+  static constexpr uint32_t file_version = 1;
+
+  ReachabilityMap() {}
+  ReachabilityMap(const double _resolution, const double _extent)
+      : resolution(_resolution), extent(_extent) {
+    n = std::ceil(2 * extent / resolution);
+    voxels.assign(n * n * n, 0);
+  }
+
+  bool empty() const { return voxels.empty(); }
+
+  // position and approach are given in the base frame of the robot
+  void insert(const arr &pos, const arr &approach) {
+    const int ind = index(pos);
+    if (ind < 0) {
+      return;
+    }
+    voxels[ind] |= approach_bits(approach, 0.5);
+  }
+
+  // a position is reachable if any voxel within margin voxels of it is
+  bool is_reachable(const arr &pos, const uint margin = 1) const {
+    return any_in_neighbourhood(pos, 0xff, margin);
+  }
+
+  bool is_reachable(const arr &pos, const arr &approach,
+                    const uint margin = 1) const {
+    return any_in_neighbourhood(pos, approach_bits(approach, 1.), margin);
+  }
+
+  // grows the reachable set by one voxel in each direction to account for the
+  // discretization of the samples
+  void dilate() {
+    std::vector<uint8_t> dilated = voxels;
+    for (int x = 0; x < (int)n; ++x) {
+      for (int y = 0; y < (int)n; ++y) {
+        for (int z = 0; z < (int)n; ++z) {
+          const uint8_t v = voxels[flat_index(x, y, z)];
+          if (v == 0) {
+            continue;
+          }
+          for (int dx = -1; dx <= 1; ++dx) {
+            for (int dy = -1; dy <= 1; ++dy) {
+              for (int dz = -1; dz <= 1; ++dz) {
+                const int nx = x + dx;
+                const int ny = y + dy;
+                const int nz = z + dz;
+                if (nx < 0 || ny < 0 || nz < 0 || nx >= (int)n ||
+                    ny >= (int)n || nz >= (int)n) {
+                  continue;
+                }
+                dilated[flat_index(nx, ny, nz)] |= v;
+              }
+            }
+          }
+        }
+      }
+    }
+    voxels = dilated;
+  }
+
+  void save(const std::string &path) const {
+    std::ofstream f(path, std::ios::binary);
+    f.write(reinterpret_cast<const char *>(&file_magic), sizeof(file_magic));
+    f.write(reinterpret_cast<const char *>(&file_version),
+            sizeof(file_version));
+    f.write(reinterpret_cast<const char *>(&resolution), sizeof(resolution));
+    f.write(reinterpret_cast<const char *>(&extent), sizeof(extent));
+    f.write(reinterpret_cast<const char *>(&n), sizeof(n));
+    f.write(reinterpret_cast<const char *>(voxels.data()), voxels.size());
+  }
+
+  bool load(const std::string &path) {
+    std::ifstream f(path, std::ios::binary);
+    if (!f.good()) {
+      return false;
+    }
+
+    uint32_t magic = 0;
+    uint32_t version = 0;
+    f.read(reinterpret_cast<char *>(&magic), sizeof(magic));
+    f.read(reinterpret_cast<char *>(&version), sizeof(version));
+    if (magic != file_magic || version != file_version) {
+      spdlog::warn("Reachability map {} has an unknown format.", path);
+      return false;
+    }
+
+    f.read(reinterpret_cast<char *>(&resolution), sizeof(resolution));
+    f.read(reinterpret_cast<char *>(&extent), sizeof(extent));
+    f.read(reinterpret_cast<char *>(&n), sizeof(n));
+
+    voxels.resize(n * n * n);
+    f.read(reinterpret_cast<char *>(voxels.data()), voxels.size());
+
+    if (!f.good()) {
+      voxels.clear();
+      return false;
+    }
+    return true;
+  }
+
+  double resolution = 0.05;
+  double extent = 1.2;
+  uint32_t n = 0;
+
+  std::vector<uint8_t> voxels;
+
+private:
+  uint flat_index(const int x, const int y, const int z) const {
+    return (x * n + y) * n + z;
+  }
+
+  int index(const arr &pos) const {
+    int ind[3];
+    for (uint i = 0; i < 3; ++i) {
+      ind[i] = std::floor((pos(i) + extent) / resolution);
+      if (ind[i] < 0 || ind[i] >= (int)n) {
+        return -1;
+      }
+    }
+    return flat_index(ind[0], ind[1], ind[2]);
+  }
+
+  // true if a voxel within margin voxels of the position has one of the bits
+  // of the mask set
+  bool any_in_neighbourhood(const arr &pos, const uint8_t mask,
+                            const uint margin) const {
+    if (voxels.empty()) {
+      return false;
+    }
+
+    int lo[3];
+    int hi[3];
+    for (uint i = 0; i < 3; ++i) {
+      const int ind = std::floor((pos(i) + extent) / resolution);
+      lo[i] = std::max(ind - (int)margin, 0);
+      hi[i] = std::min(ind + (int)margin, (int)n - 1);
+      if (lo[i] > hi[i]) {
+        return false;
+      }
+    }
+
+    for (int x = lo[0]; x <= hi[0]; ++x) {
+      for (int y = lo[1]; y <= hi[1]; ++y) {
+        for (int z = lo[2]; z <= hi[2]; ++z) {
+          if ((voxels[flat_index(x, y, z)] & mask) != 0) {
+            return true;
+          }
+        }
+      }
+    }
+    return false;
+  }
+
+  // sets the bit of each axis-direction that is within the given tolerance of
+  // the approach vector. The bit order follows PickDirection.
+  static uint8_t approach_bits(const arr &approach, const double tol) {
+    const arr a = approach / length(approach);
+
+    uint8_t bits = 0;
+    double best = -1;
+    uint8_t best_bit = 0;
+    for (uint i = 0; i < 3; ++i) {
+      for (const int sign : {1, -1}) {
+        const uint8_t bit = 1 << (2 * i + (sign > 0 ? 0 : 1));
+        const double alignment = sign * a(i);
+        if (alignment >= tol) {
+          bits |= bit;
+        }
+        if (alignment > best) {
+          best = alignment;
+          best_bit = bit;
+        }
+      }
+    }
+
+    // always report the dominant direction
+    return bits | best_bit;
+  }
+};
+
+std::string get_reachability_map_filename(const Robot &r) {
+  return global_params.reachability_map_path + robot_type_to_string(r.type) +
+         "_" + ee_type_to_string(r.ee_type) + ".bin";
+}
+
+// Samples random joint states of the robot within its joint limits and records
+// the pose of the end effector relative to the base.
+ReachabilityMap build_reachability_map(rai::Configuration C, const Robot &r,
+                                       const uint num_samples = 500000,
+                                       const double resolution = 0.05,
+                                       const double extent = 1.2) {
+  ReachabilityMap map(resolution, extent);
+
+  setActive(C, r);
+
+  const auto ee = STRING(r.prefix << r.ee_frame_name);
+  const auto base = STRING(r.prefix << "base");
+
+  const arr base_pos = C[base]->getPosition();
+  const arr base_rot = C[base]->getRotationMatrix();
+
+  const arr limits = C.getLimits();
+  arr q = C.getJointState();
+
+  for (uint i = 0; i < num_samples; ++i) {
+    for (uint j = 0; j < q.N; ++j) {
+      double lb = limits(j, 0);
+      double ub = limits(j, 1);
+      if (ub <= lb) {
+        lb = -RAI_PI;
+        ub = RAI_PI;
+      }
+      q(j) = rnd.uni(lb, ub);
+    }
+    C.setJointState(q);
+
+    const arr pos = ~base_rot * (C[ee]->getPosition() - base_pos);
+    const arr approach =
+        ~base_rot * get_pos_z_axis_dir(C[ee]->getQuaternion());
+
+    map.insert(pos, approach);
+  }
+
+  map.dilate();
+
+  return map;
+}
+
+// Maps are loaded lazily from disk, and shared between all samplers.
+const ReachabilityMap *get_reachability_map(const Robot &r) {
+  static std::mutex m;
+  static std::unordered_map<std::string, std::unique_ptr<ReachabilityMap>>
+      maps;
+
+  const std::string filename = get_reachability_map_filename(r);
+
+  std::lock_guard<std::mutex> lock(m);
+  if (maps.count(filename) == 0) {
+    auto map = std::make_unique<ReachabilityMap>();
+    if (map->load(filename)) {
+      spdlog::info("Loaded reachability map {}", filename);
+      maps[filename] = std::move(map);
+    } else {
+      spdlog::warn("Could not load reachability map {}, falling back to "
+                   "the workspace radius.",
+                   filename);
+      maps[filename] = nullptr;
+    }
+  }
+
+  return maps[filename].get();
+}
+
+// Checks if the end effector of the robot can reach the position with the
+// given approach direction (in world coordinates). Falls back to the radius of
+// the workspace if no map is available.
+bool is_reachable(const rai::Configuration &C, const Robot &r, const arr &pos,
+                  const arr &approach = NoArr) {
+  const auto base = STRING(r.prefix << "base");
+  const arr base_pos = C[base]->getPosition();
+
+  const ReachabilityMap *map = nullptr;
+  if (global_params.use_reachability_maps) {
+    map = get_reachability_map(r);
+  }
+
+  if (!map) {
+    return euclideanDistance(pos, base_pos) <=
+           get_workspace_from_robot_type(r.type);
+  }
+
+  const arr base_rot = C[base]->getRotationMatrix();
+  const arr pos_in_base = ~base_rot * (pos - base_pos);
+
+  if (!!approach) {
+    return map->is_reachable(pos_in_base, ~base_rot * approach);
+  }
+  return map->is_reachable(pos_in_base);
+}
+
+// The end effector approaches the object from the given direction, i.e. the
+// z-axis of the end effector is aligned with the direction in the object
+// frame.
+arr get_approach_direction(const rai::Configuration &C, const rai::String &obj,
+                           const PickDirection dir) {
+  const arr rot = C[obj]->getRotationMatrix();
+  return rot * dir_to_vec(dir);
+}
@@ -10,7 +10,11 @@
 #include "planners/plan.h"
 #include "planners/prioritized_planner.h"
 
+#include "samplers/direction_planner.h"
+#include "samplers/keyframe_library.h"
 #include "samplers/pick_constraints.h"
+#include "samplers/reachability_map.h"
+#include "samplers/sampler_utils.h"
 
 bool solve_problem_without_collision() {}
 
@@ -145,12 +149,16 @@ public:
     const arr r1_pos = C[STRING(r1 << "base")]->getPosition();
     const arr r2_pos = C[STRING(r2 << "base")]->getPosition();
 
-    // For now: hardcode the radius of the ur5
     const double ws_1 = get_workspace_from_robot_type(r1.type);
     const double ws_2 = get_workspace_from_robot_type(r2.type);
 
-    if (euclideanDistance(obj_pos, r1_pos) > ws_1 ||
-        euclideanDistance(goal_pos, r2_pos) > ws_2 ||
+    const bool pick_reachable =
+        !sample_pick ||
+        is_reachable(C, r1, obj_pos, get_approach_direction(C, obj, pd1));
+    const bool place_reachable =
+        is_reachable(C, r2, goal_pos, get_approach_direction(C, goal, pd2));
+
+    if (!pick_reachable || !place_reachable ||
         euclideanDistance(r1_pos, r2_pos) > ws_1 + ws_2) {
       spdlog::info("Skipping pickpick keyframe computation for obj {} and "
                    "robots {}, {} due to worspace limits",
@@ -235,6 +243,10 @@ public:
     const double r2_goal_angle =
         std::atan2(goal_pos(1) - r2_pos(1), goal_pos(0) - r2_pos(0)) - r2_z_rot;
 
+    KeyframeLibraryQuery library_query(
+        C, {r1, r2}, PrimitiveType::pick_pick_1, obj, goal,
+        {pd1, intermediate_direction, pd2}, sample_pick);
+
     const uint max_attempts = 5;
     for (uint j = 0; j < max_attempts; ++j) {
       komo.run_prepare(0.00001, false);
@@ -275,6 +287,11 @@ public:
         }
       }
 
+      // the first attempt is initialized from the closest known solution
+      if (j == 0) {
+        library_query.initialize(komo);
+      }
+
       komo.pathConfig.setJointState(komo.x);
       for (const auto f : komo.pathConfig.frames) {
         if (f->name == obj) {
@@ -298,7 +315,9 @@ public:
 
       komo.run_prepare(0.0, false);
 
+      library_query.start(komo);
       komo.run(options);
+      library_query.stop(komo);
 
       // komo.pathConfig.watch(true);
 
@@ -330,6 +349,8 @@ public:
 
       if (res1->isFeasible && res2->isFeasible && res3->isFeasible &&
           res4->isFeasible && ineq < 1. && eq < 1.) {
+        library_query.add_solution(komo.x);
+
         // komo.pathConfig.watch(true);
 
         const auto home = C.getJointState();
@@ -365,17 +386,8 @@ std::vector<arr> compute_pick_and_place_with_intermediate_pose(
   return sampler.sample(r1, r2, obj, goal, pd1, intermediate_direction, pd2);
 }
 
-RobotTaskPoseMap compute_all_pick_and_place_with_intermediate_pose(
-    rai::Configuration C, const std::vector<Robot> &robots,
-    const bool attempt_all_directions = false,
-    const bool allow_repeated_handling = false) {
-  uint num_objects = 0;
-  for (auto f : C.frames) {
-    if (f->name.contains("obj")) {
-      num_objects += 1;
-    }
-  }
-
+std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
+get_pick_pick_directions(const bool attempt_all_directions) {
   std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
       all_directions;
   if (attempt_all_directions) {
@@ -391,6 +403,75 @@ RobotTaskPoseMap compute_all_pick_and_place_with_intermediate_pose(
     all_directions = {std::make_tuple(PickDirection::NegZ, PickDirection::PosZ,
                                       PickDirection::NegZ)};
   }
+  return all_directions;
+}
+
+// Computes the keyframes of both parts of the pick-pick primitive of robots r1
+// and r2 for the i-th object.
+RobotTaskPoseMap compute_pick_and_place_with_intermediate_pose_for_object(
+    RepeatedPickSampler &sampler, const Robot &r1, const Robot &r2,
+    const uint i,
+    const std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
+        &all_directions,
+    const std::vector<std::pair<Robot, rai::String>> &held_objs) {
+  RobotTaskPoseMap rtpm;
+
+  const auto obj = STRING("obj" << i + 1);
+  const auto goal = STRING("goal" << i + 1);
+
+  bool is_held_by_other_robot = false;
+  bool is_held_by_this_robot = false;
+  for (const auto &robot_obj_pair : held_objs) {
+    if (robot_obj_pair.second == obj && robot_obj_pair.first != r1) {
+      is_held_by_other_robot = true;
+      break;
+    }
+    if (robot_obj_pair.second == obj && robot_obj_pair.first == r1) {
+      is_held_by_this_robot = true;
+      break;
+    }
+  }
+
+  if (is_held_by_other_robot) {
+    return rtpm;
+  }
+
+  set_contact_of_held_object(sampler.C, {r1, r2}, held_objs, false);
+
+  const auto planned_directions = plan_pick_pick_directions(
+      sampler.C, r1, r2, obj, goal, all_directions, is_held_by_this_robot);
+
+  for (const auto &d : planned_directions) {
+    const auto sol =
+        sampler.sample(r1, r2, obj, goal, std::get<0>(d), std::get<1>(d),
+                       std::get<2>(d), !is_held_by_this_robot);
+
+    if (sol.size() > 0) {
+      RobotTaskPair rtp_1;
+      rtp_1.robots = {r1, r2};
+      rtp_1.task = Task{.object = i, .type = PrimitiveType::pick_pick_1};
+      rtpm[rtp_1].push_back({sol[0], sol[1]});
+
+      RobotTaskPair rtp_2;
+      rtp_2.robots = {r1, r2};
+      rtp_2.task = Task{.object = i, .type = PrimitiveType::pick_pick_2};
+      rtpm[rtp_2].push_back({sol[2], sol[3]});
+      break;
+    }
+  }
+
+  set_contact_of_held_object(sampler.C, {r1, r2}, held_objs, true);
+
+  return rtpm;
+}
+
+RobotTaskPoseMap compute_all_pick_and_place_with_intermediate_pose(
+    rai::Configuration C, const std::vector<Robot> &robots,
+    const bool attempt_all_directions = false,
+    const bool allow_repeated_handling = false) {
+  const uint num_objects = get_num_objects(C);
+
+  const auto all_directions = get_pick_pick_directions(attempt_all_directions);
 
   delete_unnecessary_frames(C);
   const auto pairs = get_cant_collide_pairs(C);
@@ -400,123 +481,22 @@ RobotTaskPoseMap compute_all_pick_and_place_with_intermediate_pose(
 
   RepeatedPickSampler sampler(C);
 
-  std::vector<std::pair<Robot, rai::String>> held_objs;
-  for (const Robot &r : robots) {
-    for (const auto &c : sampler.C[STRING(r.prefix + "pen_tip")]->children) {
-      // std::cout << c->name << std::endl;
-      if (c->name.contains("obj")) {
-        held_objs.push_back(std::make_pair(r, c->name));
-      }
-    }
-  }
+  const auto held_objs = get_held_objects(sampler.C, robots);
 
   for (const auto &r1 : robots) {
     for (const auto &r2 : robots) {
-      for (const auto &robot_obj_pair: held_objs){
-        if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
-          // if we are planning keyframes for this robot, and the robot is holding something, 
-          // we need to disable the collision for this object
-          sampler.C[robot_obj_pair.second]->setContact(0);
-          break;
-        }
-      }
-
       // if (r1 == r2 && !allow_repeated_handling) {
       //   continue;
       // }
 
       for (uint i = 0; i < num_objects; ++i) {
-        const auto obj = STRING("obj" << i + 1);
-        const auto goal = STRING("goal" << i + 1);
-
-        bool is_held_by_other_robot = false;
-        bool is_held_by_this_robot = false;
-        for (const auto &robot_obj_pair: held_objs){
-          if (robot_obj_pair.second == obj && robot_obj_pair.first != r1){
-            is_held_by_other_robot = true;
-            break;
-          }
-          if (robot_obj_pair.second == obj && robot_obj_pair.first == r1){
-            is_held_by_this_robot = true;
-            break;
-          }
-        }
-
-        if (is_held_by_other_robot){
-          continue;
-        }
-
-        const auto obj_quat = C[obj]->getRelativeQuaternion();
-        const auto goal_quat = C[goal]->getRelativeQuaternion();
-
-        std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
-            reordered_directions;
-        for (const auto &d : all_directions) {
-          if (euclideanDistance(dir_to_vec(std::get<0>(d)),
-                                -get_pos_z_axis_dir(obj_quat)) < 1e-6 ||
-              euclideanDistance(dir_to_vec(std::get<2>(d)),
-                                -get_pos_z_axis_dir(obj_quat)) < 1e-6) {
-            reordered_directions.push_back(d);
-          }
-        }
-
-        for (const auto &dir : all_directions) {
-          if (std::find(reordered_directions.begin(),
-                        reordered_directions.end(),
-                        dir) == reordered_directions.end()) {
-            reordered_directions.push_back(dir);
-          }
-        }
-
-        for (const auto &d : reordered_directions) {
-          // C.watch(true);
-          // std::cout << "looking at  " << to_string(std::get<0>(d)) <<
-          // std::endl; std::cout << "looking at " << to_string(std::get<2>(d))
-          // << std::endl;
-
-          // std::cout << get_pos_z_axis_dir(obj_quat) << std::endl;
-          // std::cout << get_pos_z_axis_dir(goal_quat) << std::endl;
-
-          if (euclideanDistance(dir_to_vec(std::get<0>(d)),
-                                get_pos_z_axis_dir(obj_quat)) < 1e-6 ||
-              euclideanDistance(dir_to_vec(std::get<2>(d)),
-                                get_pos_z_axis_dir(goal_quat)) < 1e-6) {
-            // std::cout << "skipping " << to_string(std::get<0>(d)) <<
-            // std::endl; std::cout << "skipping " << to_string(std::get<2>(d))
-            // << std::endl;
-            continue;
-          }
-
-          const auto sol = sampler.sample(r1, r2, obj, goal, std::get<0>(d),
-                                          std::get<1>(d), std::get<2>(d), !is_held_by_this_robot);
-
-          if (sol.size() > 0) {
-            // std::cout << to_string(std::get<0>(d)) << " " <<
-            // to_string(std::get<1>(d)) << " " << to_string(std::get<2>(d)) <<
-            // std::endl;
-            RobotTaskPair rtp_1;
-            rtp_1.robots = {r1, r2};
-            rtp_1.task = Task{.object = i, .type = PrimitiveType::pick_pick_1};
-            rtpm[rtp_1].push_back({sol[0], sol[1]});
-
-            RobotTaskPair rtp_2;
-            rtp_2.robots = {r1, r2};
-            rtp_2.task = Task{.object = i, .type = PrimitiveType::pick_pick_2};
-            rtpm[rtp_2].push_back({sol[2], sol[3]});
-            break;
-          }
-        }
-      }
-      for (const auto &robot_obj_pair: held_objs){
-        if (r1 == robot_obj_pair.first || r2 == robot_obj_pair.first){
-          // if we are planning keyframes for this robot, and the robot is holding something, 
-          // we need to disable the collision for this object
-          sampler.C[robot_obj_pair.second]->setContact(1);
-          break;
-        }
+        const auto res =
+            compute_pick_and_place_with_intermediate_pose_for_object(
+                sampler, r1, r2, i, all_directions, held_objs);
+        rtpm.insert(res.begin(), res.end());
       }
     }
   }
 
   return rtpm;
-}
\ No newline at end of file
+}
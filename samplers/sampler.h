@@ -2,6 +2,9 @@
 
 #include "spdlog/spdlog.h"
 
+#include <memory>
+#include <unordered_set>
+
 #include <Kin/featureSymbols.h>
 
 #include "planners/plan.h"
@@ -22,24 +25,174 @@ class TaskPoseSampler{
     virtual TaskPoses sample(const RobotTaskPair &rtp, const rai::Animation &A) = 0;
 };
 
-// class RobotTaskPoseSampler{
-//   public:
-//     // this implements caching of results
-//     TaskPoses sample(const rai::Configuration &C, const RobotTaskPair &rtp){
-//       if (cache.count(rtp) > 0){
-//         return cache.at(rtp)[0];
-//       }
-//       else{
-//         const auto res = generate(C, rtp);
-//         cache[rtp].push_back(res);
-
-//         return res;
-//       }
-//     };
-
-//   private:
-//     virtual TaskPoses generate(const rai::Configuration &C, const RobotTaskPair &rtp) = 0;
-
-//     // infeasible is represented as empty vector
-//     std::unordered_map<RobotTaskPair, std::vector<TaskPoses>> cache;
-// };
\ No newline at end of file
+// Computes the keyframes of single robot-task pairs with the samplers of the
+// respective primitives. The samplers hold their own copy of the configuration.
+class PrimitiveKeyframeProvider : public KeyframeProvider {
+public:
+  PrimitiveKeyframeProvider(rai::Configuration C,
+                            const std::vector<Robot> &_robots,
+                            const bool _use_picks, const bool _use_handovers,
+                            const bool _use_repeated_picks,
+                            const bool attempt_all_directions)
+      : robots(_robots), use_picks(_use_picks), use_handovers(_use_handovers),
+        use_repeated_picks(_use_repeated_picks) {
+    num_objects = get_num_objects(C);
+
+    delete_unnecessary_frames(C);
+    const auto pairs = get_cant_collide_pairs(C);
+    C.fcl()->deactivatePairs(pairs);
+
+    pick_directions = get_pick_directions(attempt_all_directions);
+    handover_directions = get_handover_directions(attempt_all_directions);
+    pick_pick_directions = get_pick_pick_directions(attempt_all_directions);
+
+    pick_sampler = std::make_unique<PickAndPlaceSampler>(C);
+    handover_sampler = std::make_unique<HandoverSampler>(C);
+    pick_pick_sampler = std::make_unique<RepeatedPickSampler>(C);
+
+    held_objs = get_held_objects(pick_sampler->C, robots);
+
+    // order the candidates by the distance of the object to the robots
+    std::vector<std::pair<double, RobotTaskPair>> scored;
+    for (uint i = 0; i < num_objects; ++i) {
+      const arr obj_pos = C[STRING("obj" << i + 1)]->getPosition();
+      const arr goal_pos = C[STRING("goal" << i + 1)]->getPosition();
+
+      for (const auto &r1 : robots) {
+        const arr r1_pos = C[STRING(r1.prefix << "base")]->getPosition();
+        if (use_picks) {
+          const double dist = euclideanDistance(obj_pos, r1_pos) +
+                              euclideanDistance(goal_pos, r1_pos);
+          scored.push_back(
+              {dist, RobotTaskPair{.robots = {r1},
+                                   .task = Task{.object = i,
+                                                .type = PrimitiveType::pick}}});
+        }
+
+        for (const auto &r2 : robots) {
+          const arr r2_pos = C[STRING(r2.prefix << "base")]->getPosition();
+          // multi-robot primitives are less likely to be used
+          const double dist = euclideanDistance(obj_pos, r1_pos) +
+                              euclideanDistance(goal_pos, r2_pos) + 1.;
+
+          if (use_handovers && r1 != r2) {
+            scored.push_back(
+                {dist,
+                 RobotTaskPair{.robots = {r1, r2},
+                               .task = Task{.object = i,
+                                            .type = PrimitiveType::handover}}});
+          }
+          if (use_repeated_picks) {
+            scored.push_back(
+                {dist, RobotTaskPair{
+                           .robots = {r1, r2},
+                           .task = Task{.object = i,
+                                        .type = PrimitiveType::pick_pick_1}}});
+            scored.push_back(
+                {dist, RobotTaskPair{
+                           .robots = {r1, r2},
+                           .task = Task{.object = i,
+                                        .type = PrimitiveType::pick_pick_2}}});
+          }
+        }
+      }
+    }
+
+    std::stable_sort(scored.begin(), scored.end(),
+                     [](const auto &a, const auto &b) {
+                       return a.first < b.first;
+                     });
+    for (const auto &e : scored) {
+      all_candidates.push_back(e.second);
+    }
+  }
+
+  std::unordered_map<RobotTaskPair, std::vector<TaskPoses>>
+  compute(const RobotTaskPair &rtp) override {
+    RobotTaskPoseMap res;
+    const uint i = rtp.task.object;
+
+    if (rtp.task.type == PrimitiveType::pick && use_picks) {
+      res = compute_pick_and_place_positions_for_object(
+          *pick_sampler, rtp.robots[0], i, pick_directions, held_objs);
+    } else if (rtp.task.type == PrimitiveType::handover && use_handovers) {
+      res = compute_handover_poses_for_object(*handover_sampler, rtp.robots[0],
+                                              rtp.robots[1], i,
+                                              handover_directions, held_objs);
+    } else if ((rtp.task.type == PrimitiveType::pick_pick_1 ||
+                rtp.task.type == PrimitiveType::pick_pick_2) &&
+               use_repeated_picks) {
+      // both parts of the primitive are computed at once
+      RobotTaskPair first_part = rtp;
+      first_part.task.type = PrimitiveType::pick_pick_1;
+      if (failed_pick_picks.count(first_part) > 0) {
+        return {};
+      }
+
+      res = compute_pick_and_place_with_intermediate_pose_for_object(
+          *pick_pick_sampler, rtp.robots[0], rtp.robots[1], i,
+          pick_pick_directions, held_objs);
+
+      if (res.count(first_part) == 0) {
+        failed_pick_picks.insert(first_part);
+      }
+    }
+
+    return std::unordered_map<RobotTaskPair, std::vector<TaskPoses>>(
+        res.begin(), res.end());
+  }
+
+  std::vector<RobotTaskPair> candidates() const override {
+    return all_candidates;
+  }
+
+private:
+  std::vector<Robot> robots;
+  uint num_objects;
+
+  bool use_picks;
+  bool use_handovers;
+  bool use_repeated_picks;
+
+  std::vector<PickDirection> pick_directions;
+  std::vector<std::pair<PickDirection, PickDirection>> handover_directions;
+  std::vector<std::tuple<PickDirection, PickDirection, PickDirection>>
+      pick_pick_directions;
+
+  std::unique_ptr<PickAndPlaceSampler> pick_sampler;
+  std::unique_ptr<HandoverSampler> handover_sampler;
+  std::unique_ptr<RepeatedPickSampler> pick_pick_sampler;
+
+  std::vector<std::pair<Robot, rai::String>> held_objs;
+
+  std::vector<RobotTaskPair> all_candidates;
+  std::unordered_set<RobotTaskPair> failed_pick_picks;
+};
+
+// Makes a map that computes the keyframes the first time they are needed by
+// the sequence generation or the planner. If enabled, a background thread
+// precomputes the keyframes of the most promising pairs.
+// The samplers and KOMO draw from rai's global random generator, which the
+// prefetch thread then shares with the main thread. The drawn numbers depend
+// on the thread interleaving, i.e. runs with prefetching are not reproducible
+// for a fixed seed.
+RobotTaskPoseMap make_lazy_robot_task_pose_map(
+    const rai::Configuration &C, const std::vector<Robot> &robots,
+    const bool use_picks = true, const bool use_handovers = false,
+    const bool use_repeated_picks = true,
+    const bool attempt_all_directions = false, const bool prefetch = false) {
+  RobotTaskPoseMap rtpm(std::make_shared<PrimitiveKeyframeProvider>(
+      C, robots, use_picks, use_handovers, use_repeated_picks,
+      attempt_all_directions));
+
+  if (prefetch) {
+    spdlog::warn("Prefetching keyframes: results are not reproducible for a "
+                 "fixed seed.");
+    rtpm.get_lazy_keyframes()->start_prefetching(
+        std::make_shared<PrimitiveKeyframeProvider>(
+            C, robots, use_picks, use_handovers, use_repeated_picks,
+            attempt_all_directions));
+  }
+
+  return rtpm;
+}
@@ -40,4 +40,45 @@ void add_grasping_constraint(KOMO &komo, const double start, const double end,
   }
 }
 
-void add_homing_constraint() {}
\ No newline at end of file
+void add_homing_constraint() {}
+
+// Objects that are currently held by one of the robots, i.e. objects that are
+// attached to the end effector.
+std::vector<std::pair<Robot, rai::String>>
+get_held_objects(const rai::Configuration &C,
+                 const std::vector<Robot> &robots) {
+  std::vector<std::pair<Robot, rai::String>> held_objs;
+  for (const Robot &r : robots) {
+    for (const auto &c : C[STRING(r.prefix + "pen_tip")]->children) {
+      if (c->name.contains("obj")) {
+        held_objs.push_back(std::make_pair(r, c->name));
+      }
+    }
+  }
+  return held_objs;
+}
+
+// If we are planning keyframes for a robot that is holding something, we need
+// to disable the collisions for this object (and re-enable them afterwards).
+void set_contact_of_held_object(
+    rai::Configuration &C, const std::vector<Robot> &robots,
+    const std::vector<std::pair<Robot, rai::String>> &held_objs,
+    const bool contact) {
+  for (const auto &robot_obj_pair : held_objs) {
+    if (std::find(robots.begin(), robots.end(), robot_obj_pair.first) !=
+        robots.end()) {
+      C[robot_obj_pair.second]->setContact(contact ? 1 : 0);
+      break;
+    }
+  }
+}
+
+uint get_num_objects(const rai::Configuration &C) {
+  uint num_objects = 0;
+  for (auto f : C.frames) {
+    if (f->name.contains("obj")) {
+      num_objects += 1;
+    }
+  }
+  return num_objects;
+}
@@ -0,0 +1,363 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+
+#include <Kin/kin.h>
+
+#include "common/types.h"
+#include "samplers/pick_constraints.h"
+
+// Closed form inverse kinematics of the UR5e, following the DH-convention of
+// the manufacturer. The solver returns the (up to) eight branches of the
+// inverse kinematics for a pose of the flange in the DH-base frame.
+namespace ur5_ik {
+// DH parameters of the UR5e
+const double d1 = 0.1625;
+const double a2 = -0.425;
+const double a3 = -0.3922;
+const double d4 = 0.1333;
+const double d5 = 0.0997;
+const double d6 = 0.0996;
+
+const double alpha[6] = {RAI_PI / 2, 0, 0, RAI_PI / 2, -RAI_PI / 2, 0};
+const double a[6] = {0, a2, a3, 0, 0, 0};
+const double d[6] = {d1, 0, 0, d4, d5, d6};
+
+arr make_transform(const arr &R, const arr &p) {
+  arr T = eye(4);
+  for (uint i = 0; i < 3; ++i) {
+    for (uint j = 0; j < 3; ++j) {
+      T(i, j) = R(i, j);
+    }
+    T(i, 3) = p(i);
+  }
+  return T;
+}
+
+arr invert_transform(const arr &T) {
+  arr R(3, 3);
+  arr p(3);
+  for (uint i = 0; i < 3; ++i) {
+    for (uint j = 0; j < 3; ++j) {
+      R(i, j) = T(j, i);
+    }
+  }
+  for (uint i = 0; i < 3; ++i) {
+    p(i) = -(R(i, 0) * T(0, 3) + R(i, 1) * T(1, 3) + R(i, 2) * T(2, 3));
+  }
+  return make_transform(R, p);
+}
+
+arr rot_z(const double angle) {
+  arr T = eye(4);
+  T(0, 0) = std::cos(angle);
+  T(0, 1) = -std::sin(angle);
+  T(1, 0) = std::sin(angle);
+  T(1, 1) = std::cos(angle);
+  return T;
+}
+
+arr get_frame_transform(const rai::Frame *f) {
+  return make_transform(f->getRotationMatrix(), f->getPosition());
+}
+
+// transformation from link i to link i+1
+arr dh_transform(const uint i, const double theta) {
+  const double ct = std::cos(theta);
+  const double st = std::sin(theta);
+  const double ca = std::cos(alpha[i]);
+  const double sa = std::sin(alpha[i]);
+
+  arr T = eye(4);
+  T(0, 0) = ct;
+  T(0, 1) = -st * ca;
+  T(0, 2) = st * sa;
+  T(0, 3) = a[i] * ct;
+  T(1, 0) = st;
+  T(1, 1) = ct * ca;
+  T(1, 2) = -ct * sa;
+  T(1, 3) = a[i] * st;
+  T(2, 1) = sa;
+  T(2, 2) = ca;
+  T(2, 3) = d[i];
+  return T;
+}
+
+arr forward_kinematics(const arr &q) {
+  arr T = eye(4);
+  for (uint i = 0; i < 6; ++i) {
+    T = T * dh_transform(i, q(i));
+  }
+  return T;
+}
+
+// Returns all solutions for the flange pose T06. Solutions are not wrapped to
+// the joint limits.
+std::vector<arr> inverse_kinematics(const arr &T06, const double q6_default = 0.) {
+  std::vector<arr> solutions;
+
+  // position of the wrist center (origin of frame 5)
+  const double p05x = T06(0, 3) - d6 * T06(0, 2);
+  const double p05y = T06(1, 3) - d6 * T06(1, 2);
+
+  const double r05 = std::sqrt(p05x * p05x + p05y * p05y);
+  if (r05 < std::fabs(d4)) {
+    return solutions;
+  }
+
+  const double psi = std::atan2(p05y, p05x);
+  const double phi = std::acos(d4 / r05);
+
+  for (const double s1 : {1., -1.}) {
+    const double q1 = psi + s1 * phi + RAI_PI / 2;
+    const double c1 = std::cos(q1);
+    const double sn1 = std::sin(q1);
+
+    const double c5 =
+        (T06(0, 3) * sn1 - T06(1, 3) * c1 - d4) / d6;
+    if (std::fabs(c5) > 1. + 1e-9) {
+      continue;
+    }
+
+    for (const double s5 : {1., -1.}) {
+      const double q5 = s5 * std::acos(std::clamp(c5, -1., 1.));
+      const double sn5 = std::sin(q5);
+
+      // q6 is undetermined if the wrist is singular
+      double q6 = q6_default;
+      if (std::fabs(sn5) > 1e-6) {
+        q6 = std::atan2((-T06(0, 1) * sn1 + T06(1, 1) * c1) / sn5,
+                        (T06(0, 0) * sn1 - T06(1, 0) * c1) / sn5);
+      }
+
+      const arr T14 = invert_transform(dh_transform(0, q1)) * T06 *
+                      invert_transform(dh_transform(4, q5) *
+                                       dh_transform(5, q6));
+
+      // vector from the origin of frame 1 to the origin of frame 3
+      const double p13x = T14(0, 3) - d4 * T14(0, 1);
+      const double p13y = T14(1, 3) - d4 * T14(1, 1);
+      const double p13z = T14(2, 3) - d4 * T14(2, 1);
+      const double p13_sq = p13x * p13x + p13y * p13y + p13z * p13z;
+
+      const double c3 = (p13_sq - a2 * a2 - a3 * a3) / (2 * a2 * a3);
+      if (std::fabs(c3) > 1. + 1e-9) {
+        continue;
+      }
+
+      for (const double s3 : {1., -1.}) {
+        const double q3 = s3 * std::acos(std::clamp(c3, -1., 1.));
+        const double q2 = -std::atan2(p13y, -p13x) +
+                          std::asin(a3 * std::sin(q3) / std::sqrt(p13_sq));
+
+        const arr T34 =
+            invert_transform(dh_transform(1, q2) * dh_transform(2, q3)) * T14;
+        const double q4 = std::atan2(T34(1, 0), T34(0, 0));
+
+        solutions.push_back(arr{q1, q2, q3, q4, q5, q6});
+      }
+    }
+  }
+
+  return solutions;
+}
+} // namespace ur5_ik
+
+// Maps poses of the end effector of a UR5 in the configuration to the DH-model
+// and back. The constant offsets between the model in the configuration and
+// the DH-frames (base and flange) are identified from the configuration and
+// verified with the forward kinematics of the configuration.
+class UR5InverseKinematics {
+public:
+  UR5InverseKinematics(rai::Configuration C, const Robot &_r) : r(_r) {
+    if (r.type != RobotType::ur5) {
+      return;
+    }
+
+    setActive(C, r);
+    const arr q_ref = C.getJointState();
+    if (q_ref.N != 6) {
+      return;
+    }
+
+    const auto ee = STRING(r.prefix << r.ee_frame_name);
+    const auto flange = STRING(r.prefix << "wrist_3_joint");
+    if (!C.getFrame(ee, false) || !C.getFrame(flange, false)) {
+      return;
+    }
+
+    // the end effector is rigidly attached to the last link
+    ee_offset = ur5_ik::invert_transform(
+                    ur5_ik::get_frame_transform(C[flange])) *
+                ur5_ik::get_frame_transform(C[ee]);
+
+    limits = C.getLimits();
+
+    // configurations that are used to check the calibration. They are drawn
+    // with a fixed seed to not change the random numbers of the samplers.
+    std::mt19937 rng(0);
+    std::uniform_real_distribution<double> dist(-1., 1.);
+    std::vector<arr> test_configurations;
+    for (uint i = 0; i < 3; ++i) {
+      arr q = q_ref;
+      for (uint j = 0; j < q.N; ++j) {
+        q(j) += dist(rng);
+      }
+      test_configurations.push_back(q);
+    }
+
+    // the flange of the model might be rotated around its z-axis compared to
+    // the DH-frame
+    for (const double flange_angle :
+         {0., RAI_PI / 2, RAI_PI, -RAI_PI / 2}) {
+      const arr G = ur5_ik::rot_z(flange_angle);
+
+      C.setJointState(q_ref);
+      const arr B = ur5_ik::get_frame_transform(C[flange]) *
+                    ur5_ik::invert_transform(
+                        ur5_ik::forward_kinematics(q_ref) * G);
+
+      bool matches = true;
+      for (const arr &q : test_configurations) {
+        C.setJointState(q);
+        const arr predicted = B * ur5_ik::forward_kinematics(q) * G;
+        const arr actual = ur5_ik::get_frame_transform(C[flange]);
+        if (maxDiff(predicted, actual) > 1e-4) {
+          matches = false;
+          break;
+        }
+      }
+
+      if (matches) {
+        base_offset = B;
+        flange_offset = G;
+        valid = true;
+        break;
+      }
+    }
+
+    if (!valid) {
+      spdlog::warn("Kinematic model of robot {} does not match the UR5e, "
+                   "disabling the analytical inverse kinematics.",
+                   r.prefix);
+    }
+  }
+
+  bool is_valid() const { return valid; }
+
+  // Returns all solutions within the joint limits for the pose (4x4
+  // homogeneous transformation in world coordinates) of the end effector,
+  // ordered by the distance to the reference pose.
+  std::vector<arr> solve(const arr &ee_pose, const arr &q_ref) const {
+    std::vector<arr> res;
+    if (!valid) {
+      return res;
+    }
+
+    const arr T06 = ur5_ik::invert_transform(base_offset) * ee_pose *
+                    ur5_ik::invert_transform(ee_offset) *
+                    ur5_ik::invert_transform(flange_offset);
+
+    for (arr q : ur5_ik::inverse_kinematics(T06, q_ref(5))) {
+      if (wrap_to_limits(q, q_ref)) {
+        res.push_back(q);
+      }
+    }
+
+    std::sort(res.begin(), res.end(), [&](const arr &a, const arr &b) {
+      return euclideanDistance(a, q_ref) < euclideanDistance(b, q_ref);
+    });
+
+    return res;
+  }
+
+private:
+  // chooses the representative of each joint value (modulo 2pi) that is
+  // closest to the reference pose and within the joint limits
+  bool wrap_to_limits(arr &q, const arr &q_ref) const {
+    for (uint i = 0; i < q.N; ++i) {
+      const double lb = limits(i, 0);
+      const double ub = limits(i, 1);
+      const bool has_limits = ub > lb;
+
+      double best = q(i);
+      double best_dist = std::numeric_limits<double>::max();
+      bool found = false;
+      for (const int k : {-2, -1, 0, 1, 2}) {
+        const double v = q(i) + k * 2 * RAI_PI;
+        if (has_limits && (v < lb || v > ub)) {
+          continue;
+        }
+        if (std::fabs(v - q_ref(i)) < best_dist) {
+          best_dist = std::fabs(v - q_ref(i));
+          best = v;
+          found = true;
+        }
+      }
+
+      if (!found) {
+        return false;
+      }
+      q(i) = best;
+    }
+    return true;
+  }
+
+  Robot r;
+  bool valid = false;
+
+  arr base_offset;
+  arr flange_offset;
+  arr ee_offset;
+  arr limits;
+};
+
+// Poses of the end effector that fulfill the pick constraints for a top-down
+// grasp of the object: the tip is at the center of the object, and for the
+// two finger gripper, the fingers close along the shorter side of the object.
+std::vector<arr> get_top_grasp_poses(const rai::Configuration &C,
+                                     const rai::String &obj,
+                                     const EndEffectorType ee_type,
+                                     const uint num_vacuum_yaws = 8) {
+  const arr R_obj = C[obj]->getRotationMatrix();
+  const arr obj_pos = C[obj]->getPosition();
+  const arr obj_size = C[obj]->shape->size;
+
+  const arr x_obj = {R_obj(0, 0), R_obj(1, 0), R_obj(2, 0)};
+  const arr y_obj = {R_obj(0, 1), R_obj(1, 1), R_obj(2, 1)};
+  const arr z_obj = {R_obj(0, 2), R_obj(1, 2), R_obj(2, 2)};
+
+  std::vector<arr> y_axes;
+  if (ee_type == EndEffectorType::two_finger) {
+    // same alignment as in add_pick_constraints
+    const arr y = obj_size(0) < obj_size(1) ? x_obj : y_obj;
+    y_axes = {y, -y};
+  } else {
+    for (uint i = 0; i < num_vacuum_yaws; ++i) {
+      const double angle = 2 * RAI_PI * i / num_vacuum_yaws;
+      y_axes.push_back(std::cos(angle) * x_obj + std::sin(angle) * y_obj);
+    }
+  }
+
+  const arr z = -z_obj;
+
+  std::vector<arr> poses;
+  for (const arr &y : y_axes) {
+    const arr x = crossProduct(y, z);
+
+    arr R(3, 3);
+    for (uint i = 0; i < 3; ++i) {
+      R(i, 0) = x(i);
+      R(i, 1) = y(i);
+      R(i, 2) = z(i);
+    }
+    poses.push_back(ur5_ik::make_transform(R, obj_pos));
+  }
+
+  return poses;
+}
@@ -3,11 +3,14 @@
 #include "planners/plan.h"
 #include "planners/prioritized_planner.h"
 #include "search_util.h"
+#include "search_monitor.h"
 #include "sequencing.h"
+#include "transposition_table.h"
 
 Plan plan_multiple_arms_simulated_annealing(
     rai::Configuration C, const RobotTaskPoseMap &rtpm,
-    const std::unordered_map<Robot, arr> &home_poses) {
+    const std::unordered_map<Robot, arr> &home_poses,
+    TranspositionTable *tt = nullptr) {
   std::time_t t = std::time(nullptr);
   std::tm tm = *std::localtime(&t);
   std::stringstream buffer;
@@ -32,6 +35,9 @@ Plan plan_multiple_arms_simulated_annealing(
   // plan for it
   const auto plan_result =
       plan_multiple_arms_given_sequence(C, rtpm, seq, home_poses);
+  if (tt != nullptr) {
+    tt->store(seq, plan_result);
+  }
 
   auto best_plan = plan_result.plan;
   uint best_makespan = get_makespan_from_plan(plan_result.plan);
@@ -63,10 +69,12 @@ Plan plan_multiple_arms_simulated_annealing(
   double T = T0;
   double cooling_factor = 0.999;
 
-  std::vector<uint> best_makespan_at_iteration;
-  std::vector<double> computation_time_at_iteration;
+  // progress over time is reported by the monitor
+  SearchMonitor monitor(buffer.str());
+  monitor.enable_sample_logging(rtpm, home_poses);
+  monitor.add(plan_result, seq);
 
-  for (uint i = 0; i < max_iter; ++i) {
+  for (uint i = 0; i < max_iter && !search_is_cancelled(); ++i) {
     // T = T0 * (1 - (i+1.)/nmax);
     T = T * cooling_factor; // temp(i);
 
@@ -81,8 +89,31 @@ Plan plan_multiple_arms_simulated_annealing(
     rndUniform(rnd);
 
     if (p(curr_makespan, lb_makespan, T) > rnd(0)) {
+      // sequences that were planned already are only used for the acceptance
+      // test, without planning them again
+      TranspositionTable::Entry known;
+      if (tt != nullptr && tt->lookup(seq_new, known)) {
+        if (known.status == PlanStatus::success &&
+            p(curr_makespan, known.makespan, T) > rnd(0)) {
+          curr_makespan = known.makespan;
+          seq = seq_new;
+        }
+
+        monitor.add_skipped();
+        continue;
+      }
+
+      if (tt != nullptr && tt->has_failing_prefix(seq_new)) {
+        monitor.add_skipped();
+        continue;
+      }
+
       const auto new_plan_result =
           plan_multiple_arms_given_sequence(C, rtpm, seq_new, home_poses);
+      if (tt != nullptr) {
+        tt->store(seq_new, new_plan_result);
+      }
+      monitor.add(new_plan_result, seq_new);
 
       if (new_plan_result.status == PlanStatus::success) {
         const auto end_time = std::chrono::high_resolution_clock::now();
@@ -117,10 +148,9 @@ Plan plan_multiple_arms_simulated_annealing(
         }
       }
     }
-
-    best_makespan_at_iteration.push_back(best_makespan);
-    computation_time_at_iteration.push_back(i);
   }
 
+  monitor.finish(C, robots, home_poses);
+
   return best_plan;
 }
\ No newline at end of file
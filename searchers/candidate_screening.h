@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "planners/plan.h"
+#include "search_util.h"
+#include "sequencing.h"
+#include "surrogate_model.h"
+
+// Distances between the keyframes (and the home poses) of the robots, such
+// that the lower bound of a sequence only consists of table lookups. Used as
+// PoseModel for MakespanLowerBoundT.
+// Only keyframes that are already computed are added on construction, the
+// keyframes of other pairs are added by extend() once a sequence uses them.
+// This avoids forcing the computation of all keyframes of a lazy map.
+class KeyframeDistanceMatrix {
+public:
+  typedef int Pose;
+
+  KeyframeDistanceMatrix(const RobotTaskPoseMap &_rtpm,
+                         const std::unordered_map<Robot, arr> &home_poses)
+      : rtpm(_rtpm), joint_model(_rtpm, home_poses) {
+    for (const auto &e : home_poses) {
+      home_ids[e.first] = add_pose(e.second);
+    }
+
+    for (const auto &e : rtpm) {
+      add_keyframes(e.first);
+    }
+    if (rtpm.is_lazy()) {
+      for (const auto &e : rtpm.get_lazy_keyframes()->computed()) {
+        add_keyframes(e.first);
+      }
+    }
+  }
+
+  // adds the keyframes of all pairs of the sequence that are not in the table
+  // yet. Computes the keyframes of these pairs if they are lazy.
+  void extend(const OrderedTaskSequence &seq) {
+    for (const auto &rtp : seq) {
+      if (keyframe_ids.count(rtp) == 0 && infeasible.count(rtp) == 0) {
+        add_keyframes(rtp);
+      }
+    }
+  }
+
+  bool has_keyframes(const RobotTaskPair &rtp) const {
+    return keyframe_ids.count(rtp) > 0;
+  }
+
+  Pose get_home_pose(const Robot &r) const { return home_ids.at(r); }
+
+  Pose get_keyframe(const RobotTaskPair &rtp, const uint j) const {
+    return keyframe_ids.at(rtp)[j];
+  }
+
+  uint get_num_keyframes(const RobotTaskPair &rtp) const {
+    return keyframe_ids.at(rtp).size();
+  }
+
+  std::pair<Pose, Pose> get_handover_split(const RobotTaskPair &rtp,
+                                           const bool r1_first) const {
+    return handover_ids.at(rtp).at(r1_first);
+  }
+
+  double get_distance(const Pose a, const Pose b) const {
+    if (a == b) {
+      return 0.;
+    }
+    return a > b ? distances[a][b] : distances[b][a];
+  }
+
+  uint size() const { return poses.size(); }
+
+private:
+  void add_keyframes(const RobotTaskPair &rtp) {
+    if (rtpm.count(rtp) == 0) {
+      infeasible.insert(rtp);
+      return;
+    }
+
+    std::vector<int> ids;
+    for (uint j = 0; j < joint_model.get_num_keyframes(rtp); ++j) {
+      ids.push_back(add_pose(joint_model.get_keyframe(rtp, j)));
+    }
+    keyframe_ids[rtp] = ids;
+
+    if (rtp.task.type == PrimitiveType::handover) {
+      for (const bool r1_first : {true, false}) {
+        const auto split = joint_model.get_handover_split(rtp, r1_first);
+        handover_ids[rtp][r1_first] = {add_pose(split.first),
+                                       add_pose(split.second)};
+      }
+    }
+  }
+
+  // computes the distances to all poses that are already in the table
+  int add_pose(const arr &q) {
+    std::vector<double> row(poses.size(), 0.);
+    for (uint i = 0; i < poses.size(); ++i) {
+      if (poses[i].N == q.N) {
+        row[i] = JointPoseModel::get_max_joint_distance(poses[i], q);
+      }
+    }
+    poses.push_back(q);
+    distances.push_back(row);
+    return poses.size() - 1;
+  }
+
+  const RobotTaskPoseMap &rtpm;
+  JointPoseModel joint_model;
+
+  std::vector<arr> poses;
+  // lower triangle: distances[i][j] for j < i
+  std::vector<std::vector<double>> distances;
+
+  std::unordered_map<Robot, int> home_ids;
+  std::unordered_map<RobotTaskPair, std::vector<int>> keyframe_ids;
+  std::unordered_map<RobotTaskPair,
+                     std::unordered_map<bool, std::pair<int, int>>>
+      handover_ids;
+  std::unordered_set<RobotTaskPair> infeasible;
+};
+
+typedef MakespanLowerBoundT<KeyframeDistanceMatrix> ScreeningLowerBound;
+
+struct ScreenedCandidate {
+  OrderedTaskSequence seq;
+  double lb;
+  // candidates are ordered by this, it is the lower bound, or the score of
+  // the surrogate model if there is a trained one.
+  double score;
+};
+
+// Scores a batch of candidate sequences, and keeps the k most promising ones:
+// duplicates, sequences that were evaluated before, and sequences whose lower
+// bound shows that they can not improve on the given makespan are removed.
+class CandidateScreener {
+public:
+  CandidateScreener(const RobotTaskPoseMap &rtpm,
+                    const std::unordered_map<Robot, arr> &home_poses,
+                    const SurrogateModel &_surrogate_model =
+                        get_surrogate_model())
+      : distances(rtpm, home_poses), surrogate_model(_surrogate_model) {
+    for (const auto &e : home_poses) {
+      robots.push_back(e.first);
+    }
+  }
+
+  double compute_lb(const OrderedTaskSequence &seq) const {
+    ScreeningLowerBound lb(distances, robots);
+    for (const auto &rtp : seq) {
+      if (!lb.add(rtp)) {
+        return std::numeric_limits<double>::infinity();
+      }
+    }
+    return lb.get_makespan();
+  }
+
+  std::vector<ScreenedCandidate>
+  screen(const std::vector<OrderedTaskSequence> &candidates,
+         const double makespan_to_beat, const uint k) {
+    std::unordered_set<OrderedTaskSequence> batch;
+    std::vector<ScreenedCandidate> res;
+
+    for (const auto &seq : candidates) {
+      ++num_screened;
+      if (batch.count(seq) > 0 || evaluated.count(seq) > 0) {
+        ++num_duplicates;
+        continue;
+      }
+      batch.insert(seq);
+      distances.extend(seq);
+
+      double lb = 0.;
+      double score = 0.;
+      if (surrogate_model.is_trained()) {
+        const auto features =
+            surrogate::compute_features(seq, distances, robots);
+        lb = features.empty() ? std::numeric_limits<double>::infinity()
+                              : features[1];
+        score = surrogate_model.score(features);
+      } else {
+        lb = compute_lb(seq);
+        score = lb;
+      }
+
+      if (lb >= makespan_to_beat) {
+        ++num_dominated;
+        continue;
+      }
+
+      res.push_back({seq, lb, score});
+    }
+
+    const uint num_kept = std::min<uint>(k, res.size());
+    std::partial_sort(res.begin(), res.begin() + num_kept, res.end(),
+                      [](const ScreenedCandidate &a,
+                         const ScreenedCandidate &b) {
+                        return a.score < b.score;
+                      });
+    res.resize(num_kept);
+
+    return res;
+  }
+
+  // sequences that are marked as evaluated are not returned by screen()
+  void mark_evaluated(const OrderedTaskSequence &seq) { evaluated.insert(seq); }
+
+  void log_statistics() const {
+    spdlog::info("Screened {} candidates: {} duplicates, {} dominated, {} "
+                 "keyframes in distance table",
+                 num_screened, num_duplicates, num_dominated,
+                 distances.size());
+  }
+
+private:
+  KeyframeDistanceMatrix distances;
+  std::vector<Robot> robots;
+
+  const SurrogateModel &surrogate_model;
+
+  std::unordered_set<OrderedTaskSequence> evaluated;
+
+  uint num_screened = 0;
+  uint num_duplicates = 0;
+  uint num_dominated = 0;
+};
+
+// Neighbours of the given sequence that only contain feasible tasks.
+std::vector<OrderedTaskSequence>
+generate_neighbour_batch(const OrderedTaskSequence &seq,
+                         const std::vector<Robot> &robots,
+                         const RobotTaskPoseMap &rtpm, const uint batch_size,
+                         std::mt19937 &rng) {
+  std::vector<OrderedTaskSequence> batch;
+  if (seq.size() < 2) {
+    return batch;
+  }
+
+  for (uint i = 0; i < 10 * batch_size && batch.size() < batch_size; ++i) {
+    auto new_seq = neighbour(seq, robots, rng);
+    if (sequence_is_feasible(new_seq, rtpm)) {
+      batch.push_back(new_seq);
+    }
+  }
+  return batch;
+}
@@ -3,16 +3,33 @@
 #include "planners/plan.h"
 #include "planners/prioritized_planner.h"
 
+#include "candidate_screening.h"
 #include "search_util.h"
+#include "search_monitor.h"
 #include "sequencing.h"
+#include "transposition_table.h"
 
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <random>
+#include <thread>
+
+// The restarts of the greedy search are independent of each other, apart from
+// the best makespan that is used to prune sequences via their lower bound.
+// They are thus run on global_params.num_threads workers, each with its own
+// copy of the configuration and its own random number generator. A worker
+// starts a fresh restart once the current one fails, has no promising
+// neighbours left, or did not improve for greedy_stagnation_limit iterations.
+// The total number of iterations over all restarts is max_attempts.
 Plan plan_multiple_arms_greedy_random_search(
     rai::Configuration &C, const RobotTaskPoseMap &rtpm,
     const std::unordered_map<Robot, arr> &home_poses,
-    const uint max_attempts = 1000) {
+    const uint max_attempts = 1000, TranspositionTable *tt = nullptr) {
 
-  const uint max_restarts = max_attempts / 50;
   const uint max_inner_iterations = 50;
+  const uint stagnation_limit = global_params.greedy_stagnation_limit;
+  const uint num_threads = std::max(1u, global_params.num_threads);
 
   // make foldername for current run
   std::time_t t = std::time(nullptr);
@@ -34,48 +51,91 @@ Plan plan_multiple_arms_greedy_random_search(
     }
   }
 
-  OrderedTaskSequence best_seq;
-  Plan best_plan;
-  double best_makespan = 1e6;
+  SharedBestPlan best;
 
   auto start_time = std::chrono::high_resolution_clock::now();
 
-  std::vector<std::pair<OrderedTaskSequence, Plan>> cache;
+  // candidates are scored in batches with the lower bound, and only the most
+  // promising neighbours are planned. The distance table is only computed
+  // once, every worker gets a copy.
+  const bool use_screening = global_params.screening_batch_size > 0;
+  std::unique_ptr<CandidateScreener> screener_template;
+  if (use_screening) {
+    screener_template = std::make_unique<CandidateScreener>(rtpm, home_poses);
+  }
+
+  SearchMonitor monitor(buffer.str());
+  monitor.enable_sample_logging(rtpm, home_poses);
 
-  uint iter = 0;
-  for (uint i = 0; i < max_restarts; ++i) {
+  // iterations and restarts over all workers
+  std::atomic<uint> iter{0};
+  std::atomic<uint> restarts{0};
+  std::atomic<bool> no_valid_sequence{false};
+
+  auto search_is_done = [&]() {
+    return iter.load() >= max_attempts || no_valid_sequence.load() ||
+           search_is_cancelled();
+  };
+
+  auto run_restart = [&](rai::Configuration &CWorker, std::mt19937 &rng,
+                         CandidateScreener *screener) {
+    const uint i = restarts++;
     std::cout << "Generating completely new seq. " << i << std::endl;
     OrderedTaskSequence seq;
     // seq = generate_alternating_random_sequence(robots, num_tasks, rtpm);
     // seq = generate_single_arm_sequence(robots, num_tasks);
     seq = generate_alternating_greedy_sequence(robots, num_tasks, rtpm,
-                                               home_poses);
-    /*if (true || i == 0) {
-      // seq = generate_single_arm_sequence(robots, num_tasks);
-      //seq = generate_random_sequence(robots, num_tasks);
-      // seq = generate_alternating_greedy_sequence(robots, num_tasks, rtpm,
-    home_poses); } else if (i == 1) { seq =
-    generate_alternating_random_sequence(robots, num_tasks, rtpm); } else if (i
-    == 2) { seq = generate_single_arm_sequence(robots, num_tasks); } else { seq
-    = generate_random_sequence(robots, num_tasks);
-    }*/
+                                               home_poses, rng);
 
     if (!sequence_is_feasible(seq, rtpm)) {
       std::cout << "Generated sequence no feasible" << std::endl;
-      continue;
+      // count the attempt, such that the search terminates even if no
+      // feasible sequence is generated
+      ++iter;
+      return;
     }
 
     Plan plan;
     double prev_makespan = 1e6;
-    for (uint j = 0; j < max_inner_iterations; ++j) {
-      ++iter;
+    uint iterations_without_improvement = 0;
+    std::deque<OrderedTaskSequence> pending;
+    for (uint j = 0; j < max_inner_iterations && !search_is_done(); ++j) {
+      const uint current_iter = ++iter;
       OrderedTaskSequence new_seq = seq;
 
+      if (iterations_without_improvement >= stagnation_limit) {
+        spdlog::info("No improvement in {} iterations, restarting.",
+                     iterations_without_improvement);
+        break;
+      }
+      ++iterations_without_improvement;
+
+      if (use_screening && j > 0) {
+        if (pending.empty()) {
+          const auto batch = generate_neighbour_batch(
+              seq, robots, rtpm, global_params.screening_batch_size, rng);
+          for (const auto &c : screener->screen(
+                   batch, std::min(prev_makespan, best.get_makespan()),
+                   global_params.screening_top_k)) {
+            pending.push_back(c.seq);
+          }
+        }
+
+        // no neighbour can improve on the current sequence
+        if (pending.empty()) {
+          spdlog::info("No promising neighbours left, restarting.");
+          break;
+        }
+
+        new_seq = pending.front();
+        pending.pop_front();
+      }
+
       uint cnt = 0;
-      while (true) {
+      while (!use_screening || j == 0) {
         ++cnt;
         if (j > 0) {
-          new_seq = neighbour(seq, robots);
+          new_seq = neighbour(seq, robots, rng);
         }
 
         // ensure that sequence is actually feasible, i.e. robots can do the
@@ -86,7 +146,8 @@ Plan plan_multiple_arms_greedy_random_search(
 
         if (cnt > 10000){
           spdlog::error("Unable to find valid sequence.");
-          return best_plan;
+          no_valid_sequence = true;
+          return;
         }
       }
 
@@ -97,17 +158,38 @@ Plan plan_multiple_arms_greedy_random_search(
       }
       std::cout << std::endl;
 
-      if (lb > best_makespan) {
+      // the best makespan is shared between the workers
+      if (lb > best.get_makespan()) {
         std::cout << "skipping planning, since lb is larger than best plan"
                   << std::endl;
+        monitor.add_skipped();
         continue;
       }
 
-      // plan for it
+      // the plan of the initial sequence is needed as base for its
+      // neighbours, i.e. we only skip it if it is known to fail
+      if (tt != nullptr &&
+          ((j == 0 && tt->has_failing_prefix(new_seq)) ||
+           (j > 0 && tt->can_skip(new_seq, prev_makespan)))) {
+        spdlog::info("Skipping sequence since it was already evaluated.");
+        monitor.add_skipped();
+        if (j == 0) {
+          break;
+        }
+        continue;
+      }
+
+      if (use_screening) {
+        screener->mark_evaluated(new_seq);
+      }
+
+      // plan for it, and stop as soon as the plan can not improve on the
+      // current sequence or on the best plan of all workers
+      const double makespan_bound = std::min(prev_makespan, best.get_makespan());
       PlanResult new_plan_result;
       if (plan.empty()) {
         new_plan_result = plan_multiple_arms_given_sequence(
-            C, rtpm, new_seq, home_poses, prev_makespan);
+            CWorker, rtpm, new_seq, home_poses, makespan_bound, true);
       } else {
         // compute index where the new sequence starts
         uint change_in_sequence = 0;
@@ -121,9 +203,14 @@ Plan plan_multiple_arms_greedy_random_search(
         std::cout << "planning only subsequence " << change_in_sequence
                   << std::endl;
         new_plan_result = plan_multiple_arms_given_subsequence_and_prev_plan(
-            C, rtpm, new_seq, change_in_sequence, plan, home_poses,
-            prev_makespan);
+            CWorker, rtpm, new_seq, change_in_sequence, plan, home_poses,
+            makespan_bound, true);
+      }
+
+      if (tt != nullptr) {
+        tt->store(new_seq, new_plan_result, makespan_bound);
       }
+      monitor.add(new_plan_result, new_seq);
 
       if (new_plan_result.status == PlanStatus::success) {
         const Plan new_plan = new_plan_result.plan;
@@ -134,13 +221,12 @@ Plan plan_multiple_arms_greedy_random_search(
                                   end_time - start_time)
                                   .count();
 
-        // cache.push_back(std::make_pair(new_seq, new_plan));
-
-        export_plan(C, robots, home_poses, new_plan, new_seq, buffer.str(), iter,
-                    duration);
+        export_plan(CWorker, robots, home_poses, new_plan, new_seq,
+                    buffer.str(), current_iter, duration);
 
         std::cout << "\n\n\nMAKESPAN " << makespan << " best so far "
-                  << best_makespan << " (" << prev_makespan << ")" << std::endl;
+                  << best.get_makespan() << " (" << prev_makespan << ")"
+                  << std::endl;
         for (const auto &s : new_seq) {
           std::cout << "(" << s.robots[0] << " " << s.task.object << ")";
         }
@@ -150,26 +236,27 @@ Plan plan_multiple_arms_greedy_random_search(
           seq = new_seq;
           plan = new_plan;
           prev_makespan = makespan;
+          iterations_without_improvement = 0;
 
-          if (global_params.export_images){
-            const std::string image_path = global_params.output_path + buffer.str() + "/" + std::to_string(i) + "/img/";
-            visualize_plan(C, best_plan, global_params.allow_display, image_path);
-          }
-          else{
-            visualize_plan(C, best_plan, global_params.allow_display);
+          // the remaining candidates are neighbours of the previous sequence
+          pending.clear();
+
+          // the viewer can only be used from the main thread
+          if (num_threads == 1) {
+            if (global_params.export_images){
+              const std::string image_path = global_params.output_path + buffer.str() + "/" + std::to_string(i) + "/img/";
+              visualize_plan(CWorker, best.get_plan(), global_params.allow_display, image_path);
+            }
+            else{
+              visualize_plan(CWorker, best.get_plan(), global_params.allow_display);
+            }
           }
         }
 
-        if (makespan < best_makespan) {
-          best_makespan = makespan;
-          best_plan = plan;
-          best_seq = new_seq;
-
-          // visualize_plan(C, best_plan);
-        }
+        best.update(new_plan, new_seq, makespan);
       } else {
         const std::string folder =
-            global_params.output_path + buffer.str() + "/" + std::to_string(iter) + "/";
+            global_params.output_path + buffer.str() + "/" + std::to_string(current_iter) + "/";
         const int res = system(STRING("mkdir -p " << folder).p);
         (void)res;
 
@@ -196,6 +283,52 @@ Plan plan_multiple_arms_greedy_random_search(
         break;
       }
     }
+  };
+
+  // the copies of the configuration and the seeds are made before the workers
+  // are started
+  std::random_device rd;
+  std::vector<std::unique_ptr<rai::Configuration>> configurations;
+  std::vector<uint> seeds;
+  for (uint k = 0; k < num_threads; ++k) {
+    configurations.push_back(std::make_unique<rai::Configuration>());
+    configurations.back()->copy(C);
+    seeds.push_back(rd());
+  }
+
+  auto worker = [&](const uint k) {
+    std::mt19937 rng(seeds[k]);
+
+    std::unique_ptr<CandidateScreener> screener;
+    if (use_screening) {
+      screener = std::make_unique<CandidateScreener>(*screener_template);
+    }
+
+    while (!search_is_done()) {
+      run_restart(*configurations[k], rng, screener.get());
+    }
+
+    if (use_screening) {
+      screener->log_statistics();
+    }
+  };
+
+  if (num_threads == 1) {
+    worker(0);
+  } else {
+    std::vector<std::thread> threads;
+    for (uint k = 0; k < num_threads; ++k) {
+      threads.emplace_back(worker, k);
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
   }
-  return best_plan;
-}
\ No newline at end of file
+
+  spdlog::info("Greedy search: {} restarts, {} iterations, best makespan {}",
+               restarts.load(), iter.load(), best.get_makespan());
+
+  monitor.finish(C, robots, home_poses);
+
+  return best.get_plan();
+}
@@ -0,0 +1,442 @@
+#pragma once
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "planners/plan.h"
+#include "planners/prioritized_planner.h"
+#include "search_monitor.h"
+#include "search_util.h"
+#include "sequencing.h"
+#include "transposition_table.h"
+
+struct MctsOptions {
+  uint max_iterations = 1000;
+
+  // exploration constant of UCT. The rewards are normalized to be roughly 1
+  // for good sequences.
+  double exploration = 0.5;
+
+  // if true, rollouts are planned (reusing the plan of the node), otherwise
+  // they are scored with the lower bound.
+  bool planner_rollouts = true;
+};
+
+// A node of the search tree is a prefix of a sequence, together with the plan
+// for it. The plan of a child is obtained by planning the one additional task
+// on top of the plan of its parent.
+struct MctsNode {
+  MctsNode(MctsNode *_parent, const OrderedTaskSequence &_seq)
+      : parent(_parent), seq(_seq) {}
+
+  MctsNode *parent;
+  std::vector<std::unique_ptr<MctsNode>> children;
+
+  OrderedTaskSequence seq;
+  Plan plan;
+
+  // tasks that were not expanded yet
+  std::vector<RobotTaskPair> untried;
+  bool initialized = false;
+
+  uint visits = 0;
+  double total_reward = 0.;
+
+  // the task could not be planned, or all children are dead
+  bool dead = false;
+  bool is_complete = false;
+};
+
+// The tasks that can be appended to a prefix: a primitive for an object that
+// was not handled yet, or the second part of a started pick-pick.
+std::vector<RobotTaskPair>
+get_available_tasks(const OrderedTaskSequence &seq,
+                    const std::vector<RobotTaskPair> &candidates,
+                    const RobotTaskPoseMap &rtpm) {
+  std::unordered_set<uint> handled_objects;
+  std::unordered_map<uint, RobotTaskPair> open_pick_picks;
+  for (const auto &rtp : seq) {
+    handled_objects.insert(rtp.task.object);
+    if (rtp.task.type == PrimitiveType::pick_pick_1) {
+      open_pick_picks[rtp.task.object] = rtp;
+    } else if (rtp.task.type == PrimitiveType::pick_pick_2) {
+      open_pick_picks.erase(rtp.task.object);
+    }
+  }
+
+  std::vector<RobotTaskPair> available;
+  for (const auto &rtp : candidates) {
+    if (rtp.task.type == PrimitiveType::pick_pick_2) {
+      const auto it = open_pick_picks.find(rtp.task.object);
+      if (it != open_pick_picks.end() && it->second.robots == rtp.robots &&
+          rtpm.count(rtp) > 0) {
+        available.push_back(rtp);
+      }
+      continue;
+    }
+
+    if (handled_objects.count(rtp.task.object) > 0 || rtpm.count(rtp) == 0) {
+      continue;
+    }
+
+    // a pick-pick can only be started if it can be finished
+    if (rtp.task.type == PrimitiveType::pick_pick_1) {
+      RobotTaskPair second_part = rtp;
+      second_part.task.type = PrimitiveType::pick_pick_2;
+      if (rtpm.count(second_part) == 0) {
+        continue;
+      }
+    }
+
+    available.push_back(rtp);
+  }
+
+  return available;
+}
+
+bool sequence_is_complete(const OrderedTaskSequence &seq,
+                          const uint num_tasks) {
+  std::unordered_set<uint> handled_objects;
+  std::unordered_set<uint> open_pick_picks;
+  for (const auto &rtp : seq) {
+    handled_objects.insert(rtp.task.object);
+    if (rtp.task.type == PrimitiveType::pick_pick_1) {
+      open_pick_picks.insert(rtp.task.object);
+    } else if (rtp.task.type == PrimitiveType::pick_pick_2) {
+      open_pick_picks.erase(rtp.task.object);
+    }
+  }
+  return handled_objects.size() == num_tasks && open_pick_picks.empty();
+}
+
+// Monte Carlo tree search over the task sequences.
+// - selection: UCT over the children that are not dead,
+// - expansion: one untried task is appended to the prefix, and only this task
+//   is planned, reusing the plan of the parent,
+// - rollout: the prefix is completed randomly, and scored either by planning
+//   the remaining tasks on top of the plan of the node, or with the lower
+//   bound,
+// - backpropagation of the reward reference / makespan.
+class MctsSearcher {
+public:
+  MctsSearcher(rai::Configuration &_C, const RobotTaskPoseMap &_rtpm,
+               const std::unordered_map<Robot, arr> &_home_poses,
+               const uint _num_tasks, const MctsOptions &_options,
+               TranspositionTable *_tt, SearchMonitor &_monitor,
+               const std::string &_folder)
+      : C(_C), rtpm(_rtpm), home_poses(_home_poses), num_tasks(_num_tasks),
+        options(_options), tt(_tt), monitor(_monitor), folder(_folder),
+        candidates(_rtpm.candidates()), rng(std::random_device{}()),
+        root(nullptr, {}) {
+    for (const auto &element : home_poses) {
+      robots.push_back(element.first);
+    }
+  }
+
+  Plan search() {
+    start_time = std::chrono::high_resolution_clock::now();
+
+    for (iteration = 0;
+         iteration < options.max_iterations && !search_is_cancelled() &&
+         !root.dead;
+         ++iteration) {
+      MctsNode *node = select(&root);
+      if (node == nullptr) {
+        break;
+      }
+
+      if (!node->is_complete) {
+        node = expand(node);
+      }
+
+      double reward = 0.;
+      if (!node->dead) {
+        reward = rollout(node);
+      }
+
+      backpropagate(node, reward);
+    }
+
+    spdlog::info("MCTS: {} iterations, {} nodes planned, {} complete "
+                 "sequences evaluated, best makespan {}",
+                 iteration, num_expansions, num_complete_sequences,
+                 best_makespan);
+
+    return best_plan;
+  }
+
+private:
+  void initialize(MctsNode *node) {
+    if (node->initialized) {
+      return;
+    }
+    node->initialized = true;
+    node->untried = get_available_tasks(node->seq, candidates, rtpm);
+    std::shuffle(node->untried.begin(), node->untried.end(), rng);
+    node->is_complete = sequence_is_complete(node->seq, num_tasks);
+
+    if (node->untried.empty() && !node->is_complete) {
+      node->dead = true;
+    }
+  }
+
+  double get_uct(const MctsNode *child, const uint parent_visits) const {
+    if (child->visits == 0) {
+      return std::numeric_limits<double>::infinity();
+    }
+    return child->total_reward / child->visits +
+           options.exploration *
+               std::sqrt(std::log(parent_visits) / child->visits);
+  }
+
+  // descends until a node with untried tasks, or a complete sequence is found
+  MctsNode *select(MctsNode *node) {
+    while (true) {
+      initialize(node);
+      if (node->dead) {
+        return nullptr;
+      }
+      if (node->is_complete || !node->untried.empty()) {
+        return node;
+      }
+
+      MctsNode *best_child = nullptr;
+      double best_value = -std::numeric_limits<double>::infinity();
+      for (const auto &child : node->children) {
+        if (child->dead) {
+          continue;
+        }
+        const double value = get_uct(child.get(), node->visits);
+        if (value > best_value) {
+          best_value = value;
+          best_child = child.get();
+        }
+      }
+
+      if (best_child == nullptr) {
+        mark_dead(node);
+        return nullptr;
+      }
+      node = best_child;
+    }
+  }
+
+  MctsNode *expand(MctsNode *node) {
+    const RobotTaskPair rtp = node->untried.back();
+    node->untried.pop_back();
+
+    OrderedTaskSequence seq = node->seq;
+    seq.push_back(rtp);
+
+    node->children.push_back(std::make_unique<MctsNode>(node, seq));
+    MctsNode *child = node->children.back().get();
+
+    // only the new task is planned
+    ++num_expansions;
+    const auto res = plan_multiple_arms_given_subsequence_and_prev_plan(
+        C, rtpm, seq, node->seq.size(), node->plan, home_poses);
+
+    if (res.status != PlanStatus::success) {
+      spdlog::info("MCTS: could not plan {}", rtp.serialize());
+      mark_dead(child);
+      return child;
+    }
+
+    child->plan = res.plan;
+    initialize(child);
+
+    if (child->is_complete) {
+      add_complete_sequence(child->seq, res);
+    }
+
+    return child;
+  }
+
+  // random completion of the sequence of the node
+  OrderedTaskSequence complete_randomly(const MctsNode *node) {
+    OrderedTaskSequence seq = node->seq;
+    while (!sequence_is_complete(seq, num_tasks)) {
+      const auto available = get_available_tasks(seq, candidates, rtpm);
+      if (available.empty()) {
+        return {};
+      }
+      std::uniform_int_distribution<uint> dist(0, available.size() - 1);
+      seq.push_back(available[dist(rng)]);
+    }
+    return seq;
+  }
+
+  double rollout(MctsNode *node) {
+    if (node->is_complete) {
+      return get_reward(get_makespan_from_plan(node->plan));
+    }
+
+    const OrderedTaskSequence seq = complete_randomly(node);
+    if (seq.empty()) {
+      return 0.;
+    }
+
+    const double lb = compute_lb_for_sequence(seq, rtpm, home_poses);
+    if (!options.planner_rollouts) {
+      return get_reward(lb);
+    }
+
+    // rollouts that can not beat the best sequence are scored by their bound
+    if (lb >= best_makespan) {
+      monitor.add_skipped();
+      return get_reward(lb);
+    }
+
+    TranspositionTable::Entry known;
+    if (tt != nullptr && tt->lookup(seq, known)) {
+      monitor.add_skipped();
+      if (known.status == PlanStatus::success) {
+        return get_reward(known.makespan);
+      }
+      return known.status == PlanStatus::failed ? 0. : get_reward(lb);
+    }
+
+    const auto res = plan_multiple_arms_given_subsequence_and_prev_plan(
+        C, rtpm, seq, node->seq.size(), node->plan, home_poses,
+        best_makespan, true);
+
+    add_complete_sequence(seq, res);
+
+    if (res.status == PlanStatus::success) {
+      return get_reward(get_makespan_from_plan(res.plan));
+    }
+    if (res.status == PlanStatus::aborted) {
+      return get_reward(best_makespan);
+    }
+    return 0.;
+  }
+
+  void add_complete_sequence(const OrderedTaskSequence &seq,
+                             const PlanResult &res) {
+    ++num_complete_sequences;
+    if (tt != nullptr) {
+      tt->store(seq, res, best_makespan);
+    }
+    monitor.add(res, seq);
+
+    if (res.status != PlanStatus::success) {
+      return;
+    }
+
+    const double makespan = get_makespan_from_plan(res.plan);
+    if (makespan < best_makespan) {
+      best_makespan = makespan;
+      best_plan = res.plan;
+
+      spdlog::info("MCTS: new best makespan {}", makespan);
+
+      const auto end_time = std::chrono::high_resolution_clock::now();
+      const auto duration =
+          std::chrono::duration_cast<std::chrono::milliseconds>(end_time -
+                                                                start_time)
+              .count();
+      export_plan(C, robots, home_poses, res.plan, seq, folder, iteration,
+                  duration);
+    }
+  }
+
+  // the reference is fixed by the first scored rollout, such that the rewards
+  // of all iterations are comparable
+  double get_reward(const double makespan) {
+    if (reward_reference < 0) {
+      reward_reference = makespan;
+    }
+    return reward_reference / std::max(makespan, 1.);
+  }
+
+  void backpropagate(MctsNode *node, const double reward) {
+    while (node != nullptr) {
+      ++node->visits;
+      node->total_reward += reward;
+      node = node->parent;
+    }
+  }
+
+  // a node is dead if its task can not be planned, or if all its children are
+  // dead
+  void mark_dead(MctsNode *node) {
+    node->dead = true;
+    // the plans of dead nodes are not needed anymore
+    node->plan.clear();
+
+    MctsNode *parent = node->parent;
+    while (parent != nullptr && parent->untried.empty()) {
+      for (const auto &child : parent->children) {
+        if (!child->dead) {
+          return;
+        }
+      }
+      parent->dead = true;
+      parent = parent->parent;
+    }
+  }
+
+  rai::Configuration &C;
+  const RobotTaskPoseMap &rtpm;
+  const std::unordered_map<Robot, arr> &home_poses;
+  const uint num_tasks;
+  const MctsOptions options;
+
+  TranspositionTable *tt;
+  SearchMonitor &monitor;
+  const std::string folder;
+
+  std::vector<Robot> robots;
+  const std::vector<RobotTaskPair> candidates;
+  std::mt19937 rng;
+
+  MctsNode root;
+
+  uint iteration = 0;
+  uint num_expansions = 0;
+  uint num_complete_sequences = 0;
+
+  double reward_reference = -1.;
+  double best_makespan = 1e6;
+  Plan best_plan;
+
+  std::chrono::high_resolution_clock::time_point start_time;
+};
+
+Plan plan_multiple_arms_mcts(rai::Configuration &C,
+                             const RobotTaskPoseMap &rtpm,
+                             const std::unordered_map<Robot, arr> &home_poses,
+                             const MctsOptions &options = MctsOptions(),
+                             TranspositionTable *tt = nullptr) {
+  std::time_t t = std::time(nullptr);
+  std::tm tm = *std::localtime(&t);
+  std::stringstream buffer;
+  buffer << "mcts_" << std::put_time(&tm, "%Y%m%d_%H%M%S");
+
+  uint num_tasks = 0;
+  for (auto f : C.frames) {
+    if (f->name.contains("obj")) {
+      num_tasks += 1;
+    }
+  }
+
+  std::vector<Robot> robots;
+  for (const auto &element : home_poses) {
+    robots.push_back(element.first);
+  }
+
+  SearchMonitor monitor(buffer.str());
+  monitor.enable_sample_logging(rtpm, home_poses);
+
+  MctsSearcher searcher(C, rtpm, home_poses, num_tasks, options, tt, monitor,
+                        buffer.str());
+  const Plan plan = searcher.search();
+
+  monitor.finish(C, robots, home_poses);
+
+  return plan;
+}
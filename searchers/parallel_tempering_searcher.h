@@ -0,0 +1,313 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+
+#include "planners/plan.h"
+#include "planners/prioritized_planner.h"
+#include "search_monitor.h"
+#include "search_util.h"
+#include "sequencing.h"
+#include "transposition_table.h"
+
+struct ParallelTemperingOptions {
+  uint num_replicas = 4;
+  uint max_iterations = 1000; // proposals per replica
+  uint steps_per_round = 5;   // proposals between two exchange attempts
+
+  // temperatures are spaced geometrically between these. They are in units of
+  // the makespan, i.e. timesteps.
+  double min_temperature = 1.;
+  double max_temperature = 100.;
+
+  // stop if the best makespan did not improve for this many rounds
+  uint max_rounds_without_improvement = 50;
+};
+
+// A single Markov chain of the parallel tempering search. Each replica owns its
+// own copy of the configuration and its own random number generator, so that
+// the replicas can be advanced in parallel.
+struct TemperingReplica {
+  TemperingReplica(const rai::Configuration &_C, const double _temperature,
+                   const uint seed)
+      : C(_C), temperature(_temperature), rng(seed) {}
+
+  rai::Configuration C;
+  double temperature;
+  std::mt19937 rng;
+
+  OrderedTaskSequence seq;
+  Plan plan;
+  double makespan = 1e6;
+
+  uint proposed = 0;
+  uint accepted = 0;
+};
+
+// One Metropolis-Hastings step at the temperature of the replica.
+// The acceptance test is drawn before planning: a proposal with makespan m is
+// accepted iff m <= curr - T * log(u). This threshold is used to discard the
+// proposal via the lower bound, and as cutoff for the planner.
+void tempering_step(TemperingReplica &replica, const RobotTaskPoseMap &rtpm,
+                    const std::unordered_map<Robot, arr> &home_poses,
+                    const std::vector<Robot> &robots, SharedBestPlan &best,
+                    TranspositionTable *tt = nullptr,
+                    SearchMonitor *monitor = nullptr) {
+  OrderedTaskSequence seq_new;
+  bool found_valid_sequence = false;
+  for (uint i = 0; i < 100; ++i) {
+    seq_new = neighbour(replica.seq, robots, replica.rng);
+    if (sequence_is_feasible(seq_new, rtpm)) {
+      found_valid_sequence = true;
+      break;
+    }
+  }
+
+  if (!found_valid_sequence) {
+    return;
+  }
+
+  ++replica.proposed;
+
+  std::uniform_real_distribution<double> dist(1e-12, 1.);
+  const double threshold =
+      replica.makespan - replica.temperature * std::log(dist(replica.rng));
+
+  const double lb = compute_lb_for_sequence(seq_new, rtpm, home_poses);
+  if (lb > threshold) {
+    return;
+  }
+
+  // known sequences are accepted or rejected without planning them again
+  TranspositionTable::Entry known;
+  if (tt != nullptr && tt->lookup(seq_new, known) &&
+      known.status == PlanStatus::success) {
+    if (known.makespan <= threshold) {
+      ++replica.accepted;
+      replica.seq = seq_new;
+      replica.makespan = known.makespan;
+    }
+    return;
+  }
+
+  if (tt != nullptr && tt->can_skip(seq_new, std::floor(threshold))) {
+    return;
+  }
+
+  const auto res = plan_multiple_arms_given_sequence(
+      replica.C, rtpm, seq_new, home_poses, std::floor(threshold), true);
+  if (tt != nullptr) {
+    tt->store(seq_new, res, std::floor(threshold));
+  }
+  if (monitor != nullptr) {
+    monitor->add(res, seq_new);
+  }
+
+  if (res.status != PlanStatus::success) {
+    return;
+  }
+
+  const double makespan = get_makespan_from_plan(res.plan);
+  if (makespan > threshold) {
+    return;
+  }
+
+  ++replica.accepted;
+  replica.seq = seq_new;
+  replica.plan = res.plan;
+  replica.makespan = makespan;
+
+  if (best.update(res.plan, seq_new, makespan)) {
+    spdlog::info("New best makespan {} found at temperature {:.2f}", makespan,
+                 replica.temperature);
+  }
+}
+
+// Runs fn on every replica. The replicas are only advanced on their own threads
+// if global_params.num_threads > 1, since the planners still share the global
+// rng of rai.
+template <typename Fn>
+void for_each_replica(std::vector<std::unique_ptr<TemperingReplica>> &replicas,
+                      Fn fn) {
+  if (global_params.num_threads <= 1) {
+    for (auto &replica : replicas) {
+      fn(replica.get());
+    }
+    return;
+  }
+
+  std::vector<std::thread> threads;
+  for (auto &replica : replicas) {
+    threads.emplace_back(fn, replica.get());
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+}
+
+Plan plan_multiple_arms_parallel_tempering(
+    rai::Configuration C, const RobotTaskPoseMap &rtpm,
+    const std::unordered_map<Robot, arr> &home_poses,
+    const ParallelTemperingOptions &options = ParallelTemperingOptions(),
+    TranspositionTable *tt = nullptr) {
+  std::time_t t = std::time(nullptr);
+  std::tm tm = *std::localtime(&t);
+  std::stringstream buffer;
+  buffer << "parallel_tempering_" << std::put_time(&tm, "%Y%m%d_%H%M%S");
+
+  const auto start_time = std::chrono::high_resolution_clock::now();
+
+  std::vector<Robot> robots;
+  for (const auto &element : home_poses) {
+    robots.push_back(element.first);
+  }
+
+  uint num_tasks = 0;
+  for (auto f : C.frames) {
+    if (f->name.contains("obj")) {
+      num_tasks += 1;
+    }
+  }
+
+  const uint num_replicas = std::max(1u, options.num_replicas);
+
+  std::random_device rd;
+  std::mt19937 rng(rd());
+
+  // geometrically spaced temperatures, the first replica is the coldest
+  std::vector<std::unique_ptr<TemperingReplica>> replicas;
+  for (uint i = 0; i < num_replicas; ++i) {
+    double temperature = options.min_temperature;
+    if (num_replicas > 1) {
+      temperature =
+          options.min_temperature *
+          std::pow(options.max_temperature / options.min_temperature,
+                   1. * i / (num_replicas - 1));
+    }
+    replicas.push_back(
+        std::make_unique<TemperingReplica>(C, temperature, rng()));
+  }
+
+  SharedBestPlan best;
+  SearchMonitor monitor(buffer.str());
+  monitor.enable_sample_logging(rtpm, home_poses);
+
+  // initial sequences are generated with the global rng, planning them is done
+  // in parallel
+  for (auto &replica : replicas) {
+    replica->seq = generate_random_valid_sequence(robots, num_tasks, rtpm);
+    if (replica->seq.empty()) {
+      spdlog::error("Could not generate a valid initial sequence.");
+      return {};
+    }
+  }
+  for_each_replica(replicas, [&rtpm, &home_poses, &best,
+                              &monitor](TemperingReplica *r) {
+    const auto res =
+        plan_multiple_arms_given_sequence(r->C, rtpm, r->seq, home_poses);
+    monitor.add(res, r->seq);
+    if (res.status == PlanStatus::success) {
+      r->plan = res.plan;
+      r->makespan = get_makespan_from_plan(res.plan);
+      best.update(r->plan, r->seq, r->makespan);
+    }
+  });
+
+  uint exported_version = 0;
+  auto export_best = [&](const uint iteration) {
+    if (best.get_version() == exported_version) {
+      return;
+    }
+    exported_version = best.get_version();
+
+    const auto end_time = std::chrono::high_resolution_clock::now();
+    const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                              end_time - start_time)
+                              .count();
+    export_plan(C, robots, home_poses, best.get_plan(), best.get_sequence(),
+                buffer.str(), iteration, duration);
+  };
+
+  export_best(0);
+
+  if (num_tasks < 2) {
+    return best.get_plan();
+  }
+
+  const uint num_rounds =
+      std::max(1u, options.max_iterations / std::max(1u, options.steps_per_round));
+
+  uint rounds_without_improvement = 0;
+  uint swaps_proposed = 0;
+  uint swaps_accepted = 0;
+
+  for (uint round = 0; round < num_rounds && !search_is_cancelled(); ++round) {
+    const double best_makespan_before_round = best.get_makespan();
+
+    for_each_replica(replicas, [&rtpm, &home_poses, &robots, &best, &options,
+                                tt, &monitor](TemperingReplica *r) {
+      // replicas without a valid plan can not move
+      if (r->plan.empty()) {
+        return;
+      }
+      for (uint i = 0; i < options.steps_per_round && !search_is_cancelled();
+           ++i) {
+        tempering_step(*r, rtpm, home_poses, robots, best, tt, &monitor);
+      }
+    });
+
+    // exchange the states of neighbouring temperatures, alternating between
+    // even and odd pairs
+    std::uniform_real_distribution<double> dist(0., 1.);
+    for (uint i = round % 2; i + 1 < replicas.size(); i += 2) {
+      TemperingReplica &cold = *replicas[i];
+      TemperingReplica &hot = *replicas[i + 1];
+
+      if (cold.plan.empty() && hot.plan.empty()) {
+        continue;
+      }
+
+      ++swaps_proposed;
+      const double delta = (1. / cold.temperature - 1. / hot.temperature) *
+                           (cold.makespan - hot.makespan);
+      if (delta >= 0 || dist(rng) < std::exp(delta)) {
+        ++swaps_accepted;
+        std::swap(cold.seq, hot.seq);
+        std::swap(cold.plan, hot.plan);
+        std::swap(cold.makespan, hot.makespan);
+      }
+    }
+
+    export_best((round + 1) * options.steps_per_round);
+
+    if (best.get_makespan() < best_makespan_before_round) {
+      rounds_without_improvement = 0;
+    } else {
+      ++rounds_without_improvement;
+    }
+
+    if (rounds_without_improvement >= options.max_rounds_without_improvement) {
+      spdlog::info("Stopping parallel tempering after {} rounds without "
+                   "improvement.",
+                   rounds_without_improvement);
+      break;
+    }
+  }
+
+  for (const auto &replica : replicas) {
+    spdlog::info("Replica at temperature {:.2f}: accepted {} of {} proposals, "
+                 "current makespan {}",
+                 replica->temperature, replica->accepted, replica->proposed,
+                 replica->makespan);
+  }
+  spdlog::info("Accepted {} of {} exchanges", swaps_accepted, swaps_proposed);
+  spdlog::info("Best makespan {}", best.get_makespan());
+
+  monitor.finish(C, robots, home_poses);
+
+  return best.get_plan();
+}
@@ -2,8 +2,10 @@
 
 #include "../planners/prioritized_planner.h"
 #include "planners/plan.h"
+#include "search_monitor.h"
 #include "search_util.h"
 #include "sequencing.h"
+#include "transposition_table.h"
 
 #include "common/config.h"
 
@@ -11,7 +13,8 @@ Plan plan_multiple_arms_random_search(
     rai::Configuration &C, const RobotTaskPoseMap &rtpm,
     const std::unordered_map<Robot, arr> &home_poses,
     const uint max_attempts = 1000,
-    const bool avoid_repeat_evaluations = false) {
+    const bool avoid_repeat_evaluations = false,
+    TranspositionTable *tt = nullptr) {
   // make foldername for current run
   std::time_t t = std::time(nullptr);
   std::tm tm = *std::localtime(&t);
@@ -37,9 +40,15 @@ Plan plan_multiple_arms_random_search(
   Plan best_plan;
   double best_makespan = 1e6;
 
-  std::unordered_set<OrderedTaskSequence> all_sequences;
+  TranspositionTable local_tt;
+  if (tt == nullptr) {
+    tt = &local_tt;
+  }
+
+  SearchMonitor monitor(buffer.str());
+  monitor.enable_sample_logging(rtpm, home_poses);
 
-  for (uint i = 0; i < max_attempts; ++i) {
+  for (uint i = 0; i < max_attempts && !search_is_cancelled(); ++i) {
     // const auto seq = generate_random_sequence(robots, num_tasks);
 
     // if (sequence_is_feasible(seq, rtpm)) {
@@ -53,12 +62,13 @@ Plan plan_multiple_arms_random_search(
       return Plan();
     }
 
-    // check if the sequence was already evaluated at some point
-    if (avoid_repeat_evaluations && all_sequences.count(seq) > 0) {
+    // check if the sequence (or a prefix that fails) was already evaluated at
+    // some point
+    if (avoid_repeat_evaluations && tt->can_skip(seq, best_makespan)) {
       spdlog::info("Skipping sequence since it was already evaluated.");
+      monitor.add_skipped();
       continue;
     }
-    all_sequences.insert(seq);
 
     // const double lb = compute_lb_for_sequence(seq, rtpm, home_poses);
     // std::cout << "LB for sequence " << lb << std::endl;
@@ -74,6 +84,8 @@ Plan plan_multiple_arms_random_search(
     // plan for it
     const auto plan_result = plan_multiple_arms_given_sequence(
         C, rtpm, seq, home_poses, best_makespan, false,true);
+    tt->store(seq, plan_result, best_makespan);
+    monitor.add(plan_result, seq);
 
     const auto plan_resultrrt = plan_multiple_arms_given_sequence(
         C, rtpm, seq, home_poses, best_makespan, false,false);
@@ -113,5 +125,7 @@ Plan plan_multiple_arms_random_search(
       }
     }
   }
+  monitor.finish(C, robots, home_poses);
+
   return best_plan;
 }
\ No newline at end of file
@@ -0,0 +1,218 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+#include "json/json.h"
+
+#include "common/cancellation.h"
+#include "common/config.h"
+#include "planners/plan.h"
+#include "surrogate_model.h"
+
+// Keeps track of the progress of a search, and periodically appends a record
+// (elapsed time, best makespan, number of evaluated, aborted and failed
+// sequences) to <output_path>/<folder>/progress.jsonl, one json object per
+// line. A background thread writes a record every progress_interval seconds
+// even if no sequence is evaluated in the meantime, e.g. while planning a long
+// sequence. It also keeps the best plan, such that it can be exported when the
+// time budget runs out.
+class SearchMonitor {
+public:
+  SearchMonitor(const std::string &_folder,
+                const double _progress_interval =
+                    global_params.progress_interval)
+      : folder(_folder), progress_interval(_progress_interval),
+        start_time(std::chrono::steady_clock::now()),
+        last_report_time(start_time) {
+    const std::string path = global_params.output_path + folder + "/";
+    const int res = system(STRING("mkdir -p " << path).p);
+    (void)res;
+
+    progress_file.open(path + "progress.jsonl", std::ios_base::app);
+
+    if (progress_interval > 0) {
+      reporter = std::thread([this]() { run_reporter(); });
+    }
+  }
+
+  ~SearchMonitor() { stop_reporter(); }
+
+  // every evaluated sequence is written to surrogate_samples.jsonl, together
+  // with its features, as training data for the surrogate model
+  void enable_sample_logging(const RobotTaskPoseMap &_rtpm,
+                             const std::unordered_map<Robot, arr> &_home_poses) {
+    if (!global_params.log_surrogate_samples) {
+      return;
+    }
+    rtpm = &_rtpm;
+    home_poses = &_home_poses;
+    sample_file.open(global_params.output_path + folder +
+                         "/surrogate_samples.jsonl",
+                     std::ios_base::app);
+  }
+
+  // records the outcome of planning a sequence
+  void add(const PlanResult &res, const OrderedTaskSequence &seq) {
+    if (rtpm != nullptr && res.status != PlanStatus::unplanned) {
+      log_sample(res, seq);
+    }
+
+    std::lock_guard<std::mutex> lock(m);
+    ++num_evaluated;
+    if (res.status == PlanStatus::failed) {
+      ++num_failed;
+    } else if (res.status == PlanStatus::aborted) {
+      ++num_aborted;
+    } else if (res.status == PlanStatus::success) {
+      const double makespan = get_makespan_from_plan(res.plan);
+      if (makespan < best_makespan) {
+        best_makespan = makespan;
+        best_plan = res.plan;
+        best_seq = seq;
+        report(true);
+        return;
+      }
+    }
+    report(false);
+  }
+
+  // a sequence that was skipped without planning it
+  void add_skipped() {
+    std::lock_guard<std::mutex> lock(m);
+    ++num_skipped;
+    report(false);
+  }
+
+  double get_elapsed_time() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start_time)
+        .count();
+  }
+
+  double get_best_makespan() const {
+    std::lock_guard<std::mutex> lock(m);
+    return best_makespan;
+  }
+
+  // writes the final progress record, and exports the best plan if the search
+  // was stopped by the time budget
+  void finish(const rai::Configuration &C, const std::vector<Robot> &robots,
+              const std::unordered_map<Robot, arr> &home_poses) {
+    stop_reporter();
+
+    std::lock_guard<std::mutex> lock(m);
+    report(true);
+
+    if (!search_is_cancelled()) {
+      return;
+    }
+
+    spdlog::info("Time budget exhausted after {:.1f}s, best makespan {}",
+                 get_elapsed_time(), best_makespan);
+    if (!best_plan.empty()) {
+      export_plan(C, robots, home_poses, best_plan, best_seq,
+                  folder + "/final", num_evaluated,
+                  get_elapsed_time() * 1000);
+    }
+  }
+
+private:
+  void run_reporter() {
+    const auto interval =
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(progress_interval));
+
+    std::unique_lock<std::mutex> lock(m);
+    while (!stopped) {
+      cv.wait_until(lock, last_report_time + interval);
+      if (!stopped) {
+        report(false);
+      }
+    }
+  }
+
+  void stop_reporter() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stopped = true;
+    }
+    cv.notify_all();
+    if (reporter.joinable()) {
+      reporter.join();
+    }
+  }
+
+  void log_sample(const PlanResult &res, const OrderedTaskSequence &seq) {
+    // planning that was interrupted says nothing about the sequence
+    if (res.status != PlanStatus::success && search_is_cancelled()) {
+      return;
+    }
+
+    const auto features = surrogate::compute_features(seq, *rtpm, *home_poses);
+    if (features.empty()) {
+      return;
+    }
+
+    json j;
+    j["features"] = features;
+    j["status"] = int(res.status);
+    j["makespan"] = res.status == PlanStatus::success
+                        ? get_makespan_from_plan(res.plan)
+                        : -1.;
+
+    std::lock_guard<std::mutex> lock(m);
+    sample_file << j.dump() << std::endl;
+  }
+
+  void report(const bool force) {
+    const auto now = std::chrono::steady_clock::now();
+    if (!force && std::chrono::duration<double>(now - last_report_time).count() <
+                      progress_interval) {
+      return;
+    }
+    last_report_time = now;
+
+    json j;
+    j["elapsed_time"] = get_elapsed_time();
+    j["best_makespan"] = best_plan.empty() ? json() : json(best_makespan);
+    j["evaluated"] = num_evaluated;
+    j["skipped"] = num_skipped;
+    j["aborted"] = num_aborted;
+    j["failed"] = num_failed;
+
+    progress_file << j.dump() << std::endl;
+  }
+
+  mutable std::mutex m;
+
+  std::string folder;
+  double progress_interval;
+
+  std::chrono::steady_clock::time_point start_time;
+  std::chrono::steady_clock::time_point last_report_time;
+
+  std::ofstream progress_file;
+
+  std::thread reporter;
+  std::condition_variable cv;
+  bool stopped = false;
+
+  const RobotTaskPoseMap *rtpm = nullptr;
+  const std::unordered_map<Robot, arr> *home_poses = nullptr;
+  std::ofstream sample_file;
+
+  double best_makespan = 1e6;
+  Plan best_plan;
+  OrderedTaskSequence best_seq;
+
+  uint num_evaluated = 0;
+  uint num_skipped = 0;
+  uint num_aborted = 0;
+  uint num_failed = 0;
+};
@@ -1,5 +1,11 @@
 #pragma once
 
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <unordered_set>
+
 #include <Core/array.h>
 #include "planners/plan.h"
 #include "../planners/prioritized_planner.h"
@@ -13,72 +19,286 @@ double estimate_task_duration(const arr &start_pose, const arr &goal_pose,
   double dt = 0;
   if (acc_dist > max_dist) {
     // this is wrong
-    std::cout << "using acc. timing only" << std::endl;
     dt = 2 * time_to_accelerate;
   } else {
-    std::cout << "using acc. timing and max-vel" << std::endl;
     dt = (max_dist - acc_dist) / max_vel + 2 * time_to_accelerate;
   }
 
   return dt;
 }
 
-double compute_lb_for_sequence(const OrderedTaskSequence &seq,
-                               const RobotTaskPoseMap &rtpm,
-                               const std::unordered_map<Robot, arr> &start_poses,
-                               const uint start_index = 0,
-                               const std::unordered_map<Robot, double> start_times = {}) {
-  // the lower bound can be computed by finding the minimum time
-  // of the current task, and using the precedence constraints as well.
-  std::unordered_map<Robot, double> robot_time = start_times;
-  std::unordered_map<Robot, arr> robot_pos = start_poses;
+// Poses of the keyframes as joint states, i.e. distances are computed on
+// demand.
+class JointPoseModel {
+public:
+  typedef arr Pose;
 
-  for (uint i = start_index; i < seq.size(); ++i) {
-    const auto task_tuple = seq[i];
-    const auto robot = task_tuple.robots[0];
-    const auto task_index = task_tuple.task.object;
+  JointPoseModel(const RobotTaskPoseMap &_rtpm,
+                 const std::unordered_map<Robot, arr> &_home_poses)
+      : rtpm(_rtpm), home_poses(_home_poses) {}
+
+  bool has_keyframes(const RobotTaskPair &rtp) const {
+    return rtpm.count(rtp) > 0;
+  }
+
+  Pose get_home_pose(const Robot &r) const { return home_poses.at(r); }
+
+  Pose get_keyframe(const RobotTaskPair &rtp, const uint j) const {
+    return rtpm.at(rtp)[0][j];
+  }
+
+  uint get_num_keyframes(const RobotTaskPair &rtp) const {
+    return rtpm.at(rtp)[0].size();
+  }
+
+  // parts of the joint handover pose that belong to r1 and r2 respectively.
+  // The order of the robots in the joint pose follows the configuration, we
+  // thus consider both splits.
+  std::pair<Pose, Pose> get_handover_split(const RobotTaskPair &rtp,
+                                           const bool r1_first) const {
+    const arr &handover_pose = rtpm.at(rtp)[0][1];
+    const uint dim_1 = home_poses.at(rtp.robots[0]).N;
+    const uint dim_2 = home_poses.at(rtp.robots[1]).N;
+
+    const uint offset_1 = r1_first ? 0 : dim_2;
+    const uint offset_2 = r1_first ? dim_1 : 0;
+    return {handover_pose({offset_1, offset_1 + dim_1 - 1}),
+            handover_pose({offset_2, offset_2 + dim_2 - 1})};
+  }
+
+  // joint displacement where revolute joints can move in both directions
+  static double get_max_joint_distance(const arr &q0, const arr &q1) {
+    double max_dist = 0.;
+    for (uint i = 0; i < q0.N; ++i) {
+      double d = std::fabs(q1(i) - q0(i));
+      d = std::fmod(d, 2 * RAI_PI);
+      d = std::min(d, 2 * RAI_PI - d);
+      max_dist = std::max(max_dist, d);
+    }
+    return max_dist;
+  }
+
+  double get_distance(const Pose &q0, const Pose &q1) const {
+    return get_max_joint_distance(q0, q1);
+  }
 
-    // std::cout << robot << std::endl;
+private:
+  const RobotTaskPoseMap &rtpm;
+  const std::unordered_map<Robot, arr> &home_poses;
+};
 
-    if (!robot_time.count(robot)) {
-      robot_time[robot] = 0.;
+// Lower bound on the makespan of the plan that the prioritized planner
+// produces for a sequence. Every leg of every primitive is modelled with its
+// minimum duration given the velocity limit of the robot (the planner limits
+// the maximum joint displacement per timestep), and the same timing
+// constraints as in the planner are applied:
+// - the last leg of a pick(-pick) finishes no earlier than the previous task,
+// - the second part of a pick-pick starts after the first part is finished,
+// - the joint handover motion can only finish once both robots are available,
+// - every robot that did something returns to its home pose at the end.
+// The bound can be built up incrementally, task by task. The PoseModel
+// determines how poses are represented and how distances are computed.
+template <typename PoseModel> class MakespanLowerBoundT {
+public:
+  typedef typename PoseModel::Pose Pose;
+
+  // minimum time between the end of pick_pick_1 and pick_pick_2
+  static constexpr double pick_pick_delay = 5.;
+  // minimum duration of the exit path
+  static constexpr double min_exit_duration = 5.;
+
+  MakespanLowerBoundT(const PoseModel &_model, const std::vector<Robot> &robots)
+      : model(_model) {
+    for (const auto &r : robots) {
+      robot_pose[r] = model.get_home_pose(r);
     }
+  }
 
-    spdlog::info("Computing duration for {} and task {}", robot.prefix, task_index);
+  double get_leg_duration(const Pose &q0, const Pose &q1,
+                          const double vmax) const {
+    return std::ceil(model.get_distance(q0, q1) / vmax - 1e-9);
+  }
+
+  void set_start_time(const Robot &r, const double t) {
+    robot_time[r] = t;
+    robot_active.insert(r);
+  }
 
-    // TODO: fix this - does not work for new primitives
-    const arr start_pose = robot_pos[robot];
-    const arr goal_pose = rtpm.at(task_tuple)[0][0];
+  void set_start_pose(const Robot &r, const Pose &q) { robot_pose[r] = q; }
+
+  // returns false if the task is infeasible
+  bool add(const RobotTaskPair &rtp) {
+    if (!model.has_keyframes(rtp)) {
+      return false;
+    }
+
+    const PrimitiveType type = rtp.task.type;
+    if (type == PrimitiveType::handover) {
+      add_handover(rtp);
+    } else {
+      Robot r = rtp.robots[0];
+      double dependency = 0.;
+      if (type == PrimitiveType::pick_pick_2) {
+        r = rtp.robots[1];
+        if (pick_pick_end.count(rtp.task.object) > 0) {
+          dependency = pick_pick_end.at(rtp.task.object) + pick_pick_delay;
+        }
+      }
 
-    const double max_acc = 0.1;
+      const uint num_keyframes = model.get_num_keyframes(rtp);
+      double t = get_time(r);
+      for (uint j = 0; j < num_keyframes; ++j) {
+        const Pose q = model.get_keyframe(rtp, j);
+        const double leg_duration = get_leg_duration(robot_pose.at(r), q, r.vmax);
+        t += leg_duration;
+        robot_busy_time[r] += leg_duration;
+        t = std::max(t, dependency);
+        if (j == num_keyframes - 1) {
+          t = std::max(t, prev_finish);
+        }
+        robot_pose[r] = q;
+      }
 
-    const double dt =
-        estimate_task_duration(start_pose, goal_pose, robot.vmax, max_acc);
-    robot_time[robot] += dt;
+      robot_time[r] = t;
+      robot_active.insert(r);
+      prev_finish = t;
 
-    // since we know that there is a precendence constraint on the
-    // task-completion-order we set the time to the highest current time if it
-    // was lower than that
-    for (const auto &rt : robot_time) {
-      if (robot_time[robot] < rt.second) {
-        robot_time[robot] = rt.second;
+      if (type == PrimitiveType::pick_pick_1) {
+        pick_pick_end[rtp.task.object] = t;
       }
     }
 
-    robot_pos[robot] = goal_pose;
+    return true;
   }
 
-  // extract the maximum time of all the robot times
-  double max = 0;
-  for (const auto &rt : robot_time) {
-    if (max < rt.second) {
-      max = rt.second;
+  // makespan lower bound including the return to the home poses
+  double get_makespan() const {
+    double makespan = 0.;
+    for (const auto &r : robot_active) {
+      const double exit_duration = std::max(
+          min_exit_duration,
+          get_leg_duration(robot_pose.at(r), model.get_home_pose(r), r.vmax));
+      makespan = std::max(makespan, robot_time.at(r) + exit_duration);
     }
+    return makespan;
   }
 
-  return max;
-}
+  // lower bound on the finishing time of the last added task
+  double get_finishing_time() const { return prev_finish; }
+
+  // time that the robot spends moving, without waiting
+  double get_busy_time(const Robot &r) const {
+    if (robot_busy_time.count(r) == 0) {
+      return 0.;
+    }
+    return robot_busy_time.at(r);
+  }
+
+  double get_total_busy_time() const {
+    double total = 0.;
+    for (const auto &e : robot_busy_time) {
+      total += e.second;
+    }
+    return total;
+  }
+
+private:
+  double get_time(const Robot &r) const {
+    if (robot_time.count(r) == 0) {
+      return 0.;
+    }
+    return robot_time.at(r);
+  }
 
+  void add_handover(const RobotTaskPair &rtp) {
+    const Robot r1 = rtp.robots[0];
+    const Robot r2 = rtp.robots[1];
+
+    // pick by r1
+    const Pose pick_pose = model.get_keyframe(rtp, 0);
+    const double pick_duration =
+        get_leg_duration(robot_pose.at(r1), pick_pose, r1.vmax);
+    const double pick_end = get_time(r1) + pick_duration;
+
+    // joint motion to the handover pose, we take the more optimistic split
+    double handover_end = std::numeric_limits<double>::max();
+    std::pair<Pose, Pose> best_split;
+    for (const bool r1_first : {true, false}) {
+      const auto split = model.get_handover_split(rtp, r1_first);
+
+      // the joint path is planned with the velocity limit of r1
+      const double end = std::max(
+          pick_end + get_leg_duration(pick_pose, split.first, r1.vmax),
+          get_time(r2) +
+              get_leg_duration(robot_pose.at(r2), split.second, r1.vmax));
+      if (end < handover_end) {
+        handover_end = end;
+        best_split = split;
+      }
+    }
+
+    robot_busy_time[r1] +=
+        pick_duration +
+        get_leg_duration(pick_pose, best_split.first, r1.vmax);
+    robot_busy_time[r2] +=
+        get_leg_duration(robot_pose.at(r2), best_split.second, r1.vmax);
+
+    robot_pose[r1] = best_split.first;
+    robot_time[r1] = handover_end;
+
+    // place by r2
+    const Pose place_pose = model.get_keyframe(rtp, 2);
+    const double place_duration =
+        get_leg_duration(best_split.second, place_pose, r2.vmax);
+    const double place_end = handover_end + place_duration;
+    robot_busy_time[r2] += place_duration;
+    robot_pose[r2] = place_pose;
+    robot_time[r2] = place_end;
+
+    robot_active.insert(r1);
+    robot_active.insert(r2);
+    prev_finish = place_end;
+  }
+
+  const PoseModel &model;
+
+  std::unordered_map<Robot, double> robot_time;
+  std::unordered_map<Robot, double> robot_busy_time;
+  std::unordered_map<Robot, Pose> robot_pose;
+  std::unordered_set<Robot> robot_active;
+  std::unordered_map<uint, double> pick_pick_end;
+
+  double prev_finish = 0.;
+};
+
+typedef MakespanLowerBoundT<JointPoseModel> MakespanLowerBound;
+
+// Lower bound on the makespan for a sequence. Returns infinity if one of the
+// tasks in the sequence is infeasible.
+double compute_lb_for_sequence(const OrderedTaskSequence &seq,
+                               const RobotTaskPoseMap &rtpm,
+                               const std::unordered_map<Robot, arr> &start_poses,
+                               const uint start_index = 0,
+                               const std::unordered_map<Robot, double> start_times = {}) {
+  std::vector<Robot> robots;
+  for (const auto &e : start_poses) {
+    robots.push_back(e.first);
+  }
+
+  const JointPoseModel model(rtpm, start_poses);
+  MakespanLowerBound lb(model, robots);
+  for (const auto &e : start_times) {
+    lb.set_start_time(e.first, e.second);
+  }
+
+  for (uint i = start_index; i < seq.size(); ++i) {
+    if (!lb.add(seq[i])) {
+      return std::numeric_limits<double>::infinity();
+    }
+  }
+
+  return lb.get_makespan();
+}
 
 bool sequence_is_feasible(const OrderedTaskSequence &seq,
                           const RobotTaskPoseMap &rtpm) {
@@ -88,5 +308,51 @@ bool sequence_is_feasible(const OrderedTaskSequence &seq,
     }
   }
 
+  // a task of the sequence failed before in the same situation
+  if (global_params.use_nogood_store && get_nogood_store().contains(seq)) {
+    return false;
+  }
+
   return true;
-}
\ No newline at end of file
+}
+
+// The best solution found so far, shared by the threads of a search.
+class SharedBestPlan {
+public:
+  double get_makespan() const { return makespan.load(); }
+
+  bool update(const Plan &plan, const OrderedTaskSequence &seq,
+              const double new_makespan) {
+    std::lock_guard<std::mutex> lock(m);
+    if (new_makespan >= makespan.load()) {
+      return false;
+    }
+    makespan = new_makespan;
+    best_plan = plan;
+    best_seq = seq;
+    ++version;
+    return true;
+  }
+
+  Plan get_plan() {
+    std::lock_guard<std::mutex> lock(m);
+    return best_plan;
+  }
+
+  OrderedTaskSequence get_sequence() {
+    std::lock_guard<std::mutex> lock(m);
+    return best_seq;
+  }
+
+  uint get_version() {
+    std::lock_guard<std::mutex> lock(m);
+    return version;
+  }
+
+private:
+  std::mutex m;
+  std::atomic<double> makespan{1e6};
+  Plan best_plan;
+  OrderedTaskSequence best_seq;
+  uint version = 0;
+};
@@ -4,6 +4,7 @@
 #include <vector>
 #include <deque>
 
+#include "planners/nogood_store.h"
 #include "planners/plan.h"
 #include "common/util.h"
 
@@ -98,6 +99,80 @@ OrderedTaskSequence neighbour(const OrderedTaskSequence &seq,
   }
 }
 
+// Variants of the neighbourhood operators above that draw from the given
+// random number generator instead of the global one, e.g. for searchers that
+// run several chains in parallel.
+OrderedTaskSequence swap_robot(const OrderedTaskSequence &seq,
+                               const std::vector<Robot> &robots,
+                               std::mt19937 &rng) {
+  std::uniform_int_distribution<uint> task_dist(0, seq.size() - 1);
+  std::uniform_int_distribution<uint> robot_dist(0, robots.size() - 1);
+
+  const uint task_index = task_dist(rng);
+  while (true) {
+    const uint r = robot_dist(rng);
+
+    OrderedTaskSequence seq_new = seq;
+    if (seq_new[task_index].robots[0] != robots[r]) {
+      seq_new[task_index].robots[0] = robots[r];
+      return seq_new;
+    }
+  }
+}
+
+OrderedTaskSequence swap_tasks(const OrderedTaskSequence &seq,
+                               std::mt19937 &rng) {
+  std::uniform_int_distribution<uint> dist(0, seq.size() - 1);
+  while (true) {
+    const uint t1_index = dist(rng);
+    const uint t2_index = dist(rng);
+
+    if (t1_index != t2_index) {
+      OrderedTaskSequence seq_new = seq;
+      std::swap(seq_new[t1_index], seq_new[t2_index]);
+      return seq_new;
+    }
+  }
+}
+
+OrderedTaskSequence reverse_subtour(const OrderedTaskSequence &seq,
+                                    std::mt19937 &rng) {
+  std::uniform_int_distribution<uint> dist(0, seq.size() - 1);
+  uint start = dist(rng);
+  uint end = dist(rng);
+
+  while (start == end) {
+    start = dist(rng);
+    end = dist(rng);
+  }
+
+  if (start > end) {
+    std::swap(start, end);
+  }
+
+  OrderedTaskSequence seq_new = seq;
+  for (uint i = 0; i <= end - start; ++i) {
+    seq_new[start + i] = seq[end - i];
+  }
+
+  return seq_new;
+}
+
+OrderedTaskSequence neighbour(const OrderedTaskSequence &seq,
+                              const std::vector<Robot> &robots,
+                              std::mt19937 &rng) {
+  std::uniform_real_distribution<double> dist(0., 1.);
+  const double r = dist(rng);
+
+  if (r < 1. / 3. && robots.size() > 1) {
+    return swap_robot(seq, robots, rng);
+  } else if (r < 2. / 3.) {
+    return swap_tasks(seq, rng);
+  } else {
+    return reverse_subtour(seq, rng);
+  }
+}
+
 OrderedTaskSequence
 generate_single_arm_sequence(const std::vector<Robot> &robots,
                              const uint num_tasks) {
@@ -124,56 +199,81 @@ OrderedTaskSequence
 generate_random_valid_sequence(const std::vector<Robot> &robots,
                                const uint num_tasks,
                                const RobotTaskPoseMap &rtpm) {
+  // for lazily computed keyframes, this does not compute anything yet.
+  const std::vector<RobotTaskPair> candidates = rtpm.candidates();
+
   std::vector<std::deque<RobotTaskPair>> sequence_of_primitives;
   for (uint i=0; i<num_tasks; ++i){
     // extract available primitives and choose one
     spdlog::info("Collecting available robots for obj {}", i+1);
     std::vector<RobotTaskPair> available_primitives_for_object;
-    for (const auto &e: rtpm){
+    for (const auto &rtp: candidates){
       // we filter out pick_pick_2, because it is the second action of a 
       // primitive
-      if (e.first.task.object == i &&
-          e.first.task.type != PrimitiveType::pick_pick_2) {
-        available_primitives_for_object.push_back(e.first);
+      if (rtp.task.object == i &&
+          rtp.task.type != PrimitiveType::pick_pick_2) {
+        available_primitives_for_object.push_back(rtp);
+      }
+    }
+
+    // choose a random primitive, and make sure that it is actually feasible
+    bool found_primitive = false;
+    RobotTaskPair primitive;
+    while (available_primitives_for_object.size() > 0) {
+      const uint primitive_index =
+          std::rand() % available_primitives_for_object.size();
+      primitive = available_primitives_for_object[primitive_index];
+
+      if (rtpm.count(primitive) > 0) {
+        found_primitive = true;
+        break;
       }
+
+      available_primitives_for_object.erase(
+          available_primitives_for_object.begin() + primitive_index);
     }
 
-    if (available_primitives_for_object.size() == 0){
+    if (!found_primitive){
       spdlog::error("No primitive available for obj {}", i+1);
       return {};
     }
 
-    const uint primitive_index = std::rand() % available_primitives_for_object.size();
-    const RobotTaskPair& primitive = available_primitives_for_object[primitive_index];
-
     if (primitive.task.type != PrimitiveType::pick_pick_1){
       sequence_of_primitives.push_back({primitive});
       // sequence_of_primitives.back().push_back(primitive);
     }
     else{
       sequence_of_primitives.push_back({primitive});
-      // search for pick_pick_2 and add it
-      for (const auto &rtp : rtpm) {
-        auto robots = rtp.first.robots;
-        if (rtp.first.task.object == i &&
-            robots[0] == primitive.robots[0] &&
-            robots[1] == primitive.robots[1] &&
-            rtp.first.task.type == PrimitiveType::pick_pick_2) {
-          sequence_of_primitives.back().push_back(rtp.first);
-        }
+      // add pick_pick_2
+      RobotTaskPair second_part = primitive;
+      second_part.task.type = PrimitiveType::pick_pick_2;
+      if (rtpm.count(second_part) > 0) {
+        sequence_of_primitives.back().push_back(second_part);
       }
     }
   }
 
+  // orderings that contain a task that is known to fail in its situation are
+  // rejected, as long as there are attempts left
+  const uint max_ordering_attempts = 10;
   OrderedTaskSequence seq;
-  while(sequence_of_primitives.size() > 0){
-    const uint ind = std::rand() % sequence_of_primitives.size();
-    seq.push_back(sequence_of_primitives[ind].front());
-    sequence_of_primitives[ind].pop_front();
-
-    if (sequence_of_primitives[ind].size() == 0){
-      // delete element from vector
-      sequence_of_primitives.erase(sequence_of_primitives.begin() + ind);
+  for (uint attempt = 0; attempt < max_ordering_attempts; ++attempt) {
+    auto remaining_primitives = sequence_of_primitives;
+
+    seq.clear();
+    while(remaining_primitives.size() > 0){
+      const uint ind = std::rand() % remaining_primitives.size();
+      seq.push_back(remaining_primitives[ind].front());
+      remaining_primitives[ind].pop_front();
+
+      if (remaining_primitives[ind].size() == 0){
+        // delete element from vector
+        remaining_primitives.erase(remaining_primitives.begin() + ind);
+      }
+    }
+
+    if (!global_params.use_nogood_store || !get_nogood_store().contains(seq)) {
+      break;
     }
   }
 
@@ -220,14 +320,16 @@ generate_alternating_random_sequence(const std::vector<Robot> &robots,
   return seq;
 }
 
-OrderedTaskSequence generate_alternating_greedy_sequence(
+// Greedily assigns the closest task to the robots in turn, starting with the
+// robot with index first_robot.
+OrderedTaskSequence generate_alternating_greedy_sequence_from(
     const std::vector<Robot> &robots, const uint num_tasks,
-    const RobotTaskPoseMap &rtpm, const std::unordered_map<Robot, arr> &home_poses) {
+    const RobotTaskPoseMap &rtpm, const std::unordered_map<Robot, arr> &home_poses,
+    const uint first_robot) {
   std::cout << "Generating alternating greedy" << std::endl;
   auto available_tasks = straightPerm(num_tasks);
 
-  // sample starting_ robot.
-  uint r = rand() % robots.size();
+  uint r = first_robot;
   std::unordered_map<Robot, arr> poses = home_poses;
 
   const uint max_iter = 1000;
@@ -282,6 +384,26 @@ OrderedTaskSequence generate_alternating_greedy_sequence(
   return seq;
 }
 
+OrderedTaskSequence generate_alternating_greedy_sequence(
+    const std::vector<Robot> &robots, const uint num_tasks,
+    const RobotTaskPoseMap &rtpm, const std::unordered_map<Robot, arr> &home_poses) {
+  // sample starting_ robot.
+  const uint r = rand() % robots.size();
+  return generate_alternating_greedy_sequence_from(robots, num_tasks, rtpm,
+                                                   home_poses, r);
+}
+
+// Variant that draws the starting robot from the given random number
+// generator instead of the global one.
+OrderedTaskSequence generate_alternating_greedy_sequence(
+    const std::vector<Robot> &robots, const uint num_tasks,
+    const RobotTaskPoseMap &rtpm, const std::unordered_map<Robot, arr> &home_poses,
+    std::mt19937 &rng) {
+  std::uniform_int_distribution<uint> dist(0, robots.size() - 1);
+  return generate_alternating_greedy_sequence_from(robots, num_tasks, rtpm,
+                                                   home_poses, dist(rng));
+}
+
 OrderedTaskSequence make_handover_sequence(const std::vector<Robot> &robots,
                                            const uint num_tasks,
                                            const RobotTaskPoseMap &rtpm, const uint max_attempts = 100) {
@@ -2,13 +2,398 @@
 
 #include "../planners/prioritized_planner.h"
 #include "planners/plan.h"
+#include "search_monitor.h"
 #include "search_util.h"
 #include "sequencing.h"
+#include "transposition_table.h"
 
 #include "common/config.h"
 
+#include <algorithm>
+#include <random>
+
+// Blame of a task of the sequence, computed from the timing of a plan:
+// - wait: time steps in which one of the robots that execute the task stands
+//   still, or waits before it can start with the task.
+// - idle: the time the other robots are idle at the end of the plan, since
+//   the robot that finishes last is busy with this task. Distributed over the
+//   tasks of the last robot proportionally to their duration.
+struct TaskBlame {
+  double wait = 0.;
+  double idle = 0.;
+
+  double total() const { return wait + idle; }
+};
+
+// index of the element of the sequence that a part of the plan belongs to.
+// Exits are attributed to the task that they follow.
+int get_sequence_index(const OrderedTaskSequence &seq, const TaskPart &part) {
+  for (uint i = 0; i < seq.size(); ++i) {
+    if (seq[i].task.object == part.task_index &&
+        seq[i].task.type == part.primitive_type) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+std::vector<TaskBlame> compute_task_blame(const OrderedTaskSequence &seq,
+                                          const Plan &plan) {
+  std::vector<TaskBlame> blame(seq.size());
+  if (plan.empty()) {
+    return blame;
+  }
+
+  const double makespan = get_makespan_from_plan(plan);
+
+  Robot last_robot;
+  double idle_time = 0.;
+  double min_finishing_time = makespan;
+  for (const auto &p : plan) {
+    const double finishing_time = p.second.back().t(-1);
+    idle_time += makespan - finishing_time;
+    min_finishing_time = std::min(min_finishing_time, finishing_time);
+    if (finishing_time >= makespan) {
+      last_robot = p.first;
+    }
+  }
+
+  for (const auto &p : plan) {
+    double prev_end_time = 0.;
+    for (const auto &part : p.second) {
+      const int index = get_sequence_index(seq, part);
+      if (index >= 0 && part.t.N > 0) {
+        // waiting for the start of the task
+        blame[index].wait += std::max(0., part.t(0) - prev_end_time);
+
+        // standing still during the task
+        for (uint k = 0; k + 1 < part.path.d0; ++k) {
+          if (absMax(part.path[k + 1] - part.path[k]) < 1e-6) {
+            blame[index].wait += 1.;
+          }
+        }
+      }
+
+      if (part.t.N > 0) {
+        prev_end_time = part.t(-1);
+      }
+    }
+  }
+
+  // only the tasks of the last robot are responsible for the idle time
+  if (plan.count(last_robot) > 0 && makespan > min_finishing_time) {
+    const auto &parts = plan.at(last_robot);
+    double busy_time = 0.;
+    for (const auto &part : parts) {
+      if (!part.is_exit && part.t.N > 0) {
+        busy_time += part.t(-1) - part.t(0);
+      }
+    }
+
+    for (const auto &part : parts) {
+      const int index = get_sequence_index(seq, part);
+      if (index < 0 || part.is_exit || part.t.N == 0 || busy_time <= 0) {
+        continue;
+      }
+      blame[index].idle +=
+          idle_time * (part.t(-1) - part.t(0)) / busy_time;
+    }
+  }
+
+  return blame;
+}
+
+// the second part of a pick-pick has to come after its first part
+bool pick_picks_are_ordered(const OrderedTaskSequence &seq) {
+  std::vector<uint> started;
+  for (const auto &s : seq) {
+    if (s.task.type == PrimitiveType::pick_pick_1) {
+      started.push_back(s.task.object);
+    } else if (s.task.type == PrimitiveType::pick_pick_2 &&
+               std::find(started.begin(), started.end(), s.task.object) ==
+                   started.end()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+uint get_first_changed_index(const OrderedTaskSequence &a,
+                             const OrderedTaskSequence &b) {
+  const uint n = std::min(a.size(), b.size());
+  for (uint i = 0; i < n; ++i) {
+    if (!(a[i] == b[i])) {
+      return i;
+    }
+  }
+  return n;
+}
+
+// Modifications of the sequence that address the blame of the task at the
+// given index, the most promising ones first: tasks that make the other robots
+// idle are handed to the robot that finishes first, tasks that wait are moved
+// to an earlier position.
+std::vector<OrderedTaskSequence>
+prioritize_task(const OrderedTaskSequence &seq, const uint index,
+                const TaskBlame &blame, const Plan &plan,
+                const RobotTaskPoseMap &rtpm, const uint max_shift = 3) {
+  std::vector<OrderedTaskSequence> moves;
+
+  for (uint k = 1; k <= max_shift && k <= index; ++k) {
+    OrderedTaskSequence new_seq = seq;
+    const auto rtp = new_seq[index];
+    new_seq.erase(new_seq.begin() + index);
+    new_seq.insert(new_seq.begin() + index - k, rtp);
+    moves.push_back(new_seq);
+  }
+  if (index + 1 < seq.size()) {
+    OrderedTaskSequence new_seq = seq;
+    std::swap(new_seq[index], new_seq[index + 1]);
+    moves.push_back(new_seq);
+  }
+
+  std::vector<OrderedTaskSequence> reassignments;
+  if (seq[index].task.type == PrimitiveType::pick) {
+    std::vector<std::pair<double, Robot>> robots_by_finishing_time;
+    for (const auto &p : plan) {
+      robots_by_finishing_time.push_back({p.second.back().t(-1), p.first});
+    }
+    std::sort(robots_by_finishing_time.begin(), robots_by_finishing_time.end(),
+              [](const std::pair<double, Robot> &a,
+                 const std::pair<double, Robot> &b) {
+                return a.first < b.first;
+              });
+
+    for (const auto &e : robots_by_finishing_time) {
+      if (e.second == seq[index].robots[0]) {
+        continue;
+      }
+      OrderedTaskSequence new_seq = seq;
+      new_seq[index].robots = {e.second};
+      if (rtpm.count(new_seq[index]) > 0) {
+        reassignments.push_back(new_seq);
+      }
+    }
+  }
+
+  if (blame.idle > blame.wait) {
+    reassignments.insert(reassignments.end(), moves.begin(), moves.end());
+    moves = reassignments;
+  } else {
+    moves.insert(moves.end(), reassignments.begin(), reassignments.end());
+  }
+
+  std::vector<OrderedTaskSequence> res;
+  for (const auto &m : moves) {
+    if (pick_picks_are_ordered(m)) {
+      res.push_back(m);
+    }
+  }
+  return res;
+}
+
+// Squeaky wheel optimization: construct a plan, blame the tasks by the waiting
+// and idle times in the plan, and modify the sequence at the tasks with the
+// highest blame. Only the part of the sequence from the first changed task on
+// is replanned. Once no modification of the most blamed tasks improves the
+// makespan, the best sequence is perturbed randomly, and the loop starts
+// again. max_iterations is the number of calls to the planner, and of
+// constructed sequences that were skipped as they are known already.
 Plan plan_multiple_arms_squeaky_wheel(
     rai::Configuration &C, const RobotTaskPoseMap &rtpm,
-    const std::unordered_map<Robot, arr> &home_poses) {
-  return {};
-}
\ No newline at end of file
+    const std::unordered_map<Robot, arr> &home_poses,
+    const uint max_iterations = 1000, TranspositionTable *tt = nullptr) {
+  const uint num_blamed_tasks = 3;
+  const uint num_perturbations = 2;
+
+  std::time_t t = std::time(nullptr);
+  std::tm tm = *std::localtime(&t);
+
+  std::stringstream buffer;
+  buffer << "squeaky_wheel_" << std::put_time(&tm, "%Y%m%d_%H%M%S");
+
+  std::vector<Robot> robots;
+  for (const auto &element : home_poses) {
+    robots.push_back(element.first);
+  }
+  uint num_tasks = 0;
+  for (auto f : C.frames) {
+    if (f->name.contains("obj")) {
+      num_tasks += 1;
+    }
+  }
+
+  SearchMonitor monitor(buffer.str());
+  monitor.enable_sample_logging(rtpm, home_poses);
+
+  std::random_device rd;
+  std::mt19937 rng(rd());
+
+  auto start_time = std::chrono::high_resolution_clock::now();
+
+  Plan best_plan;
+  OrderedTaskSequence best_seq;
+  double best_makespan = 1e6;
+
+  uint iter = 0;
+  uint num_full_replans = 0;
+  uint num_partial_replans = 0;
+
+  // plans the sequence from start_index on, and returns the result of the
+  // planner, or an unplanned result if the sequence can be skipped. Planning
+  // is aborted once the makespan can not beat makespan_to_beat anymore.
+  auto evaluate = [&](const OrderedTaskSequence &seq, const uint start_index,
+                      const Plan &prev_plan, const double makespan_to_beat) {
+    PlanResult res(PlanStatus::unplanned);
+    if (tt != nullptr && tt->can_skip(seq, makespan_to_beat)) {
+      monitor.add_skipped();
+      return res;
+    }
+
+    ++iter;
+    if (prev_plan.empty() || start_index == 0) {
+      ++num_full_replans;
+      res = plan_multiple_arms_given_sequence(C, rtpm, seq, home_poses,
+                                              makespan_to_beat, true);
+    } else {
+      ++num_partial_replans;
+      res = plan_multiple_arms_given_subsequence_and_prev_plan(
+          C, rtpm, seq, start_index, prev_plan, home_poses, makespan_to_beat,
+          true);
+    }
+
+    if (tt != nullptr) {
+      tt->store(seq, res, makespan_to_beat);
+    }
+    monitor.add(res, seq);
+
+    if (res.status == PlanStatus::success) {
+      const auto end_time = std::chrono::high_resolution_clock::now();
+      const auto duration =
+          std::chrono::duration_cast<std::chrono::milliseconds>(end_time -
+                                                                start_time)
+              .count();
+      export_plan(C, robots, home_poses, res.plan, seq, buffer.str(), iter,
+                  duration);
+    }
+    return res;
+  };
+
+  auto search_is_done = [&]() {
+    return iter >= max_iterations || search_is_cancelled();
+  };
+
+  uint num_constructions = 0;
+  while (!search_is_done()) {
+    // construct
+    OrderedTaskSequence seq;
+    if (best_seq.empty()) {
+      seq = generate_alternating_greedy_sequence(robots, num_tasks, rtpm,
+                                                 home_poses, rng);
+    } else {
+      seq = best_seq;
+      for (uint k = 0; k < num_perturbations; ++k) {
+        seq = neighbour(seq, robots, rng);
+      }
+    }
+    ++num_constructions;
+
+    if (!sequence_is_feasible(seq, rtpm) || !pick_picks_are_ordered(seq)) {
+      // count the attempt, such that the search terminates even if no
+      // feasible sequence is generated
+      ++iter;
+      continue;
+    }
+
+    const PlanResult initial = evaluate(seq, 0, {}, 1e6);
+    if (initial.status == PlanStatus::unplanned) {
+      // the sequence is known already. Count the construction, otherwise the
+      // search does not terminate once all perturbations are known.
+      ++iter;
+      continue;
+    }
+    if (initial.status != PlanStatus::success) {
+      continue;
+    }
+
+    Plan plan = initial.plan;
+    double makespan = get_makespan_from_plan(plan);
+
+    // analyze and prioritize until no modification improves the plan
+    bool improved = true;
+    while (improved && !search_is_done()) {
+      improved = false;
+
+      const auto blame = compute_task_blame(seq, plan);
+      std::vector<uint> indices;
+      for (uint i = 0; i < seq.size(); ++i) {
+        if (blame[i].total() > 0) {
+          indices.push_back(i);
+        }
+      }
+      std::sort(indices.begin(), indices.end(), [&](const uint a, const uint b) {
+        return blame[a].total() > blame[b].total();
+      });
+      if (indices.size() > num_blamed_tasks) {
+        indices.resize(num_blamed_tasks);
+      }
+
+      for (const uint i : indices) {
+        spdlog::info("Task {} (obj {}): blame {} wait, {} idle", i,
+                     seq[i].task.object, blame[i].wait, blame[i].idle);
+
+        for (const auto &new_seq :
+             prioritize_task(seq, i, blame[i], plan, rtpm)) {
+          if (search_is_done()) {
+            break;
+          }
+          if (!sequence_is_feasible(new_seq, rtpm)) {
+            continue;
+          }
+
+          if (compute_lb_for_sequence(new_seq, rtpm, home_poses) >= makespan) {
+            monitor.add_skipped();
+            continue;
+          }
+
+          const PlanResult res =
+              evaluate(new_seq, get_first_changed_index(seq, new_seq), plan,
+                       makespan);
+          if (res.status != PlanStatus::success) {
+            continue;
+          }
+
+          const double new_makespan = get_makespan_from_plan(res.plan);
+          if (new_makespan < makespan) {
+            spdlog::info("Improved makespan from {} to {}", makespan,
+                         new_makespan);
+            seq = new_seq;
+            plan = res.plan;
+            makespan = new_makespan;
+            improved = true;
+            break;
+          }
+        }
+
+        if (improved) {
+          break;
+        }
+      }
+    }
+
+    if (makespan < best_makespan) {
+      best_makespan = makespan;
+      best_plan = plan;
+      best_seq = seq;
+    }
+  }
+
+  spdlog::info("Squeaky wheel search: {} constructions, {} full and {} "
+               "partial replans, best makespan {}",
+               num_constructions, num_full_replans, num_partial_replans,
+               best_makespan);
+
+  monitor.finish(C, robots, home_poses);
+
+  return best_plan;
+}
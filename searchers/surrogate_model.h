@@ -0,0 +1,355 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include <cmath>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "json/json.h"
+
+#include "planners/plan.h"
+#include "search_util.h"
+
+// Cheap features of a sequence, computed from the keyframes only. The
+// PoseModel is the same as for the lower bound, i.e. the features can be
+// computed from the joint states, or from the precomputed distance table.
+namespace surrogate {
+const uint num_features = 9;
+
+template <typename PoseModel>
+std::vector<double> compute_features(const OrderedTaskSequence &seq,
+                                     const PoseModel &model,
+                                     const std::vector<Robot> &robots) {
+  std::vector<double> features(num_features, 0.);
+  features[0] = 1.;
+
+  MakespanLowerBoundT<PoseModel> lb(model, robots);
+  for (const auto &rtp : seq) {
+    if (!lb.add(rtp)) {
+      return {};
+    }
+  }
+
+  double max_busy_time = 0.;
+  uint num_robots_used = 0;
+  for (const auto &r : robots) {
+    const double busy_time = lb.get_busy_time(r);
+    max_busy_time = std::max(max_busy_time, busy_time);
+    if (busy_time > 0) {
+      ++num_robots_used;
+    }
+  }
+
+  uint num_handovers = 0;
+  uint num_pick_picks = 0;
+  uint num_robot_switches = 0;
+  for (uint i = 0; i < seq.size(); ++i) {
+    if (seq[i].task.type == PrimitiveType::handover) {
+      ++num_handovers;
+    } else if (seq[i].task.type == PrimitiveType::pick_pick_1) {
+      ++num_pick_picks;
+    }
+    if (i > 0 && seq[i].robots[0] != seq[i - 1].robots[0]) {
+      ++num_robot_switches;
+    }
+  }
+
+  features[1] = lb.get_makespan();
+  features[2] = lb.get_total_busy_time();
+  features[3] = max_busy_time;
+  features[4] = num_handovers;
+  features[5] = num_pick_picks;
+  features[6] = num_robots_used;
+  features[7] = num_robot_switches;
+  features[8] = seq.size();
+
+  return features;
+}
+
+std::vector<double>
+compute_features(const OrderedTaskSequence &seq, const RobotTaskPoseMap &rtpm,
+                 const std::unordered_map<Robot, arr> &home_poses) {
+  std::vector<Robot> robots;
+  for (const auto &e : home_poses) {
+    robots.push_back(e.first);
+  }
+  const JointPoseModel model(rtpm, home_poses);
+  return compute_features(seq, model, robots);
+}
+
+// solves A x = b with gaussian elimination and partial pivoting, A is n x n
+// and stored row major.
+std::vector<double> solve_linear_system(std::vector<double> A,
+                                        std::vector<double> b) {
+  const uint n = b.size();
+  for (uint c = 0; c < n; ++c) {
+    uint pivot = c;
+    for (uint r = c + 1; r < n; ++r) {
+      if (std::fabs(A[r * n + c]) > std::fabs(A[pivot * n + c])) {
+        pivot = r;
+      }
+    }
+    for (uint k = 0; k < n; ++k) {
+      std::swap(A[c * n + k], A[pivot * n + k]);
+    }
+    std::swap(b[c], b[pivot]);
+
+    if (std::fabs(A[c * n + c]) < 1e-12) {
+      continue;
+    }
+
+    for (uint r = c + 1; r < n; ++r) {
+      const double f = A[r * n + c] / A[c * n + c];
+      for (uint k = c; k < n; ++k) {
+        A[r * n + k] -= f * A[c * n + k];
+      }
+      b[r] -= f * b[c];
+    }
+  }
+
+  std::vector<double> x(n, 0.);
+  for (int r = n - 1; r >= 0; --r) {
+    if (std::fabs(A[r * n + r]) < 1e-12) {
+      continue;
+    }
+    double sum = b[r];
+    for (uint k = r + 1; k < n; ++k) {
+      sum -= A[r * n + k] * x[k];
+    }
+    x[r] = sum / A[r * n + r];
+  }
+  return x;
+}
+
+double dot(const std::vector<double> &a, const std::vector<double> &b) {
+  double res = 0.;
+  for (uint i = 0; i < a.size(); ++i) {
+    res += a[i] * b[i];
+  }
+  return res;
+}
+
+double sigmoid(const double x) { return 1. / (1. + std::exp(-x)); }
+} // namespace surrogate
+
+struct SurrogateSample {
+  std::vector<double> features;
+  PlanStatus status;
+  double makespan;
+};
+
+// Linear model of the makespan (ridge regression) and logistic model of the
+// probability that planning a sequence fails, on standardized features.
+// Prediction is a dot product, i.e. the cost is dominated by the feature
+// computation.
+class SurrogateModel {
+public:
+  bool is_trained() const { return trained; }
+
+  double predict_makespan(const std::vector<double> &features) const {
+    return surrogate::dot(w_makespan, standardize(features));
+  }
+
+  double predict_failure_probability(const std::vector<double> &features) const {
+    return surrogate::sigmoid(
+        surrogate::dot(w_failure, standardize(features)));
+  }
+
+  // score to order candidates by, lower is better. The predicted makespan is
+  // never smaller than the lower bound, and is penalized with the probability
+  // that the sequence can not be planned.
+  double score(const std::vector<double> &features) const {
+    if (features.empty()) {
+      return std::numeric_limits<double>::infinity();
+    }
+    const double makespan = std::max(features[1], predict_makespan(features));
+    const double p_success =
+        std::max(0.05, 1. - predict_failure_probability(features));
+    return makespan / p_success;
+  }
+
+  void train(const std::vector<SurrogateSample> &all_samples,
+             const double regularization = 1e-3) {
+    const uint n = surrogate::num_features;
+
+    // an aborted sample only shows that the makespan exceeds the bound at the
+    // time it was planned: it is neither a failure, nor is its makespan known
+    std::vector<SurrogateSample> samples;
+    for (const auto &s : all_samples) {
+      if (s.status != PlanStatus::aborted) {
+        samples.push_back(s);
+      }
+    }
+
+    if (samples.empty()) {
+      spdlog::error("No samples to train the surrogate model.");
+      return;
+    }
+
+    // standardization of all features but the bias
+    mean.assign(n, 0.);
+    stddev.assign(n, 1.);
+    for (uint i = 1; i < n; ++i) {
+      double sum = 0.;
+      double sq_sum = 0.;
+      for (const auto &s : samples) {
+        sum += s.features[i];
+        sq_sum += s.features[i] * s.features[i];
+      }
+      mean[i] = sum / samples.size();
+      const double var = sq_sum / samples.size() - mean[i] * mean[i];
+      stddev[i] = var > 1e-12 ? std::sqrt(var) : 1.;
+    }
+
+    // makespan: ridge regression on the successful samples
+    std::vector<double> A(n * n, 0.);
+    std::vector<double> b(n, 0.);
+    uint num_successful = 0;
+    for (const auto &s : samples) {
+      if (s.status != PlanStatus::success) {
+        continue;
+      }
+      ++num_successful;
+      const auto x = standardize(s.features);
+      for (uint i = 0; i < n; ++i) {
+        for (uint j = 0; j < n; ++j) {
+          A[i * n + j] += x[i] * x[j];
+        }
+        b[i] += x[i] * s.makespan;
+      }
+    }
+    for (uint i = 0; i < n; ++i) {
+      A[i * n + i] += regularization * std::max(1u, num_successful);
+    }
+    w_makespan = surrogate::solve_linear_system(A, b);
+
+    // failure: logistic regression with gradient descent
+    w_failure.assign(n, 0.);
+    const double learning_rate = 0.5;
+    for (uint iter = 0; iter < 500; ++iter) {
+      std::vector<double> grad(n, 0.);
+      for (const auto &s : samples) {
+        const auto x = standardize(s.features);
+        const double y = s.status == PlanStatus::failed ? 1. : 0.;
+        const double err = surrogate::sigmoid(surrogate::dot(w_failure, x)) - y;
+        for (uint i = 0; i < n; ++i) {
+          grad[i] += err * x[i] / samples.size();
+        }
+      }
+      for (uint i = 0; i < n; ++i) {
+        w_failure[i] -= learning_rate * (grad[i] + regularization * w_failure[i]);
+      }
+    }
+
+    trained = true;
+
+    double abs_error = 0.;
+    for (const auto &s : samples) {
+      if (s.status == PlanStatus::success) {
+        abs_error += std::fabs(predict_makespan(s.features) - s.makespan);
+      }
+    }
+    spdlog::info("Trained surrogate model on {} samples ({} successful), mean "
+                 "absolute makespan error {:.2f}",
+                 samples.size(), num_successful,
+                 abs_error / std::max(1u, num_successful));
+  }
+
+  void save(const std::string &path) const {
+    json data;
+    data["num_features"] = surrogate::num_features;
+    data["mean"] = mean;
+    data["stddev"] = stddev;
+    data["w_makespan"] = w_makespan;
+    data["w_failure"] = w_failure;
+
+    std::ofstream f(path);
+    f << std::setw(2) << data;
+  }
+
+  bool load(const std::string &path) {
+    std::ifstream ifs(path);
+    if (!ifs.good()) {
+      spdlog::error("Could not read surrogate model from {}", path);
+      return false;
+    }
+
+    const json data = json::parse(ifs);
+    if (data["num_features"].get<uint>() != surrogate::num_features) {
+      spdlog::error("Surrogate model at {} uses different features.", path);
+      return false;
+    }
+
+    mean = data["mean"].get<std::vector<double>>();
+    stddev = data["stddev"].get<std::vector<double>>();
+    w_makespan = data["w_makespan"].get<std::vector<double>>();
+    w_failure = data["w_failure"].get<std::vector<double>>();
+    trained = true;
+    return true;
+  }
+
+private:
+  std::vector<double> standardize(const std::vector<double> &features) const {
+    std::vector<double> x(features.size());
+    for (uint i = 0; i < features.size(); ++i) {
+      x[i] = (features[i] - mean[i]) / stddev[i];
+    }
+    return x;
+  }
+
+  bool trained = false;
+
+  std::vector<double> mean;
+  std::vector<double> stddev;
+  std::vector<double> w_makespan;
+  std::vector<double> w_failure;
+};
+
+// model that is used by the searchers if it is trained
+SurrogateModel &get_surrogate_model() {
+  static SurrogateModel model;
+  return model;
+}
+
+// The samples are logged by the SearchMonitor to surrogate_samples.jsonl in the
+// folder of every run. This collects them from all runs below the given path.
+std::vector<SurrogateSample> read_surrogate_samples(const std::string &path) {
+  namespace fs = std::experimental::filesystem;
+
+  std::vector<SurrogateSample> samples;
+  if (!fs::exists(path)) {
+    return samples;
+  }
+
+  for (const auto &entry : fs::recursive_directory_iterator(path)) {
+    if (!fs::is_regular_file(entry.path()) ||
+        entry.path().filename() != "surrogate_samples.jsonl") {
+      continue;
+    }
+
+    std::ifstream ifs(entry.path().string());
+    std::string line;
+    while (std::getline(ifs, line)) {
+      if (line.empty()) {
+        continue;
+      }
+      const json j = json::parse(line);
+      SurrogateSample s;
+      s.features = j["features"].get<std::vector<double>>();
+      s.status = PlanStatus(j["status"].get<int>());
+      s.makespan = j["makespan"].get<double>();
+
+      if (s.features.size() == surrogate::num_features) {
+        samples.push_back(s);
+      }
+    }
+  }
+
+  spdlog::info("Read {} surrogate samples from {}", samples.size(), path);
+  return samples;
+}
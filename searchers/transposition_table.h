@@ -0,0 +1,206 @@
+#pragma once
+
+#include "spdlog/spdlog.h"
+
+#include <fstream>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+
+#include "json/json.h"
+
+#include <Kin/kin.h>
+
+#include "common/cancellation.h"
+#include "planners/plan.h"
+
+// Hash of the parts of the scene that influence the outcome of planning a
+// sequence, i.e. the frames and their shapes. Used to make sure that a
+// persisted table is only reused for the same scene.
+uint64_t compute_scene_hash(const rai::Configuration &C) {
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(4);
+  for (const auto f : C.frames) {
+    ss << f->name << ":";
+    const arr pos = f->getPosition();
+    const arr quat = f->getQuaternion();
+    for (uint i = 0; i < pos.N; ++i) {
+      ss << pos(i) << ",";
+    }
+    for (uint i = 0; i < quat.N; ++i) {
+      ss << quat(i) << ",";
+    }
+    if (f->shape) {
+      const arr size = f->shape->size;
+      for (uint i = 0; i < size.N; ++i) {
+        ss << size(i) << ",";
+      }
+    }
+    ss << ";";
+  }
+  return fnv1a_hash(ss.str());
+}
+
+// Outcomes of all sequences that were evaluated by the planner, shared by the
+// searchers. Sequences are identified by their 64 bit hash only.
+// Additionally, the prefixes of failed sequences are stored: the planner plans
+// the tasks in order, i.e. a sequence that starts with the same tasks up to
+// (and including) the one that could not be planned will fail as well.
+// Since the planner is randomized, a failure does not prove that the prefix is
+// infeasible. Skipping sequences because of their prefix is thus opt-in.
+class TranspositionTable {
+public:
+  struct Entry {
+    PlanStatus status;
+    // the makespan if the plan was successful. If the planning was aborted,
+    // this is the bound that was exceeded.
+    double makespan;
+    int failed_task_index;
+  };
+
+  TranspositionTable(const uint64_t _scene_hash = 0,
+                     const bool _skip_failing_prefixes = false)
+      : scene_hash(_scene_hash),
+        skip_failing_prefixes(_skip_failing_prefixes) {}
+
+  bool lookup(const OrderedTaskSequence &seq, Entry &entry) const {
+    std::lock_guard<std::mutex> lock(m);
+    const auto it = entries.find(hash_sequence(seq));
+    if (it == entries.end()) {
+      return false;
+    }
+    entry = it->second;
+    return true;
+  }
+
+  bool has_failing_prefix(const OrderedTaskSequence &seq) const {
+    if (!skip_failing_prefixes) {
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m);
+    for (const auto h : hash_sequence_prefixes(seq)) {
+      if (failing_prefixes.count(h) > 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // true if planning the sequence can not give us new information, i.e. it was
+  // planned already, it fails because of its prefix, or it was aborted with a
+  // bound that is at least as tight as the given one.
+  bool can_skip(const OrderedTaskSequence &seq,
+                const double makespan_bound = 1e6) {
+    bool skip = false;
+    Entry e;
+    if (lookup(seq, e)) {
+      skip = e.status != PlanStatus::aborted || e.makespan >= makespan_bound;
+    } else {
+      skip = has_failing_prefix(seq);
+    }
+
+    if (skip) {
+      std::lock_guard<std::mutex> lock(m);
+      ++num_hits;
+    }
+    return skip;
+  }
+
+  void store(const OrderedTaskSequence &seq, const PlanResult &res,
+             const double makespan_bound = 1e6) {
+    // planning was interrupted, the result says nothing about the sequence
+    if (res.status != PlanStatus::success && search_is_cancelled()) {
+      return;
+    }
+
+    Entry e{res.status, makespan_bound, res.failed_task_index};
+    if (res.status == PlanStatus::success) {
+      e.makespan = get_makespan_from_plan(res.plan);
+    }
+
+    std::lock_guard<std::mutex> lock(m);
+    entries[hash_sequence(seq)] = e;
+
+    if (res.status == PlanStatus::failed && res.failed_task_index >= 0 &&
+        res.failed_task_index < int(seq.size())) {
+      failing_prefixes.insert(
+          hash_sequence_prefixes(seq)[res.failed_task_index]);
+    }
+  }
+
+  uint size() const {
+    std::lock_guard<std::mutex> lock(m);
+    return entries.size();
+  }
+
+  void log_statistics() const {
+    std::lock_guard<std::mutex> lock(m);
+    spdlog::info("Transposition table: {} sequences, {} failing prefixes, {} "
+                 "skipped evaluations",
+                 entries.size(), failing_prefixes.size(), num_hits);
+  }
+
+  void save(const std::string &path) const {
+    std::lock_guard<std::mutex> lock(m);
+
+    json data;
+    data["scene_hash"] = scene_hash;
+
+    json sequences = json::array();
+    for (const auto &e : entries) {
+      json j;
+      j["hash"] = e.first;
+      j["status"] = int(e.second.status);
+      j["makespan"] = e.second.makespan;
+      j["failed_task_index"] = e.second.failed_task_index;
+      sequences.push_back(j);
+    }
+    data["sequences"] = sequences;
+    data["failing_prefixes"] = failing_prefixes;
+
+    std::ofstream f(path);
+    f << data;
+  }
+
+  // returns false if there is no table at the path, or if it was computed for
+  // a different scene.
+  bool load(const std::string &path) {
+    std::ifstream ifs(path);
+    if (!ifs.good()) {
+      return false;
+    }
+
+    const json data = json::parse(ifs);
+    if (data["scene_hash"].get<uint64_t>() != scene_hash) {
+      spdlog::info("Not loading transposition table from {}, since it belongs "
+                   "to a different scene.",
+                   path);
+      return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m);
+    for (const auto &j : data["sequences"]) {
+      entries[j["hash"].get<uint64_t>()] = {
+          PlanStatus(j["status"].get<int>()), j["makespan"].get<double>(),
+          j["failed_task_index"].get<int>()};
+    }
+    for (const auto &h : data["failing_prefixes"]) {
+      failing_prefixes.insert(h.get<uint64_t>());
+    }
+
+    spdlog::info("Loaded {} sequences from {}", entries.size(), path);
+    return true;
+  }
+
+private:
+  mutable std::mutex m;
+
+  uint64_t scene_hash;
+  bool skip_failing_prefixes;
+  std::unordered_map<uint64_t, Entry> entries;
+  std::unordered_set<uint64_t> failing_prefixes;
+
+  uint num_hits = 0;
+};
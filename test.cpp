@@ -6,7 +6,11 @@
 #include "samplers/sampler.h"
 #include <Kin/featureSymbols.h>
 
+#include "planners/path_validation.h"
+#include "planners/postprocessing.h"
+#include "searchers/search_util.h"
 #include "searchers/sequencing.h"
+#include "searchers/squeaky_wheel_searcher.h"
 
 #include "common/config.h"
 #include "common/env_util.h"
@@ -23,21 +27,11 @@ bool check_plan_validity(rai::Configuration C, const std::vector<Robot> robots,
   const uint makespan = get_makespan_from_plan(plan);
   spdlog::info("Makespan is {}", makespan);
 
-  for (uint t = 0; t < makespan; ++t) {
-    for (const auto &r : robots) {
-      setActive(C, r);
-      arr pose = get_robot_pose_at_time(t, r, home_poses, plan);
-      C.setJointState(pose);
-    }
-
-    ConfigurationProblem cp(C);
-    const auto res = cp.query({}, false);
-
-    if (!res->isFeasible) {
-      spdlog::error("Path is not feasible. Collision at time {}", t);
-      // cp.C.watch(true);
-      return false;
-    }
+  const auto res = validate_plan(C, robots, plan, home_poses);
+  if (!res.is_feasible()) {
+    spdlog::error("Path is not feasible. Collision at time {}, penetration {}",
+                  res.first_infeasible_index, res.penetration);
+    return false;
   }
 
   return true;
@@ -416,6 +410,102 @@ GTEST_TEST(KEYFRAME_TEST, TripleArmHandoverTest) {
   }
 }
 
+GTEST_TEST(KEYFRAME_TEST, LazySingleArmPickPlaceTest) {
+  spdlog::set_level(spdlog::level::off);
+
+  rai::Configuration C;
+  const auto robots = single_robot_configuration(C, true);
+
+  const uint num_objects = 2;
+  shuffled_line(C, num_objects, 0.3, false);
+
+  const auto rtpm =
+      make_lazy_robot_task_pose_map(C, robots, true, false, false);
+
+  // nothing is computed before the keyframes are queried
+  ASSERT_TRUE(rtpm.is_lazy());
+  ASSERT_EQ(rtpm.size(), 0);
+
+  const auto candidates = rtpm.candidates();
+  ASSERT_EQ(candidates.size(), num_objects);
+
+  for (const auto &rtp : candidates) {
+    ASSERT_GT(rtpm.count(rtp), 0);
+
+    for (const arr &pose : rtpm.at(rtp)[0]) {
+      setActive(C, rtp.robots);
+      const arr initial_pose = C.getJointState();
+
+      ConfigurationProblem cp(C);
+      auto res = cp.query(pose);
+      ASSERT_TRUE(res->isFeasible);
+
+      C.setJointState(initial_pose);
+    }
+  }
+
+  ASSERT_EQ(rtpm.size(), num_objects);
+}
+
+// Provider that marks the pairs of odd objects as infeasible, and counts how
+// often it is called.
+class CountingKeyframeProvider : public KeyframeProvider {
+public:
+  CountingKeyframeProvider(const std::vector<RobotTaskPair> &_pairs)
+      : pairs(_pairs) {}
+
+  std::unordered_map<RobotTaskPair, std::vector<TaskPoses>>
+  compute(const RobotTaskPair &rtp) override {
+    ++num_computed;
+    if (rtp.task.object % 2 == 1) {
+      return {};
+    }
+    return {{rtp, {TaskPoses{arr{1. * rtp.task.object}}}}};
+  }
+
+  std::vector<RobotTaskPair> candidates() const override { return pairs; }
+
+  std::vector<RobotTaskPair> pairs;
+  uint num_computed = 0;
+};
+
+GTEST_TEST(UTIL_TEST, LazyKeyframesTest) {
+  const Robot r("a0_", RobotType::ur5, 0.05);
+
+  std::vector<RobotTaskPair> pairs;
+  for (uint i = 0; i < 4; ++i) {
+    pairs.push_back(RobotTaskPair{
+        .robots = {r}, .task = Task{.object = i, .type = PrimitiveType::pick}});
+  }
+
+  auto provider = std::make_shared<CountingKeyframeProvider>(pairs);
+  RobotTaskPoseMap rtpm(provider);
+  const RobotTaskPoseMap copy = rtpm;
+
+  EXPECT_EQ(rtpm.candidates().size(), 4);
+
+  EXPECT_GT(rtpm.count(pairs[0]), 0);
+  EXPECT_EQ(rtpm.count(pairs[1]), 0);
+  EXPECT_EQ(provider->num_computed, 2);
+
+  // the results are memoized, and shared between the copies
+  EXPECT_EQ(copy.at(pairs[0])[0][0](0), 0.);
+  EXPECT_EQ(copy.count(pairs[1]), 0);
+  EXPECT_EQ(provider->num_computed, 2);
+
+  // infeasible pairs are no candidates anymore
+  EXPECT_EQ(rtpm.candidates().size(), 3);
+  EXPECT_EQ(rtpm.size(), 1);
+
+  // iterating only covers the explicitly inserted keyframes
+  uint num_iterated = 0;
+  for (const auto &e : rtpm) {
+    (void)e;
+    ++num_iterated;
+  }
+  EXPECT_EQ(num_iterated, 0);
+}
+
 GTEST_TEST(PLANNING_TEST, SingleArmTest) {
   bool show = false;
   spdlog::set_level(spdlog::level::off);
@@ -469,6 +559,347 @@ GTEST_TEST(UTIL_TEST, SetAndLinkToPhaseTest) {
   // TODO
 }
 
+GTEST_TEST(UTIL_TEST, SegmentCostsTest) {
+  // the second dimension is periodic
+  const std::vector<bool> periodic_dimensions = {false, true};
+
+  arr path(5, 2);
+  for (uint i = 0; i < path.d0; ++i) {
+    path(i, 0) = 0.1 * i;
+    path(i, 1) = RAI_PI - 0.05 + 0.2 * i;
+    path(i, 1) = std::fmod(path(i, 1) + RAI_PI, 2 * RAI_PI) - RAI_PI;
+  }
+  path(2, 0) = 1.;
+
+  SegmentCosts costs(periodic_dimensions, path);
+  EXPECT_NEAR(costs.get_total_cost(), path_length(periodic_dimensions, path),
+              1e-9);
+  EXPECT_NEAR(costs.get_cost(1, 3), 0.9 + 0.7, 1e-9);
+
+  // the periodic dimension takes the short way around
+  const std::vector<bool> mask = {true, true};
+  const arr shortcut = constructShortcutPath(periodic_dimensions, path, 1, 3, mask);
+  EXPECT_NEAR(path_length(periodic_dimensions, shortcut), 0.4, 1e-9);
+
+  for (uint n = 1; n < shortcut.d0; ++n) {
+    path[1 + n] = shortcut[n];
+  }
+  costs.update(path, 1, 3);
+  EXPECT_NEAR(costs.get_cost(1, 3), 0.4, 1e-9);
+  EXPECT_NEAR(costs.get_total_cost(), path_length(periodic_dimensions, path),
+              1e-9);
+}
+
+GTEST_TEST(UTIL_TEST, CarryingIntervalsTest) {
+  const Robot r("a0_", RobotType::ur5, 0.05);
+
+  TaskPart go_to(arr{0., 1., 2.}, zeros(3, 6));
+  go_to.anim.frameNames = {"a0_base", "a0_ee"};
+
+  TaskPart carry(arr{3., 4., 5., 6.}, zeros(4, 6));
+  carry.anim.frameNames = {"a0_base", "a0_ee", "obj1"};
+
+  Plan plan;
+  plan[r] = {go_to, carry};
+
+  const auto intervals = get_carrying_intervals(plan);
+  ASSERT_EQ(intervals.size(), 1u);
+  EXPECT_EQ(intervals[0].first, 3u);
+  EXPECT_EQ(intervals[0].second, 6u);
+}
+
+GTEST_TEST(UTIL_TEST, BisectionOrderTest) {
+  const std::vector<uint> order = get_bisection_order(3, 12);
+  ASSERT_EQ(order.size(), 9);
+
+  // endpoints, midpoint, quarter points
+  EXPECT_EQ(order[0], 3);
+  EXPECT_EQ(order[1], 11);
+  EXPECT_EQ(order[2], 7);
+  EXPECT_EQ(order[3], 5);
+  EXPECT_EQ(order[4], 9);
+
+  std::vector<uint> sorted = order;
+  std::sort(sorted.begin(), sorted.end());
+  for (uint i = 0; i < sorted.size(); ++i) {
+    EXPECT_EQ(sorted[i], 3 + i);
+  }
+
+  EXPECT_TRUE(get_bisection_order(4, 4).empty());
+  EXPECT_EQ(get_bisection_order(4, 5), std::vector<uint>{4});
+}
+
+GTEST_TEST(UTIL_TEST, UR5InverseKinematicsRoundTripTest) {
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<double> dist(-RAI_PI, RAI_PI);
+
+  for (uint i = 0; i < 100; ++i) {
+    arr q(6);
+    for (uint j = 0; j < q.N; ++j) {
+      q(j) = dist(rng);
+    }
+
+    const arr T06 = ur5_ik::forward_kinematics(q);
+    const auto solutions = ur5_ik::inverse_kinematics(T06, q(5));
+
+    bool found = false;
+    for (const arr &sol : solutions) {
+      ASSERT_EQ(sol.N, 6);
+      EXPECT_LT(maxDiff(ur5_ik::forward_kinematics(sol), T06), 1e-6);
+
+      double max_angle_diff = 0.;
+      for (uint j = 0; j < q.N; ++j) {
+        const double diff = std::remainder(sol(j) - q(j), 2 * RAI_PI);
+        max_angle_diff = std::max(max_angle_diff, std::fabs(diff));
+      }
+      if (max_angle_diff < 1e-4) {
+        found = true;
+      }
+    }
+    EXPECT_TRUE(found);
+  }
+}
+
+GTEST_TEST(UTIL_TEST, KeyframeLibraryLoadTest) {
+  spdlog::set_level(spdlog::level::off);
+  const std::string path =
+      (std::experimental::filesystem::temp_directory_path() /
+       "keyframe_library_test.json")
+          .string();
+
+  KeyframeLibrary library;
+  for (uint i = 0; i < 10; ++i) {
+    library.add("pick", arr{1. * i}, arr{1. * i, 2. * i});
+  }
+  library.save(path);
+
+  // the newest entries are kept
+  KeyframeLibrary trimmed;
+  trimmed.max_entries_per_key = 4;
+  ASSERT_TRUE(trimmed.load(path));
+  EXPECT_EQ(trimmed.size(), 4);
+  EXPECT_EQ(trimmed.query("pick", arr{0.})(0), 6.);
+
+  {
+    std::ofstream f(path, std::ios_base::trunc);
+    f << "{\"entries\": {\"pick\": [{\"features\": [1";
+  }
+
+  KeyframeLibrary corrupt;
+  EXPECT_FALSE(corrupt.load(path));
+  EXPECT_EQ(corrupt.size(), 0);
+
+  std::experimental::filesystem::remove(path);
+}
+
+GTEST_TEST(UTIL_TEST, BoxDistanceTest) {
+  const double half[3] = {0.5, 0.25, 0.1};
+
+  const double outside[3] = {1.5, 0., 0.};
+  EXPECT_NEAR(sdf::box_distance(outside, half), 1., 1e-9);
+
+  const double corner[3] = {0.8, 0.65, 0.1};
+  EXPECT_NEAR(sdf::box_distance(corner, half), 0.5, 1e-9);
+
+  const double inside[3] = {0.1, 0., 0.05};
+  EXPECT_NEAR(sdf::box_distance(inside, half), -0.05, 1e-9);
+}
+
+GTEST_TEST(UTIL_TEST, StaticSdfLowerBoundTest) {
+  rai::Configuration C;
+  auto *box = C.addFrame("box");
+  box->setShape(rai::ST_box, {0.6, 0.4, 0.1});
+  box->setPosition({0.1, -0.2, 0.3});
+  box->setQuaternion({0.9239, 0., 0., 0.3827});
+  auto *sphere = C.addFrame("sphere");
+  sphere->setShape(rai::ST_sphere, {0.15});
+  sphere->setPosition({-0.4, 0.3, 0.5});
+
+  const FrameL frames = {box, sphere};
+  const StaticSdf field(frames);
+
+  std::vector<sdf::Shape> shapes;
+  for (auto *f : frames) {
+    shapes.push_back(sdf::make_shape(f));
+  }
+
+  std::mt19937 rng(0);
+  std::uniform_real_distribution<double> dist(-1., 1.);
+  for (uint i = 0; i < 1000; ++i) {
+    const arr p = {dist(rng), dist(rng), 0.4 + dist(rng)};
+
+    double exact = 1e6;
+    for (const auto &s : shapes) {
+      exact = std::min(exact, sdf::shape_distance(s, p.p));
+    }
+    EXPECT_LE(field.get_distance(p), exact + 1e-6);
+  }
+}
+
+GTEST_TEST(UTIL_TEST, LinkSpheresCoverLinkTest) {
+  rai::Configuration C;
+  C.addFrame("box")->setShape(rai::ST_box, {0.5, 0.1, 0.08});
+  C.addFrame("cylinder")->setShape(rai::ST_cylinder, {0.4, 0.05});
+  C.addFrame("capsule")->setShape(rai::ST_capsule, {0.3, 0.04});
+  C.addFrame("sphere")->setShape(rai::ST_sphere, {0.1});
+
+  std::mt19937 rng(0);
+  for (auto *f : C.frames) {
+    const auto spheres = get_link_spheres(f);
+    const sdf::Shape shape = sdf::make_shape(f);
+    const double r = get_bounding_radius(f);
+    std::uniform_real_distribution<double> dist(-r, r);
+
+    // random points inside the shape (the frames are at the origin)
+    uint num_inside = 0;
+    for (uint i = 0; i < 10000 && num_inside < 500; ++i) {
+      const arr p = {dist(rng), dist(rng), dist(rng)};
+      if (sdf::shape_distance(shape, p.p) > 0.) {
+        continue;
+      }
+      ++num_inside;
+
+      bool covered = false;
+      for (const auto &s : spheres) {
+        if (length(p - s.center) <= s.radius + 1e-9) {
+          covered = true;
+          break;
+        }
+      }
+      EXPECT_TRUE(covered) << f->name << " " << p;
+    }
+    EXPECT_GT(num_inside, 0u) << f->name;
+  }
+}
+
+GTEST_TEST(SEARCH_TEST, MakespanLowerBoundTest) {
+  const Robot r1("a0_", RobotType::ur5, 0.1);
+  const Robot r2("a1_", RobotType::ur5, 0.1);
+
+  const std::unordered_map<Robot, arr> home_poses = {{r1, arr{0., 0.}},
+                                                     {r2, arr{0., 0.}}};
+
+  const auto pick_1 = RobotTaskPair{
+      .robots = {r1}, .task = Task{.object = 0, .type = PrimitiveType::pick}};
+  const auto pick_2 = RobotTaskPair{
+      .robots = {r2}, .task = Task{.object = 1, .type = PrimitiveType::pick}};
+  const auto pick_pick_1 =
+      RobotTaskPair{.robots = {r1, r2},
+                    .task = Task{.object = 2, .type = PrimitiveType::pick_pick_1}};
+  const auto pick_pick_2 =
+      RobotTaskPair{.robots = {r1, r2},
+                    .task = Task{.object = 2, .type = PrimitiveType::pick_pick_2}};
+
+  RobotTaskPoseMap rtpm;
+  rtpm[pick_1].push_back({arr{1., 0.}, arr{1., 0.5}});
+  rtpm[pick_2].push_back({arr{0.2, 0.}, arr{0.2, 0.2}});
+  rtpm[pick_pick_1].push_back({arr{0.5, 0.}, arr{0.5, 0.5}});
+  rtpm[pick_pick_2].push_back({arr{0., 0.3}, arr{0., 0.}});
+
+  // r1: 10 + 5 steps, and 10 steps back home
+  EXPECT_EQ(compute_lb_for_sequence({pick_1}, rtpm, home_poses), 25.);
+
+  // the place of r2 can not finish before the place of r1
+  EXPECT_EQ(compute_lb_for_sequence({pick_1, pick_2}, rtpm, home_poses), 25.);
+  EXPECT_EQ(compute_lb_for_sequence({pick_2, pick_1}, rtpm, home_poses), 25.);
+
+  // r2 can only pick 5 steps after r1 placed at the intermediate pose (10),
+  // and needs at least 5 steps to return home
+  EXPECT_EQ(
+      compute_lb_for_sequence({pick_pick_1, pick_pick_2}, rtpm, home_poses),
+      23.);
+
+  // infeasible tasks
+  const auto pick_3 = RobotTaskPair{
+      .robots = {r2}, .task = Task{.object = 0, .type = PrimitiveType::pick}};
+  EXPECT_EQ(compute_lb_for_sequence({pick_3}, rtpm, home_poses),
+            std::numeric_limits<double>::infinity());
+}
+
+GTEST_TEST(SEARCH_TEST, NogoodStoreTest) {
+  const Robot r1("a0_", RobotType::ur5, 0.1);
+
+  const auto pick_1 = RobotTaskPair{
+      .robots = {r1}, .task = Task{.object = 0, .type = PrimitiveType::pick}};
+  const auto pick_2 = RobotTaskPair{
+      .robots = {r1}, .task = Task{.object = 1, .type = PrimitiveType::pick}};
+
+  NogoodStore store(3, 10, 2);
+
+  store.add(pick_2, {0}, 12);
+  EXPECT_TRUE(store.contains(pick_2, {0}, 15));
+  EXPECT_FALSE(store.contains(pick_2, {0}, 25));
+  EXPECT_FALSE(store.contains(pick_2, {}, 15));
+
+  // the sequence check does not know the start time
+  EXPECT_FALSE(store.contains(OrderedTaskSequence{pick_1, pick_2}));
+
+  // failing in a second time bucket rejects the task independent of the time
+  store.add(pick_2, {0}, 35);
+  EXPECT_TRUE(store.contains(pick_2, {0}, 55));
+  EXPECT_TRUE(store.contains(OrderedTaskSequence{pick_1, pick_2}));
+  EXPECT_FALSE(store.contains(OrderedTaskSequence{pick_2, pick_1}));
+
+  // the least recently used entries are evicted
+  store.add(pick_1, {}, 0);
+  store.add(pick_1, {1}, 0);
+  EXPECT_FALSE(store.contains(pick_2, {0}, 12));
+  EXPECT_FALSE(store.contains(OrderedTaskSequence{pick_1, pick_2}));
+}
+
+GTEST_TEST(SEARCH_TEST, SqueakyWheelBlameTest) {
+  const Robot r1("a0_", RobotType::ur5, 0.1);
+  const Robot r2("a1_", RobotType::ur5, 0.1);
+
+  const auto pick_1 = RobotTaskPair{
+      .robots = {r1}, .task = Task{.object = 0, .type = PrimitiveType::pick}};
+  const auto pick_2 = RobotTaskPair{
+      .robots = {r1}, .task = Task{.object = 1, .type = PrimitiveType::pick}};
+  const auto pick_3 = RobotTaskPair{
+      .robots = {r2}, .task = Task{.object = 2, .type = PrimitiveType::pick}};
+
+  auto make_part = [](const uint obj, const double t0,
+                      const std::vector<double> &q) {
+    arr t(q.size());
+    arr path(q.size(), 1);
+    for (uint k = 0; k < q.size(); ++k) {
+      t(k) = t0 + k;
+      path(k, 0) = q[k];
+    }
+    TaskPart part(t, path);
+    part.task_index = obj;
+    part.primitive_type = PrimitiveType::pick;
+    return part;
+  };
+
+  // r1 stands still for two steps during pick_2, which starts 2 steps after
+  // pick_1 ended. r2 is done at t=3, and idles until the end at t=10.
+  Plan plan;
+  plan[r1].push_back(make_part(0, 0, {0., 1., 2., 3.}));
+  plan[r1].push_back(make_part(1, 5, {3., 3., 3., 4., 5., 6.}));
+  plan[r2].push_back(make_part(2, 0, {0., 1., 2., 3.}));
+
+  const auto blame = compute_task_blame({pick_1, pick_2, pick_3}, plan);
+  EXPECT_EQ(blame[0].wait, 0.);
+  EXPECT_EQ(blame[1].wait, 4.);
+  EXPECT_EQ(blame[2].wait, 0.);
+
+  // the idle time of r2 is distributed over the tasks of r1
+  EXPECT_NEAR(blame[0].idle + blame[1].idle, 7., 1e-6);
+  EXPECT_NEAR(blame[0].idle, 7. * 3. / 8., 1e-6);
+  EXPECT_EQ(blame[2].idle, 0.);
+
+  // the second part of a pick-pick can not be moved before the first one
+  const auto pick_pick_1 =
+      RobotTaskPair{.robots = {r1, r2},
+                    .task = Task{.object = 3, .type = PrimitiveType::pick_pick_1}};
+  const auto pick_pick_2 =
+      RobotTaskPair{.robots = {r1, r2},
+                    .task = Task{.object = 3, .type = PrimitiveType::pick_pick_2}};
+  EXPECT_TRUE(pick_picks_are_ordered({pick_pick_1, pick_1, pick_pick_2}));
+  EXPECT_FALSE(pick_picks_are_ordered({pick_pick_2, pick_1, pick_pick_1}));
+}
+
 extern "C" int backtrace(void **buffer, int size) {
     return 0; // Prevent stack trace generation
 }
@@ -4,6 +4,8 @@
 
 #include "../samplers/sampler.h"
 
+#include "planners/path_validation.h"
+
 #include "common/env_util.h"
 #include "common/types.h"
 #include "test_util.h"
@@ -16,20 +18,11 @@ bool check_plan_validity(rai::Configuration C, const std::vector<Robot> robots,
   const uint makespan = get_makespan_from_plan(plan);
   spdlog::info("Makespan is {}", makespan);
 
-  for (uint t = 0; t < makespan; ++t) {
-    for (const auto &r : robots) {
-      setActive(C, r);
-      arr pose = get_robot_pose_at_time(t, r, home_poses, plan);
-      C.setJointState(pose);
-    }
-
-    ConfigurationProblem cp(C);
-    const auto res = cp.query({}, false);
-
-    if (!res->isFeasible) {
-      spdlog::error("Path is not feasible. Collision at time {}", t);
-      return false;
-    }
+  const auto res = validate_plan(C, robots, plan, home_poses);
+  if (!res.is_feasible()) {
+    spdlog::error("Path is not feasible. Collision at time {}, penetration {}",
+                  res.first_infeasible_index, res.penetration);
+    return false;
   }
 
   return true;